@@ -0,0 +1,100 @@
+// Measures the throughput of the ordinary memory pools under the
+// different lock policies, with 1, 4, 16 and 64 threads sharing a
+// single pool. The threads share a fixed amount of work, every one of
+// them repeatedly allocates a burst of entries and releases them in
+// the same order.
+//
+// Output: one CSV line per (policy, threads) pair:
+// policy,threads,ops,seconds,ns_per_op,mops_per_sec
+
+#include <cmempool.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ELEM_SIZE 64
+#define BURST 16
+#define TOTAL_OPS (1 << 22)
+
+static const char* policy_names[] = {
+    "rwlock", "none", "adaptive_mutex", "ticket_spinlock", "mcs", "lock_free",
+};
+
+static const uint32_t thread_counts[] = {1, 4, 16, 64};
+
+static double now_in_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t ops_per_thread = 0;
+
+static void* worker(void* arg) {
+  mempool* mp = (mempool*)arg;
+  void* ptrs[BURST];
+
+  // Every iteration performs 2 * BURST operations.
+  for (uint32_t i = 0; i < ops_per_thread / (2 * BURST); ++i) {
+    for (uint32_t j = 0; j < BURST; ++j) {
+      ptrs[j] = mempool_alloc_entry(mp);
+      if (!ptrs[j]) {
+        abort();
+      }
+    }
+    for (uint32_t j = 0; j < BURST; ++j) {
+      mempool_free_entry(ptrs[j]);
+    }
+  }
+
+  return NULL;
+}
+
+static void run(mempool_lock_policy_t policy, uint32_t thread_count) {
+  mempool_config config = {.lock_policy = policy};
+  mempool* mp =
+      mempool_create_with_config(thread_count * BURST, ELEM_SIZE, &config);
+  if (!mp) {
+    fprintf(stderr, "Failed to create a pool with policy %s\n",
+            policy_names[policy]);
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_t threads[thread_count];
+  ops_per_thread = TOTAL_OPS / thread_count;
+  double start = now_in_seconds();
+  for (uint32_t i = 0; i < thread_count; ++i) {
+    if (pthread_create(&threads[i], NULL, worker, mp) != 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (uint32_t i = 0; i < thread_count; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now_in_seconds() - start;
+
+  uint64_t ops = (uint64_t)thread_count * ops_per_thread;
+  printf("%s,%u,%lu,%.6f,%.2f,%.2f\n", policy_names[policy], thread_count,
+         (unsigned long)ops, elapsed, elapsed * 1e9 / ops, ops / elapsed / 1e6);
+  fflush(stdout);
+
+  mempool_destroy(mp);
+}
+
+int main(void) {
+  printf("policy,threads,ops,seconds,ns_per_op,mops_per_sec\n");
+
+  for (mempool_lock_policy_t policy = lock_policy_rwlock;
+       policy < __lock_policy_end_place_holder; ++policy) {
+    for (uint32_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]);
+         ++i) {
+      if (policy == lock_policy_none && thread_counts[i] > 1) {
+        continue;
+      }
+      run(policy, thread_counts[i]);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+// Single threaded microbenchmarks of the ordinary and the ranged memory
+// pools against glibc malloc. Every run allocates a burst of entries
+// of a given size and releases them in LIFO, FIFO or random order,
+// over and over, until a fixed number of operations is reached.
+//
+// Output: one CSV line per (allocator, order, size) triple:
+// allocator,order,size,ops,seconds,ns_per_op,mops_per_sec
+
+#include <cmempool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BURST 1024
+#define TOTAL_OPS (1 << 21)
+
+static const uint32_t elem_sizes[] = {16, 64, 256, 1024, 4096};
+
+typedef enum free_order_t {
+  order_lifo = 0,
+  order_fifo,
+  order_random
+} free_order_t;
+
+static const char* order_names[] = {"lifo", "fifo", "random"};
+
+// The allocators under test share the following interface, so that
+// every one of them pays for the same indirect calls.
+typedef struct allocator {
+  const char* name;
+  void* (*create)(uint32_t size);
+  void* (*alloc)(void* ctx, uint32_t size);
+  void (*release)(void* entry);
+  void (*destroy)(void* ctx);
+} allocator;
+
+static void* malloc_create(uint32_t size) {
+  (void)size;
+  return (void*)1;  // No context needed
+}
+
+static void* malloc_alloc(void* ctx, uint32_t size) {
+  (void)ctx;
+  return malloc(size);
+}
+
+static void malloc_release(void* entry) { free(entry); }
+
+static void malloc_destroy(void* ctx) { (void)ctx; }
+
+static void* mempool_create_for_policy(uint32_t size,
+                                       mempool_lock_policy_t policy) {
+  mempool_config config = {.lock_policy = policy};
+  return mempool_create_with_config(BURST, size, &config);
+}
+
+static void* mempool_none_create(uint32_t size) {
+  return mempool_create_for_policy(size, lock_policy_none);
+}
+
+static void* mempool_rwlock_create(uint32_t size) {
+  return mempool_create_for_policy(size, lock_policy_rwlock);
+}
+
+static void* mempool_lock_free_create(uint32_t size) {
+  return mempool_create_for_policy(size, lock_policy_lock_free);
+}
+
+static void* mempool_alloc(void* ctx, uint32_t size) {
+  (void)size;
+  return mempool_alloc_entry((mempool*)ctx);
+}
+
+static void mempool_release(void* entry) { _mempool_free_entry(entry); }
+
+static void mempool_destroy_ctx(void* ctx) { _mempool_destroy((mempool*)ctx); }
+
+static void* r_mempool_create_ctx(uint32_t size) {
+  (void)size;
+  // 16 bytes to 4 KiB, with room for a full burst of the largest size.
+  return r_mempool_create(4, 12, 18, fallback_disabled, false);
+}
+
+static void* r_mempool_alloc(void* ctx, uint32_t size) {
+  return r_mempool_alloc_entry((r_mempool*)ctx, size);
+}
+
+static void r_mempool_destroy_ctx(void* ctx) {
+  _r_mempool_destroy((r_mempool*)ctx);
+}
+
+static const allocator allocators[] = {
+    {"malloc", malloc_create, malloc_alloc, malloc_release, malloc_destroy},
+    {"mempool_none", mempool_none_create, mempool_alloc, mempool_release,
+     mempool_destroy_ctx},
+    {"mempool_rwlock", mempool_rwlock_create, mempool_alloc, mempool_release,
+     mempool_destroy_ctx},
+    {"mempool_lock_free", mempool_lock_free_create, mempool_alloc,
+     mempool_release, mempool_destroy_ctx},
+    {"r_mempool", r_mempool_create_ctx, r_mempool_alloc, mempool_release,
+     r_mempool_destroy_ctx},
+};
+
+static double now_in_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t release_order[BURST];
+
+static void prepare_release_order(free_order_t order) {
+  for (uint32_t i = 0; i < BURST; ++i) {
+    release_order[i] = order == order_lifo ? BURST - 1 - i : i;
+  }
+
+  if (order == order_random) {
+    // A fixed seed keeps the runs comparable.
+    uint32_t state = 0x2545f491;
+    for (uint32_t i = BURST - 1; i > 0; --i) {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      uint32_t j = state % (i + 1);
+      uint32_t tmp = release_order[i];
+      release_order[i] = release_order[j];
+      release_order[j] = tmp;
+    }
+  }
+}
+
+static void run(const allocator* alloc, free_order_t order, uint32_t size) {
+  void* ctx = alloc->create(size);
+  if (!ctx) {
+    fprintf(stderr, "Failed to create %s for size %u\n", alloc->name, size);
+    exit(EXIT_FAILURE);
+  }
+
+  static void* ptrs[BURST];
+  prepare_release_order(order);
+
+  // Every iteration performs 2 * BURST operations.
+  uint32_t iterations = TOTAL_OPS / (2 * BURST);
+  double start = now_in_seconds();
+  for (uint32_t i = 0; i < iterations; ++i) {
+    for (uint32_t j = 0; j < BURST; ++j) {
+      ptrs[j] = alloc->alloc(ctx, size);
+      if (!ptrs[j]) {
+        abort();
+      }
+      // Touch the entry, as any real user would.
+      *(volatile uint8_t*)ptrs[j] = (uint8_t)j;
+    }
+    for (uint32_t j = 0; j < BURST; ++j) {
+      alloc->release(ptrs[release_order[j]]);
+    }
+  }
+  double elapsed = now_in_seconds() - start;
+
+  uint64_t ops = (uint64_t)iterations * 2 * BURST;
+  printf("%s,%s,%u,%lu,%.6f,%.2f,%.2f\n", alloc->name, order_names[order],
+         size, (unsigned long)ops, elapsed, elapsed * 1e9 / ops,
+         ops / elapsed / 1e6);
+  fflush(stdout);
+
+  alloc->destroy(ctx);
+}
+
+int main(void) {
+  printf("allocator,order,size,ops,seconds,ns_per_op,mops_per_sec\n");
+
+  for (uint32_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a) {
+    for (free_order_t order = order_lifo; order <= order_random; ++order) {
+      for (uint32_t s = 0; s < sizeof(elem_sizes) / sizeof(elem_sizes[0]);
+           ++s) {
+        run(&allocators[a], order, elem_sizes[s]);
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
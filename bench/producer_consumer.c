@@ -0,0 +1,312 @@
+// Measures the cross-thread release pattern, in which the producer
+// threads allocate entries from a shared pool and hand them over to
+// the consumer threads, which release them. Every producer feeds a
+// ring of its own, and consumer i drains the rings of the producers
+// i, i + consumers, i + 2 * consumers and so on, so there should be
+// at least as many producers as consumers.
+//
+// The latency of every single allocation and release gets recorded in
+// a log-linear (HDR-style) histogram with 32 sub-buckets per power of
+// two, i.e. a relative error of about 3%.
+//
+// Usage: producer_consumer [producers consumers]
+// Without arguments, topologies from 1+1 up to 64+64 threads are run.
+//
+// Output: one CSV line per (pool, topology, operation) triple:
+// pool,producers,consumers,op,ops,seconds,mops_per_sec,p50_ns,p99_ns,
+// p999_ns,max_ns
+
+#include <cmempool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TOTAL_ENTRIES (1 << 20)
+#define RING_SIZE 256
+#define MAX_THREADS 128
+#define R_MEMPOOL_MAX_SIZE 128
+
+// Log-linear histogram
+#define SUB_BUCKET_BITS 5
+#define SUB_BUCKET_HALF (1u << (SUB_BUCKET_BITS - 1))
+#define HISTOGRAM_SIZE (64 * SUB_BUCKET_HALF)
+
+typedef struct histogram {
+  uint64_t counts[HISTOGRAM_SIZE];
+  uint64_t total;
+  uint64_t max;
+} histogram;
+
+static uint32_t histogram_index(uint64_t value) {
+  if (value < (1u << SUB_BUCKET_BITS)) {
+    return (uint32_t)value;
+  }
+
+  // Keep the top SUB_BUCKET_BITS bits of the value.
+  uint32_t shift = 63 - __builtin_clzll(value) - (SUB_BUCKET_BITS - 1);
+  return (shift + 1) * SUB_BUCKET_HALF +
+         (uint32_t)(value >> shift) - SUB_BUCKET_HALF;
+}
+
+static uint64_t histogram_value(uint32_t index) {
+  if (index < (1u << SUB_BUCKET_BITS)) {
+    return index;
+  }
+
+  uint32_t shift = index / SUB_BUCKET_HALF - 1;
+  return (uint64_t)(index % SUB_BUCKET_HALF + SUB_BUCKET_HALF) << shift;
+}
+
+static inline void histogram_record(histogram* h, uint64_t value) {
+  ++h->counts[histogram_index(value)];
+  ++h->total;
+  if (value > h->max) {
+    h->max = value;
+  }
+}
+
+static void histogram_merge(histogram* to, const histogram* from) {
+  for (uint32_t i = 0; i < HISTOGRAM_SIZE; ++i) {
+    to->counts[i] += from->counts[i];
+  }
+  to->total += from->total;
+  if (from->max > to->max) {
+    to->max = from->max;
+  }
+}
+
+static uint64_t histogram_percentile(const histogram* h, double percentile) {
+  uint64_t rank = (uint64_t)(h->total * percentile / 100.0);
+  uint64_t seen = 0;
+
+  for (uint32_t i = 0; i < HISTOGRAM_SIZE; ++i) {
+    seen += h->counts[i];
+    if (seen > rank) {
+      return histogram_value(i);
+    }
+  }
+
+  return h->max;
+}
+
+// Single producer single consumer ring
+typedef struct ring {
+  uint32_t head __attribute__((aligned(64)));  // Written by the consumer
+  uint32_t tail __attribute__((aligned(64)));  // Written by the producer
+  void* entries[RING_SIZE];
+} ring;
+
+static void ring_push(ring* r, void* entry) {
+  uint32_t tail = r->tail;
+  while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+    sched_yield();
+  }
+  r->entries[tail % RING_SIZE] = entry;
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void* ring_pop(ring* r) {
+  uint32_t head = r->head;
+  if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  void* entry = r->entries[head % RING_SIZE];
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  return entry;
+}
+
+typedef struct worker_context {
+  uint32_t index;
+  histogram latencies;
+} worker_context;
+
+static ring rings[MAX_THREADS];
+static worker_context producer_contexts[MAX_THREADS];
+static worker_context consumer_contexts[MAX_THREADS];
+static uint32_t producer_count;
+static uint32_t consumer_count;
+static uint32_t entries_per_producer;
+static mempool* shared_mp;
+static r_mempool* shared_rmp;
+
+static inline uint64_t now_in_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void* producer(void* arg) {
+  worker_context* ctx = (worker_context*)arg;
+  ring* r = &rings[ctx->index];
+  uint32_t state = 0x9e3779b9 ^ ctx->index;
+
+  for (uint32_t i = 0; i < entries_per_producer; ++i) {
+    void* entry = NULL;
+    uint64_t start = 0;
+
+    if (shared_mp) {
+      start = now_in_ns();
+      entry = mempool_alloc_entry(shared_mp);
+    } else {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      uint32_t size = 1 + state % R_MEMPOOL_MAX_SIZE;
+      start = now_in_ns();
+      entry = r_mempool_alloc_entry(shared_rmp, size);
+    }
+    histogram_record(&ctx->latencies, now_in_ns() - start);
+
+    if (!entry) {
+      fprintf(stderr, "The pool got exhausted\n");
+      abort();
+    }
+    *(volatile uint32_t*)entry = i;
+    ring_push(r, entry);
+  }
+
+  return NULL;
+}
+
+static void* consumer(void* arg) {
+  worker_context* ctx = (worker_context*)arg;
+  uint32_t remaining = 0;
+  for (uint32_t i = ctx->index; i < producer_count; i += consumer_count) {
+    remaining += entries_per_producer;
+  }
+
+  while (remaining > 0) {
+    bool idle = true;
+    for (uint32_t i = ctx->index; i < producer_count; i += consumer_count) {
+      void* entry = ring_pop(&rings[i]);
+      if (entry) {
+        uint64_t start = now_in_ns();
+        _mempool_free_entry(entry);
+        histogram_record(&ctx->latencies, now_in_ns() - start);
+        --remaining;
+        idle = false;
+      }
+    }
+    if (idle) {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+static void report(const char* pool_name, const char* op,
+                   const histogram* h, double seconds) {
+  printf("%s,%u,%u,%s,%lu,%.6f,%.2f,%lu,%lu,%lu,%lu\n", pool_name,
+         producer_count, consumer_count, op, (unsigned long)h->total, seconds,
+         h->total / seconds / 1e6,
+         (unsigned long)histogram_percentile(h, 50.0),
+         (unsigned long)histogram_percentile(h, 99.0),
+         (unsigned long)histogram_percentile(h, 99.9), (unsigned long)h->max);
+  fflush(stdout);
+}
+
+static void run(const char* pool_name) {
+  memset(rings, 0, sizeof(rings));
+  memset(producer_contexts, 0, sizeof(producer_contexts));
+  memset(consumer_contexts, 0, sizeof(consumer_contexts));
+  entries_per_producer = TOTAL_ENTRIES / producer_count;
+
+  pthread_t producers[MAX_THREADS];
+  pthread_t consumers[MAX_THREADS];
+
+  uint64_t start = now_in_ns();
+  for (uint32_t i = 0; i < consumer_count; ++i) {
+    consumer_contexts[i].index = i;
+    if (pthread_create(&consumers[i], NULL, consumer,
+                       &consumer_contexts[i]) != 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (uint32_t i = 0; i < producer_count; ++i) {
+    producer_contexts[i].index = i;
+    if (pthread_create(&producers[i], NULL, producer,
+                       &producer_contexts[i]) != 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (uint32_t i = 0; i < producer_count; ++i) {
+    pthread_join(producers[i], NULL);
+  }
+  for (uint32_t i = 0; i < consumer_count; ++i) {
+    pthread_join(consumers[i], NULL);
+  }
+  double seconds = (now_in_ns() - start) / 1e9;
+
+  static histogram allocs;
+  static histogram frees;
+  memset(&allocs, 0, sizeof(allocs));
+  memset(&frees, 0, sizeof(frees));
+  for (uint32_t i = 0; i < producer_count; ++i) {
+    histogram_merge(&allocs, &producer_contexts[i].latencies);
+  }
+  for (uint32_t i = 0; i < consumer_count; ++i) {
+    histogram_merge(&frees, &consumer_contexts[i].latencies);
+  }
+
+  report(pool_name, "alloc", &allocs, seconds);
+  report(pool_name, "free", &frees, seconds);
+}
+
+static void run_topology(uint32_t producers, uint32_t consumers) {
+  producer_count = producers;
+  consumer_count = consumers;
+
+  // Every producer may have a full ring plus one entry in flight.
+  uint32_t in_flight = producers * (RING_SIZE + 1);
+
+  shared_mp = mempool_create(in_flight, R_MEMPOOL_MAX_SIZE, false, false);
+  if (!shared_mp) {
+    exit(EXIT_FAILURE);
+  }
+  run("mempool");
+  mempool_destroy(shared_mp);
+
+  // Every size class should be able to hold all the entries in flight,
+  // the largest one has 1/8 of the elements of the smallest one.
+  uint8_t count_power_of_two = 3;
+  while ((1u << count_power_of_two) < in_flight * 8) {
+    ++count_power_of_two;
+  }
+  shared_rmp = r_mempool_create(4, 7, count_power_of_two, fallback_disabled,
+                                false);
+  if (!shared_rmp) {
+    exit(EXIT_FAILURE);
+  }
+  run("r_mempool");
+  r_mempool_destroy(shared_rmp);
+}
+
+int main(int argc, char** argv) {
+  printf(
+      "pool,producers,consumers,op,ops,seconds,mops_per_sec,p50_ns,p99_ns,"
+      "p999_ns,max_ns\n");
+
+  if (argc == 3) {
+    uint32_t producers = (uint32_t)atoi(argv[1]);
+    uint32_t consumers = (uint32_t)atoi(argv[2]);
+    if (producers == 0 || consumers == 0 || producers > MAX_THREADS ||
+        consumers > producers) {
+      fprintf(stderr,
+              "Expected 1 to %u producers, and up to as many consumers\n",
+              MAX_THREADS);
+      return EXIT_FAILURE;
+    }
+    run_topology(producers, consumers);
+    return EXIT_SUCCESS;
+  }
+
+  for (uint32_t threads = 1; threads <= MAX_THREADS / 2; threads *= 2) {
+    run_topology(threads, threads);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,432 @@
+// Replays an allocation trace, recorded via r_mempool_trace_start(),
+// against glibc malloc and against ranged memory pools of different
+// configurations, so that the pool sizes can be chosen offline.
+//
+// The records get replayed in the recorded order by a single thread.
+// Before the replay, the recorded entry addresses are translated into
+// dense handles, so that the timed loop does nothing but the calls to
+// the allocator under test. The traces are not required to be complete:
+// failed allocations are skipped, so are the releases of entries that
+// were allocated before the recording started, and the reallocations
+// of such entries are replayed as allocations. The whole trace gets
+// replayed over and over until a minimum number of operations is
+// reached, and the entries still alive at the end of a pass are
+// released outside of the timed region.
+//
+// Usage: replay <trace> [smallest largest count]...
+// Every 'smallest largest count' triple describes an r_mempool in terms
+// of the powers of two passed to r_mempool_create(). Without any, the
+// largest size is derived from the trace, and the smallest element
+// count is swept up to the point where nothing fails anymore.
+//
+// Output: one CSV line per allocator:
+// allocator,smallest,largest,count,ops,failures,peak_live,seconds,
+// ns_per_op
+
+#include <cmempool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MIN_TOTAL_OPS (1 << 22)
+#define MAX_POOL_BYTES (1ull << 30)
+#define NO_HANDLE UINT32_MAX
+
+typedef struct replay_op {
+  uint8_t op;  // An r_mempool_trace_op_t
+  uint32_t size;
+  uint32_t handle;
+} replay_op;
+
+static replay_op* ops;
+static uint32_t op_count;
+static uint32_t handle_count;
+static uint32_t peak_live;
+static uint32_t max_size;
+
+// Maps the recorded entry addresses to handles while the trace gets
+// compiled, via open addressing with backward shift deletion.
+typedef struct handle_map {
+  uint64_t* keys;
+  uint32_t* handles;
+  uint32_t mask;
+} handle_map;
+
+static uint32_t handle_map_slot(handle_map* map, uint64_t key) {
+  uint32_t slot = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & map->mask;
+  while (map->keys[slot] != 0 && map->keys[slot] != key) {
+    slot = (slot + 1) & map->mask;
+  }
+  return slot;
+}
+
+static uint32_t handle_map_get(handle_map* map, uint64_t key) {
+  uint32_t slot = handle_map_slot(map, key);
+  return map->keys[slot] ? map->handles[slot] : NO_HANDLE;
+}
+
+static void handle_map_put(handle_map* map, uint64_t key, uint32_t handle) {
+  uint32_t slot = handle_map_slot(map, key);
+  map->keys[slot] = key;
+  map->handles[slot] = handle;
+}
+
+static void handle_map_remove(handle_map* map, uint64_t key) {
+  uint32_t slot = handle_map_slot(map, key);
+  if (!map->keys[slot]) {
+    return;
+  }
+
+  // Move the following entries of the cluster back, if they belong
+  // to a slot at or before the one being emptied.
+  uint32_t next = slot;
+  for (;;) {
+    map->keys[slot] = 0;
+    for (;;) {
+      next = (next + 1) & map->mask;
+      if (!map->keys[next]) {
+        return;
+      }
+      uint32_t home =
+          (uint32_t)((map->keys[next] * 0x9e3779b97f4a7c15ull) >> 32) &
+          map->mask;
+      if (((next - home) & map->mask) >= ((next - slot) & map->mask)) {
+        break;
+      }
+    }
+    map->keys[slot] = map->keys[next];
+    map->handles[slot] = map->handles[next];
+    slot = next;
+  }
+}
+
+static uint32_t* free_handles;
+static uint32_t free_handle_count;
+static uint32_t live_count;
+
+static uint32_t acquire_handle(void) {
+  if (++live_count > peak_live) {
+    peak_live = live_count;
+  }
+  return free_handle_count > 0 ? free_handles[--free_handle_count]
+                               : handle_count++;
+}
+
+static void release_handle(uint32_t handle) {
+  --live_count;
+  free_handles[free_handle_count++] = handle;
+}
+
+static void emit(uint8_t op, uint32_t size, uint32_t handle) {
+  ops[op_count++] = (replay_op){.op = op, .size = size, .handle = handle};
+  if (size > max_size) {
+    max_size = size;
+  }
+}
+
+static void xfail(const char* message) {
+  fprintf(stderr, "%s\n", message);
+  exit(EXIT_FAILURE);
+}
+
+static void compile_trace(const r_mempool_trace_record* records,
+                          uint32_t record_count) {
+  handle_map map;
+  uint32_t capacity = 16;
+  while (capacity < record_count * 2) {
+    capacity *= 2;
+  }
+  map.keys = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+  map.handles = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+  map.mask = capacity - 1;
+
+  // A record may turn into a release followed by an allocation.
+  ops = (replay_op*)malloc(2 * (size_t)record_count * sizeof(replay_op) + 1);
+  free_handles = (uint32_t*)malloc((size_t)record_count * sizeof(uint32_t) + 1);
+  if (!map.keys || !map.handles || !ops || !free_handles) {
+    xfail("Failed to allocate memory for the trace");
+  }
+
+  for (uint32_t i = 0; i < record_count; ++i) {
+    const r_mempool_trace_record* record = &records[i];
+    uint32_t old_handle = NO_HANDLE;
+
+    switch (record->op) {
+      case r_mempool_trace_free:
+        old_handle = handle_map_get(&map, record->entry);
+        if (old_handle != NO_HANDLE) {
+          handle_map_remove(&map, record->entry);
+          release_handle(old_handle);
+          emit(r_mempool_trace_free, 0, old_handle);
+        }
+        continue;
+      case r_mempool_trace_realloc:
+        if (record->old_entry) {
+          old_handle = handle_map_get(&map, record->old_entry);
+        }
+        break;
+      case r_mempool_trace_alloc:
+        break;
+      default:
+        xfail("Unknown operation in the trace");
+    }
+
+    if (!record->entry) {
+      continue;  // Failed, nothing changed hands.
+    }
+
+    // The release of an address that gets handed out again must have
+    // been missed, unless it is being reallocated in place.
+    uint32_t stale = handle_map_get(&map, record->entry);
+    if (stale != NO_HANDLE && stale != old_handle) {
+      handle_map_remove(&map, record->entry);
+      release_handle(stale);
+      emit(r_mempool_trace_free, 0, stale);
+    }
+
+    if (old_handle != NO_HANDLE) {
+      handle_map_remove(&map, record->old_entry);
+      handle_map_put(&map, record->entry, old_handle);
+      emit(r_mempool_trace_realloc, record->size, old_handle);
+    } else {
+      uint32_t handle = acquire_handle();
+      handle_map_put(&map, record->entry, handle);
+      emit(r_mempool_trace_alloc, record->size, handle);
+    }
+  }
+
+  free(map.keys);
+  free(map.handles);
+}
+
+static r_mempool_trace_record* load_trace(const char* path,
+                                          uint32_t* record_count) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    xfail("Failed to open the trace");
+  }
+
+  char magic[8];
+  uint32_t preamble[2];
+  if (fread(magic, sizeof(magic), 1, file) != 1 ||
+      memcmp(magic, R_MEMPOOL_TRACE_MAGIC, sizeof(magic)) != 0 ||
+      fread(preamble, sizeof(preamble), 1, file) != 1 ||
+      preamble[0] != R_MEMPOOL_TRACE_VERSION ||
+      preamble[1] != sizeof(r_mempool_trace_record)) {
+    xfail("Not a trace of a supported version");
+  }
+
+  uint32_t capacity = 1024;
+  uint32_t count = 0;
+  r_mempool_trace_record* records = NULL;
+  for (;;) {
+    records = (r_mempool_trace_record*)realloc(
+        records, (size_t)capacity * sizeof(r_mempool_trace_record));
+    if (!records) {
+      xfail("Failed to allocate memory for the trace");
+    }
+    count += (uint32_t)fread(records + count, sizeof(r_mempool_trace_record),
+                             capacity - count, file);
+    if (count < capacity) {
+      break;
+    }
+    capacity *= 2;
+  }
+  fclose(file);
+
+  *record_count = count;
+  return records;
+}
+
+// The allocators under test share the following interface, so that
+// every one of them pays for the same indirect calls.
+typedef struct allocator {
+  const char* name;
+  void* (*alloc)(void* ctx, uint32_t size);
+  void* (*realloc)(void* ctx, void* entry, uint32_t size);
+  void (*release)(void* entry);
+} allocator;
+
+static void* malloc_alloc(void* ctx, uint32_t size) {
+  (void)ctx;
+  return malloc(size);
+}
+
+static void* malloc_realloc(void* ctx, void* entry, uint32_t size) {
+  (void)ctx;
+  return realloc(entry, size);
+}
+
+static void malloc_release(void* entry) { free(entry); }
+
+static void* r_mempool_alloc(void* ctx, uint32_t size) {
+  return r_mempool_alloc_entry((r_mempool*)ctx, size);
+}
+
+static void* r_mempool_realloc(void* ctx, void* entry, uint32_t size) {
+  return r_mempool_realloc_entry((r_mempool*)ctx, entry, size);
+}
+
+static void r_mempool_release(void* entry) { _r_mempool_free_entry(entry); }
+
+static const allocator malloc_allocator = {"malloc", malloc_alloc,
+                                           malloc_realloc, malloc_release};
+static const allocator r_mempool_allocator = {
+    "r_mempool", r_mempool_alloc, r_mempool_realloc, r_mempool_release};
+
+static double now_in_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the number of failed allocations and reallocations.
+static uint64_t replay(const allocator* alloc, void* ctx, void** ptrs,
+                       double* seconds) {
+  uint64_t failures = 0;
+  uint32_t passes = MIN_TOTAL_OPS / op_count + 1;
+  *seconds = 0;
+
+  for (uint32_t pass = 0; pass < passes; ++pass) {
+    memset(ptrs, 0, (size_t)handle_count * sizeof(void*));
+
+    double start = now_in_seconds();
+    for (uint32_t i = 0; i < op_count; ++i) {
+      const replay_op* op = &ops[i];
+      void** ptr = &ptrs[op->handle];
+
+      if (op->op == r_mempool_trace_free) {
+        if (*ptr) {
+          alloc->release(*ptr);
+          *ptr = NULL;
+        }
+        continue;
+      }
+
+      void* entry = op->op == r_mempool_trace_realloc && *ptr
+                        ? alloc->realloc(ctx, *ptr, op->size)
+                        : alloc->alloc(ctx, op->size);
+      if (entry) {
+        // Touch the entry, as any real user would.
+        *(volatile uint8_t*)entry = (uint8_t)i;
+        *ptr = entry;
+      } else {
+        ++failures;
+      }
+    }
+    *seconds += now_in_seconds() - start;
+
+    for (uint32_t i = 0; i < handle_count; ++i) {
+      if (ptrs[i]) {
+        alloc->release(ptrs[i]);
+      }
+    }
+  }
+
+  return failures / passes;
+}
+
+static void report(const char* name, uint32_t smallest, uint32_t largest,
+                   uint32_t count, uint64_t failures, double seconds) {
+  uint64_t total_ops = (uint64_t)op_count * (MIN_TOTAL_OPS / op_count + 1);
+  printf("%s,%u,%u,%u,%u,%lu,%u,%.6f,%.2f\n", name, smallest, largest, count,
+         op_count, (unsigned long)failures, peak_live, seconds,
+         seconds * 1e9 / total_ops);
+  fflush(stdout);
+}
+
+static void run_malloc(void** ptrs) {
+  double seconds;
+  uint64_t failures = replay(&malloc_allocator, NULL, ptrs, &seconds);
+  report(malloc_allocator.name, 0, 0, 0, failures, seconds);
+}
+
+// Returns the number of failures, or UINT64_MAX if the pool couldn't
+// be created.
+static uint64_t run_r_mempool(void** ptrs, uint8_t smallest, uint8_t largest,
+                              uint8_t count) {
+  // Every pool takes roughly the same amount of memory.
+  uint64_t pool_bytes = (uint64_t)(largest - smallest + 1)
+                        << (smallest + count);
+  if (count > 31 || pool_bytes > MAX_POOL_BYTES) {
+    fprintf(stderr, "Skipping %u %u %u, it would take more than %llu bytes\n",
+            smallest, largest, count, MAX_POOL_BYTES);
+    return UINT64_MAX;
+  }
+
+  r_mempool* rmp =
+      r_mempool_create(smallest, largest, count, fallback_disabled, true);
+  if (!rmp) {
+    fprintf(stderr, "Failed to create an r_mempool of %u %u %u\n", smallest,
+            largest, count);
+    return UINT64_MAX;
+  }
+
+  double seconds;
+  uint64_t failures = replay(&r_mempool_allocator, rmp, ptrs, &seconds);
+  report(r_mempool_allocator.name, smallest, largest, count, failures,
+         seconds);
+  r_mempool_destroy(rmp);
+
+  return failures;
+}
+
+static uint8_t ceil_log2(uint32_t value) {
+  return value <= 1 ? 0 : (uint8_t)(32 - __builtin_clz(value - 1));
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2 || (argc - 2) % 3 != 0) {
+    fprintf(stderr, "Usage: %s <trace> [smallest largest count]...\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  uint32_t record_count = 0;
+  r_mempool_trace_record* records = load_trace(argv[1], &record_count);
+  compile_trace(records, record_count);
+  free(records);
+  if (op_count == 0) {
+    xfail("Nothing to replay");
+  }
+
+  void** ptrs = (void**)malloc((size_t)handle_count * sizeof(void*) + 1);
+  if (!ptrs) {
+    xfail("Failed to allocate memory for the trace");
+  }
+
+  printf(
+      "allocator,smallest,largest,count,ops,failures,peak_live,seconds,"
+      "ns_per_op\n");
+  run_malloc(ptrs);
+
+  if (argc > 2) {
+    for (int i = 2; i < argc; i += 3) {
+      run_r_mempool(ptrs, (uint8_t)atoi(argv[i]), (uint8_t)atoi(argv[i + 1]),
+                    (uint8_t)atoi(argv[i + 2]));
+    }
+  } else {
+    uint8_t smallest = 4;
+    uint8_t largest = ceil_log2(max_size);
+    if (largest <= smallest) {
+      largest = smallest + 1;
+    }
+
+    // Once the largest pool can hold all of the live entries, none of
+    // the allocations can fail.
+    uint8_t last_count = ceil_log2(peak_live) + largest - smallest;
+    for (uint8_t count = largest - smallest; count <= last_count; ++count) {
+      uint64_t failures = run_r_mempool(ptrs, smallest, largest, count);
+      if (failures == 0 || failures == UINT64_MAX) {
+        break;
+      }
+    }
+  }
+
+  free(ptrs);
+  free(ops);
+  free(free_handles);
+
+  return EXIT_SUCCESS;
+}
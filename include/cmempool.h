@@ -52,6 +52,114 @@ mempool *mempool_create(uint32_t elem_count, uint32_t elem_size,
                         bool fallback_to_dynamic_memory,
                         bool will_be_accessed_by_only_one_thread);
 
+// The synchronization mechanism protecting the shared state of a
+// memory pool. The one that fits best depends on the contention,
+// the benchmarks under the 'bench' directory may help with choosing.
+typedef enum mempool_lock_policy_t {
+  // A reader/writer lock, as used by mempool_create, which is kept for
+  // compatibility. Every operation takes it exclusively.
+  lock_policy_rwlock = 0,
+  // No synchronization at all, the pool should be accessed by only
+  // one thread.
+  lock_policy_none,
+  // A mutex that spins for a while before going to sleep.
+  lock_policy_adaptive_mutex,
+  // A FIFO spinlock, cheap under low to moderate contention.
+  lock_policy_ticket_spinlock,
+  // A FIFO queue lock in which every waiter spins on its own cache
+  // line, which scales better than the ticket lock under heavy
+  // contention.
+  lock_policy_mcs,
+  // No lock at all, the shared free list becomes a lock-free stack
+  // whose head is updated via compare-and-swap, and the counters are
+  // kept with atomic operations.
+  lock_policy_lock_free,
+  // This one should always remain at the end
+  __lock_policy_end_place_holder
+} mempool_lock_policy_t;
+
+// The kind of memory backing the buffer of a pool. The huge pages save
+// the dTLB misses of the large pools, whose entries are spread over
+// far more 4 KiB pages than the TLB can cover.
+typedef enum mempool_page_backing_t {
+  // The buffer comes from the heap, as with mempool_create.
+  page_backing_heap = 0,
+  // An anonymous mapping of regular pages.
+  page_backing_regular_pages,
+  // An anonymous mapping aligned to 2 MiB, which the kernel is asked
+  // to back with transparent huge pages via madvise(MADV_HUGEPAGE).
+  page_backing_transparent_huge_pages,
+  // Explicit huge pages via MAP_HUGETLB, which have to be reserved
+  // beforehand, e.g. via /proc/sys/vm/nr_hugepages.
+  page_backing_huge_pages_2mb,
+  page_backing_huge_pages_1gb,
+  // This one should always remain at the end
+  __page_backing_end_place_holder
+} mempool_page_backing_t;
+
+// The upper limit for mempool_config.thread_cache_size.
+#define MEMPOOL_MAX_THREAD_CACHE_SIZE 4096
+
+// The upper limit for mempool_config.alignment.
+#define MEMPOOL_MAX_ALIGNMENT 4096
+
+// The following struct carries the optional settings of an ordinary
+// memory pool. A zeroed config creates the same pool as
+// mempool_create(elem_count, elem_size, false, false).
+typedef struct mempool_config {
+  bool fallback_to_dynamic_memory;
+  mempool_lock_policy_t lock_policy;
+  // When non-zero, every thread keeps up to this many free entries
+  // in a private magazine in front of the shared free list. The
+  // magazines get refilled from and drained into the shared list
+  // in batches of half their size, so most of the allocations and
+  // releases don't touch the pool lock at all. The entries sitting
+  // in the magazines are neither free nor used from the pool's
+  // point of view, see mempool_cached_count.
+  uint32_t thread_cache_size;
+  // When true, the pool doesn't walk its elements at creation time.
+  // The untouched elements are handed out in address order via a bump
+  // pointer and only the released ones are put on the free list, so
+  // the creation is O(1) and the pages of the pool buffer get touched
+  // only when they are first used.
+  bool lazy_init;
+  // When greater than the element count of the pool, an exhausted pool
+  // grows by allocating a new slab of elements instead of allocating
+  // them one by one. Every slab is as large as the pool at that point,
+  // so the capacity doubles with each growth until it reaches
+  // max_elem_count. The dynamic memory fallback, if enabled, is only
+  // used after that. The slabs are kept until the pool is destroyed.
+  // The lock_policy_lock_free pools can't grow.
+  uint32_t max_elem_count;
+  // When non-zero, every entry handed out by the pool, including the
+  // dynamically allocated ones, is aligned to this many bytes. It
+  // should be a power of two between 8 and MEMPOOL_MAX_ALIGNMENT. The
+  // entries get padded so that their headers sit right before the
+  // aligned user pointers, so the alignments above 16 bytes cost some
+  // memory per entry. A preallocated buffer doesn't need to be aligned
+  // itself, the pool simply skips its unaligned head.
+  uint32_t alignment;
+  // When true, the entries carry no header at all, so an entry takes
+  // exactly elem_size bytes (rounded up to the pointer size, or to the
+  // alignment). The entries live in 2 MiB aligned slabs whose metadata,
+  // including a bitmap of the entries handed out, sits at the start of
+  // the slab. mempool_free_entry finds the slab of an entry via a global
+  // registry, which is only consulted while some headerless pool exists.
+  // The headerless pools can't be preallocated, sharded, lock-free,
+  // lazily initialized, growing or thread cached.
+  bool headerless;
+  // When not page_backing_heap, the pool buffer gets mapped with the
+  // given backing instead of being allocated from the heap. Whenever
+  // the kernel can't provide it, the next one down the list is tried,
+  // down to the regular pages, and mempool_stats.page_backing reports
+  // what was obtained. The slabs of a growing pool still come from the
+  // heap. The preallocated and headerless pools can't be mapped.
+  mempool_page_backing_t page_backing;
+} mempool_config;
+
+mempool *mempool_create_with_config(uint32_t elem_count, uint32_t elem_size,
+                                    const mempool_config *config);
+
 #define DECLARE_STATIC_MEMPOOL_BUFFER(name, elem_count, elem_size) \
   static uint8_t                                                   \
       name[elem_count *                                            \
@@ -62,6 +170,25 @@ mempool *mempool_create_from_preallocated_buffer(
     void *buffer, uint32_t buf_size, uint32_t elem_size,
     bool fallback_to_dynamic_memory, bool will_be_accessed_by_only_one_thread);
 
+// The following function creates a memory pool whose elements are
+// split into shard_count sub-pools, each with its own free list and
+// lock on its own cache line. The allocations are served by the
+// shard of the CPU the calling thread runs on, and fall back to the
+// neighbouring shards only when that one is exhausted. The releases
+// always go back to the owning shard. A shard_count of 0 creates one
+// shard per configured CPU. The thread_cache_size and lock_policy
+// settings apply to every shard, and max_elem_count gets split among
+// the shards like the elements, so an exhausted shard grows before
+// stealing from its neighbours. The dynamic memory fallback is only
+// used once all the shards are exhausted.
+mempool *mempool_create_sharded(uint32_t elem_count, uint32_t elem_size,
+                                uint32_t shard_count,
+                                const mempool_config *config);
+
+mempool *mempool_create_from_preallocated_buffer_with_config(
+    void *buffer, uint32_t buf_size, uint32_t elem_size,
+    const mempool_config *config);
+
 void _mempool_destroy(mempool *mp);
 
 #define mempool_destroy(mp) \
@@ -82,12 +209,72 @@ void _mempool_free_entry(void *entry);
     entry = NULL;                 \
   } while (0)
 
+// Allocates up to 'count' entries into the 'entries' array, taking the
+// pool lock only once, and returns the number of entries allocated.
+// The dynamic memory fallback, if enabled, fills in the missing ones.
+uint32_t mempool_alloc_bulk(mempool *mp, void **entries, uint32_t count);
+
+// Releases the 'count' entries in the 'entries' array, taking the lock
+// of each involved pool only once. The entries may come from different
+// pools. NULL entries are skipped, and every released entry is set to
+// NULL in the array, as mempool_free_entry does.
+void mempool_free_bulk(void **entries, uint32_t count);
+
+// Gives the pages of a mapped pool, see mempool_config.page_backing,
+// whose entries are all free back to the OS via madvise(MADV_DONTNEED),
+// and returns the number of bytes released. Such entries are reused
+// only after the rest of the free ones, and their pages get faulted in
+// again, zero-filled, when they are handed out. The entries held in the
+// per-thread magazines count as used. The pool lock is held throughout,
+// so this is meant for the idle times of the pool. The pools allocated
+// from the heap and the lock-free pools are left as they are.
+size_t mempool_trim(mempool *mp);
+
+// The statistics functions below never take the pool lock, so they
+// can be polled without getting in the way of the allocations. While
+// the pool is being used, the values may be slightly stale.
+typedef struct mempool_stats {
+  uint32_t total_capacity;
+  uint32_t used_count;
+  uint32_t dynamic_allocs_count;
+  // The free entries held in the per-thread magazines, which are
+  // excluded from used_count.
+  uint32_t cached_count;
+  // The high-water marks of used_count and dynamic_allocs_count. The
+  // entries in the magazines count as used for the former, and the
+  // sharded pools report the sum of the peaks of their shards.
+  uint32_t peak_used_count;
+  uint32_t peak_dynamic_allocs_count;
+  // The number of allocations that couldn't be served at all, i.e. the
+  // NULL returns, counting the missing entries of the bulk allocations.
+  uint64_t failed_allocs_count;
+  // The number of entries served by the dynamic memory fallback.
+  uint64_t fallback_count;
+  // The backing obtained for the pool buffer, see
+  // mempool_config.page_backing.
+  mempool_page_backing_t page_backing;
+  // The free entries whose pages were released by mempool_trim, and
+  // haven't been handed out since.
+  uint32_t trimmed_count;
+} mempool_stats;
+
+// Fills in all the statistics of the given pool in one go.
+void mempool_get_stats(mempool *mp, mempool_stats *stats);
+
+// Starts the peaks over from the current values and zeroes the
+// failure and fallback counts.
+void mempool_reset_stats(mempool *mp);
+
 uint32_t mempool_total_capacity(mempool *mp);
 
 uint32_t mempool_used_count(mempool *mp);
 
 uint32_t mempool_dynamic_allocs_count(mempool *mp);
 
+// Returns the number of free entries currently held in the per-thread
+// magazines. These entries are excluded from mempool_used_count.
+uint32_t mempool_cached_count(mempool *mp);
+
 // Ranged mempool declarations
 // The ranged mempools are a quick alternative to dynamic memory
 // allocation in which the memory is preallocated and served in
@@ -123,11 +310,8 @@ r_mempool *r_mempool_create(uint8_t smallest_size_power_of_two,
 // the required size for a rmempool. It is not meant to be used
 // directly, it is mostly there as a helper to the following macro
 // DECLARE_STATIC_RMEMPOOL_BUFFER.
-#define CALCULATE_STATIC_RMEMPOOL_BUFFER_SIZE(SS, LS, SC)                   \
-  ((LS - SS + 1) * (1 << SC) * (1 << SS) +                                  \
-   (2 * (1 << SC) * offsetof(__dummy_struct_for_offset_dont_use, _final_) * \
-    ((1 << (LS - SS + 1)) - 1)) /                                           \
-       (1 << (LS - SS + 1)))
+#define CALCULATE_STATIC_RMEMPOOL_BUFFER_SIZE(SS, LS, SC) \
+  CALCULATE_STATIC_SPACED_RMEMPOOL_BUFFER_SIZE(SS, LS, SC, 0)
 
 // The macro DECLARE_STATIC_RMEMPOOL_BUFFER declares a static
 // buffer using the given name and size parameters. This buffer
@@ -148,6 +332,132 @@ r_mempool *r_mempool_create_from_preallocated_buffer(
     r_memory_fallback_policy_t fb_policy,
     bool will_be_accessed_by_only_one_thread);
 
+// Same as r_mempool_create, except that every doubling of the size
+// above the smallest size is split into 2^classes_per_doubling_power_of_two
+// size classes of equal steps. With 2 (i.e. 4 classes per doubling) and
+// a smallest size of 2^5, the size classes become 32, 40, 48, 56, 64,
+// 80, 96, ... which wastes less than 20% of an entry instead of 50%.
+// Every class holds as many elements as the power of two class right
+// above it would in r_mempool_create. The steps can not be smaller
+// than 8 bytes, i.e. classes_per_doubling_power_of_two can be at most
+// smallest_size_power_of_two - 3, and at most 3.
+r_mempool *r_mempool_create_spaced(
+    uint8_t smallest_size_power_of_two, uint8_t largest_size_power_of_two,
+    uint8_t number_of_smallest_size_elems_power_of_two,
+    uint8_t classes_per_doubling_power_of_two,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread);
+
+// The spaced counterparts of the macros above. The first class takes
+// 2^SC * (2^SS + header) bytes, every doubling takes the same amount
+// for the data, and the headers halve with every doubling.
+#define CALCULATE_STATIC_SPACED_RMEMPOOL_BUFFER_SIZE(SS, LS, SC, SP)         \
+  ((1 << (SC)) *                                                            \
+       ((1 << (SS)) + offsetof(__dummy_struct_for_offset_dont_use, _final_)) + \
+   ((LS) - (SS)) * ((1 << ((SC) + (SS)-1)) * (1 << (SP)) +                   \
+                    (1 << ((SC) + (SS)-2)) * ((1 << (SP)) + 1)) +            \
+   (1 << (SP)) * offsetof(__dummy_struct_for_offset_dont_use, _final_) *     \
+       ((1 << (SC)) - (1 << ((SC) - ((LS) - (SS))))))
+
+#define DECLARE_STATIC_SPACED_RMEMPOOL_BUFFER(                         \
+    name, smallest_size_power_of_two, largest_size_power_of_two,       \
+    number_of_smallest_size_elems_power_of_two,                        \
+    classes_per_doubling_power_of_two)                                 \
+  static uint8_t name[CALCULATE_STATIC_SPACED_RMEMPOOL_BUFFER_SIZE(    \
+      smallest_size_power_of_two, largest_size_power_of_two,           \
+      number_of_smallest_size_elems_power_of_two,                      \
+      classes_per_doubling_power_of_two)] = {0}
+
+r_mempool *r_mempool_create_spaced_from_preallocated_buffer(
+    void *buffer, uint32_t buf_size, uint8_t smallest_size_power_of_two,
+    uint8_t largest_size_power_of_two,
+    uint8_t number_of_smallest_size_elems_power_of_two,
+    uint8_t classes_per_doubling_power_of_two,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread);
+
+// An explicit size class for r_mempool_create_with_classes.
+typedef struct r_mempool_class_spec {
+  uint32_t size;   // The largest size the class serves
+  uint32_t count;  // The number of entries preallocated for the class
+} r_mempool_class_spec;
+
+// Creates a ranged pool out of the given classes instead of the powers
+// of two, so that the memory goes where the traffic is, e.g. plenty of
+// 64 and 4096 byte entries with a few in between. The sizes should be
+// increasing multiples of 8, starting from at least 16, and every class
+// should hold at least one entry. A size is served by the first class
+// whose size is at least as large. The specs are copied.
+r_mempool *r_mempool_create_with_classes(
+    const r_mempool_class_spec *specs, uint32_t number_of_classes,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread);
+
+// Returns the buffer size the following preallocated variant expects for
+// the given classes, or 0 if it doesn't fit in 32 bits. The macro below
+// does the same for a single class, so that a static buffer can be
+// declared as the sum of its classes.
+uint32_t r_mempool_classes_buffer_size(const r_mempool_class_spec *specs,
+                                       uint32_t number_of_classes);
+
+#define CALCULATE_STATIC_RMEMPOOL_CLASS_BUFFER_SIZE(size, count) \
+  ((count) * ((size) + offsetof(__dummy_struct_for_offset_dont_use, _final_)))
+
+r_mempool *r_mempool_create_with_classes_from_preallocated_buffer(
+    void *buffer, uint32_t buf_size, const r_mempool_class_spec *specs,
+    uint32_t number_of_classes, r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread);
+
+// Creates a ranged pool whose classes keep their entries in slabs of
+// slab_size bytes, which can move from one class to another, so that a
+// class running dry can take over the memory of a class sitting idle.
+// A slab moves only once all of its entries are free, from the class
+// with the lowest utilization which would still be below 75% without
+// it, and every class keeps at least one slab. The classes start with
+// enough slabs for their counts, and slab_size should be large enough
+// for at least one entry of the largest class, including its 16-byte
+// header.
+//
+// With rebalance_on_exhaustion, an allocation whose class is exhausted
+// moves a slab into it before trying the larger classes. The entries
+// come from the dynamic memory right away with
+// fallback_at_first_exhaustion though, so r_mempool_rebalance is the
+// only way to rebalance such a pool.
+r_mempool *r_mempool_create_rebalancing(
+    const r_mempool_class_spec *specs, uint32_t number_of_classes,
+    uint32_t slab_size, bool rebalance_on_exhaustion,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread);
+
+// Moves a slab into every class of a rebalancing pool that has at least
+// 75% of its entries in use, as long as some other class can give one
+// away, and returns the number of slabs moved. Meant to be called from
+// a maintenance thread every now and then, as it walks the free lists
+// of the donor classes under their locks. Returns 0 for the other
+// ranged pools.
+uint32_t r_mempool_rebalance(r_mempool *rmp);
+
+// Same as r_mempool_create, except that every entry handed out by the
+// ranged pool is aligned to the given number of bytes, see
+// mempool_config.alignment for the details.
+r_mempool *r_mempool_create_aligned(
+    uint8_t smallest_size_power_of_two, uint8_t largest_size_power_of_two,
+    uint8_t number_of_smallest_size_elems_power_of_two,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread, uint32_t alignment);
+
+// Same as r_mempool_create, except that the size classes are carved out
+// of a single buffer mapped with the given backing, see
+// mempool_config.page_backing, so the huge pages only get rounded up
+// once for the whole pool. Every class reports the backing obtained for
+// that buffer through r_mempool_get_stats.
+r_mempool *r_mempool_create_backed(
+    uint8_t smallest_size_power_of_two, uint8_t largest_size_power_of_two,
+    uint8_t number_of_smallest_size_elems_power_of_two,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread,
+    mempool_page_backing_t page_backing);
+
 void _r_mempool_destroy(r_mempool *rmp);
 
 #define r_mempool_destroy(rmp) \
@@ -162,10 +472,164 @@ uint32_t r_mempool_total_capacity(r_mempool *rmp, uint32_t size);
 
 uint32_t r_mempool_dynamic_allocs_count(r_mempool *rmp, uint32_t size);
 
+// The statistics of the size class that serves the given size.
+typedef struct r_mempool_stats {
+  // The statistics of the pool of the class itself. Its failures are
+  // the times the class was exhausted, whether the allocation was then
+  // served by another class or not.
+  mempool_stats pool;
+  // The allocations of this class served by a larger class.
+  uint64_t escalated_count;
+  // The allocations of this class served by the dynamic memory after
+  // exhausting all the larger classes, with fallback_at_last_exhaustion.
+  uint64_t last_exhaustion_fallback_count;
+  // The allocations of this class that couldn't be served at all.
+  uint64_t failed_allocs_count;
+} r_mempool_stats;
+
+// Fills in the statistics of the size class serving 'size', or zeroes
+// them if there's no such class.
+void r_mempool_get_stats(r_mempool *rmp, uint32_t size,
+                         r_mempool_stats *stats);
+
+// Resets the statistics of all the size classes, as mempool_reset_stats
+// does, along with the requested size histograms.
+void r_mempool_reset_stats(r_mempool *rmp);
+
+// Trims the pools of all the size classes, see mempool_trim, and unmaps
+// the mappings cached for the large entries. Returns the number of bytes
+// given back to the OS.
+size_t r_mempool_trim(r_mempool *rmp);
+
+// Requested size histograms
+// Every request gets rounded up to the size of its class, and the slack
+// this leaves in the entries is the internal fragmentation of the pool.
+// Once enabled, the ranged pool records the requested sizes of every
+// class in a histogram, along with the bytes requested and the bytes
+// handed out, which tell how much of the pool memory is actually used.
+// The class of a size spans the sizes in (lower_size, upper_size], and
+// every bucket covers an equal share of it.
+#define R_MEMPOOL_SIZE_HISTOGRAM_BUCKETS 8
+
+typedef struct r_mempool_size_histogram {
+  uint32_t lower_size;
+  uint32_t upper_size;
+  uint64_t counts[R_MEMPOOL_SIZE_HISTOGRAM_BUCKETS];
+  uint64_t requested_bytes;
+  // The usable sizes of the entries handed out, which may come from the
+  // larger classes, or from the dynamic memory.
+  uint64_t handed_out_bytes;
+} r_mempool_size_histogram;
+
+// Starts or stops the recording of the requested sizes, which is
+// disabled by default. The recorded sizes are kept when stopped.
+// Returns false if the histograms couldn't be allocated.
+bool r_mempool_set_size_histogram(r_mempool *rmp, bool enabled);
+
+// Fills in the histogram of the size class serving 'size'.
+void r_mempool_get_size_histogram(r_mempool *rmp, uint32_t size,
+                                  r_mempool_size_histogram *histogram);
+
 void *r_mempool_alloc_entry(r_mempool *rmp, uint32_t size);
 
 void *r_mempool_calloc_entry(r_mempool *rmp, uint32_t size);
 
+// Keeps the entry in place if the new size maps to its class, or if it
+// fits in the entry and is at least the given percentage of its usable
+// size, see r_mempool_set_realloc_in_place_percentage. Otherwise the
+// contents get copied into a new entry, up to the smaller of the sizes.
 void *r_mempool_realloc_entry(r_mempool *rmp, void *addr, uint32_t size);
 
-#define r_mempool_free_entry(entry) mempool_free_entry(entry)
+// Sets the percentage of the usable size an entry can shrink to while
+// still being kept in place by r_mempool_realloc_entry. It is 100 by
+// default, i.e. an entry only stays in place within its class, and 0
+// keeps every entry in place as long as the new size fits. A growable
+// buffer shrinking and growing back would set it to e.g. 25. Returns
+// false for a percentage above 100.
+bool r_mempool_set_realloc_in_place_percentage(r_mempool *rmp,
+                                               uint32_t percentage);
+
+// Returns the number of bytes the given entry can hold, which may be
+// more than what was requested, e.g. up to the size of its class. The
+// entries served by the dynamic memory report what the allocator has
+// handed out. Returns 0 for NULL.
+uint32_t r_mempool_usable_size(void *entry);
+
+// The upper limit for the cached_mapping_count of
+// r_mempool_enable_large_entries.
+#define R_MEMPOOL_MAX_CACHED_MAPPINGS 64
+
+// The fallback entries of at least this many bytes get mapped as well
+// once the large entries are enabled.
+#define R_MEMPOOL_LARGE_ENTRY_THRESHOLD (128 * 1024)
+
+// Lets the pool serve the sizes above its largest class, which it would
+// refuse otherwise, by mapping every such entry on its own with mmap.
+// The dynamic memory fallback of fallback_at_last_exhaustion maps the
+// entries of R_MEMPOOL_LARGE_ENTRY_THRESHOLD bytes or more as well, so
+// that large buffers don't fragment the heap. Up to cached_mapping_count
+// released mappings are kept for reuse, which saves the mmap and munmap
+// calls of a buffer getting allocated and released over and over, at
+// the cost of keeping that much memory mapped. The large entries are
+// released with r_mempool_free_entry, r_mempool_realloc_entry remaps
+// them instead of copying, and r_mempool_get_stats reports them as the
+// dynamic allocations of any size above the largest class. Should be
+// called before the pool is shared with other threads. Returns false
+// if they are enabled already, for more than R_MEMPOOL_MAX_CACHED_MAPPINGS
+// mappings, or if the cache can't be allocated.
+bool r_mempool_enable_large_entries(r_mempool *rmp,
+                                    uint32_t cached_mapping_count);
+
+void _r_mempool_free_entry(void *entry);
+
+#define r_mempool_free_entry(entry) \
+  do {                              \
+    _r_mempool_free_entry(entry);   \
+    entry = NULL;                   \
+  } while (0)
+
+// Allocates up to 'count' entries of the given size into the 'entries'
+// array and returns the number of entries allocated. Once the matching
+// pool is exhausted, the larger ones are used, following the same rules
+// as r_mempool_alloc_entry. The sizes above the largest class get mapped
+// one by one, once the large entries are enabled.
+uint32_t r_mempool_alloc_bulk(r_mempool *rmp, uint32_t size, void **entries,
+                              uint32_t count);
+
+void r_mempool_free_bulk(void **entries, uint32_t count);
+
+// Allocation trace recording
+// While a trace is being recorded, the ranged pool allocations, the
+// reallocations and the releases of all the ranged pools get appended
+// to the trace file, which starts with R_MEMPOOL_TRACE_MAGIC, followed
+// by the uint32_t values R_MEMPOOL_TRACE_VERSION and
+// sizeof(r_mempool_trace_record), and then the records themselves in
+// the host byte order. The 'replay' benchmark runs such a trace against
+// different pool configurations. When no trace is being recorded, the
+// hooks cost a single load per call.
+#define R_MEMPOOL_TRACE_MAGIC "CMPTRACE"
+#define R_MEMPOOL_TRACE_VERSION 1
+
+typedef enum r_mempool_trace_op_t {
+  r_mempool_trace_alloc = 0,
+  r_mempool_trace_realloc,
+  r_mempool_trace_free
+} r_mempool_trace_op_t;
+
+typedef struct r_mempool_trace_record {
+  uint64_t timestamp_ns;  // Since the start of the trace
+  uint64_t entry;         // The returned or released entry, 0 on failure
+  uint64_t old_entry;     // The reallocated entry, if any
+  uint32_t size;          // The requested size, 0 for the releases
+  uint16_t thread_id;     // Sequential, in the order of first appearance
+  uint8_t op;             // An r_mempool_trace_op_t
+  uint8_t reserved;
+} r_mempool_trace_record;
+
+// Starts recording into the file at the given path, which gets
+// truncated. Returns false if the file can't be created, or if there's
+// a trace being recorded already.
+bool r_mempool_trace_start(const char *path);
+
+// Stops the recording and closes the trace file.
+void r_mempool_trace_stop(void);
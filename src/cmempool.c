@@ -22,12 +22,21 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <cmempool.h>
+#include <malloc.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #define mem_alloc(size) malloc(size)
 #define mem_calloc(elem_count, elem_size) calloc(elem_count, elem_size)
@@ -38,9 +47,170 @@ SOFTWARE.
 #define rw_lock_destroy(a) pthread_rwlock_destroy(a)
 #define rw_lock_init(a) pthread_rwlock_init(a, NULL)
 #define rw_lock_wrlock(a) pthread_rwlock_wrlock(a)
-#define rw_lock_rdlock(a) pthread_rwlock_rdlock(a)
 #define rw_lock_unlock(a) pthread_rwlock_unlock(a)
 
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+// The spinning locks give the CPU away after this many attempts, so
+// that a preempted lock holder gets a chance to run.
+#define SPIN_COUNT_BEFORE_YIELD 128
+
+typedef struct mcs_node {
+  struct mcs_node *next;
+  bool locked;
+#ifndef NDEBUG
+  bool in_use;  // Catches the nested acquisitions
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE))) mcs_node;
+
+// The pool code never holds more than one pool lock at a time, hence a
+// single queue node per thread is enough for the MCS locks. The only
+// nesting is in the fork handlers of the malloc shim, whose pools use
+// the adaptive mutexes.
+static __thread mcs_node mcs_thread_node;
+
+typedef struct pool_lock {
+  mempool_lock_policy_t policy;
+  union {
+    rw_lock_t rwlock;
+    pthread_mutex_t mutex;
+    struct {
+      uint32_t next_ticket;
+      uint32_t now_serving;
+    } ticket;
+    mcs_node *mcs_tail;
+  };
+} pool_lock;
+
+static inline void spin_wait(uint32_t *spins) {
+  if (++*spins < SPIN_COUNT_BEFORE_YIELD) {
+    cpu_relax();
+  } else {
+    *spins = 0;
+    sched_yield();
+  }
+}
+
+static int pool_lock_init(pool_lock *lock, mempool_lock_policy_t policy) {
+  memset(lock, 0, sizeof(pool_lock));
+  lock->policy = policy;
+
+  switch (policy) {
+    case lock_policy_rwlock:
+      return rw_lock_init(&lock->rwlock);
+    case lock_policy_adaptive_mutex: {
+      pthread_mutexattr_t attr;
+      if (pthread_mutexattr_init(&attr) != 0) {
+        return -1;
+      }
+      int result = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+      if (result == 0) {
+        result = pthread_mutex_init(&lock->mutex, &attr);
+      }
+      pthread_mutexattr_destroy(&attr);
+      return result;
+    }
+    default:
+      return 0;
+  }
+}
+
+static void pool_lock_destroy(pool_lock *lock) {
+  if (lock->policy == lock_policy_rwlock) {
+    rw_lock_destroy(&lock->rwlock);
+  } else if (lock->policy == lock_policy_adaptive_mutex) {
+    pthread_mutex_destroy(&lock->mutex);
+  }
+}
+
+static inline void pool_lock_acquire(pool_lock *lock) {
+  switch (lock->policy) {
+    case lock_policy_rwlock:
+      rw_lock_wrlock(&lock->rwlock);
+      break;
+    case lock_policy_adaptive_mutex:
+      pthread_mutex_lock(&lock->mutex);
+      break;
+    case lock_policy_ticket_spinlock: {
+      uint32_t ticket =
+          __atomic_fetch_add(&lock->ticket.next_ticket, 1, __ATOMIC_RELAXED);
+      uint32_t spins = 0;
+      while (__atomic_load_n(&lock->ticket.now_serving, __ATOMIC_ACQUIRE) !=
+             ticket) {
+        spin_wait(&spins);
+      }
+      break;
+    }
+    case lock_policy_mcs: {
+      mcs_node *node = &mcs_thread_node;
+#ifndef NDEBUG
+      assert(!node->in_use);
+      node->in_use = true;
+#endif
+      node->next = NULL;
+      node->locked = true;
+      mcs_node *prev = __atomic_exchange_n(&lock->mcs_tail, node,
+                                           __ATOMIC_ACQ_REL);
+      if (prev) {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        uint32_t spins = 0;
+        while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+          spin_wait(&spins);
+        }
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static inline void pool_lock_release(pool_lock *lock) {
+  switch (lock->policy) {
+    case lock_policy_rwlock:
+      rw_lock_unlock(&lock->rwlock);
+      break;
+    case lock_policy_adaptive_mutex:
+      pthread_mutex_unlock(&lock->mutex);
+      break;
+    case lock_policy_ticket_spinlock:
+      __atomic_store_n(&lock->ticket.now_serving, lock->ticket.now_serving + 1,
+                       __ATOMIC_RELEASE);
+      break;
+    case lock_policy_mcs: {
+      mcs_node *node = &mcs_thread_node;
+#ifndef NDEBUG
+      node->in_use = false;
+#endif
+      mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+      if (!next) {
+        mcs_node *expected = node;
+        if (__atomic_compare_exchange_n(&lock->mcs_tail, &expected, NULL, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+          break;
+        }
+        // A successor is enqueueing itself, wait for the link.
+        uint32_t spins = 0;
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+          spin_wait(&spins);
+        }
+      }
+      __atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
 const char *_mempool_mark = "mempool";
 
 typedef uintptr_t *addr_t;
@@ -63,6 +233,80 @@ typedef struct entry_header {
 #define USER_SIZE_TO_EXT_SIZE(elem_size) \
   (elem_size + offsetof(entry_header, next))
 
+// The statistics functions read the pool counters without taking the
+// pool lock. Hence the locked paths update them with relaxed atomic
+// stores, which cost no more than plain ones since the lock already
+// makes them the only writer, while the lock-free paths use atomic
+// read-modify-write operations.
+#define COUNTER_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define COUNTER_ADD(counter, value) \
+  __atomic_store_n(&(counter), (counter) + (value), __ATOMIC_RELAXED)
+#define COUNTER_SUB(counter, value) \
+  __atomic_store_n(&(counter), (counter) - (value), __ATOMIC_RELAXED)
+
+// Raises the given high-water mark to 'value', if it's below. Once the
+// peak is reached, this costs a single load.
+static inline void counter_raise_peak(uint32_t *peak, uint32_t value) {
+  uint32_t current = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(peak, &current, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Per-thread magazine of free entries. Every thread gets a slot index
+// on its first cached access, and each pool with a thread cache keeps
+// one magazine per slot, so that a magazine is only ever touched by
+// the thread owning its slot (apart from the relaxed reads of 'count'
+// done by the statistics functions).
+typedef struct thread_cache {
+  uint32_t count;
+  entry_header **entries;
+} __attribute__((aligned(CACHE_LINE_SIZE))) thread_cache;
+
+#define MAX_THREAD_CACHE_SLOTS 128
+
+#define LF_HEAD(gen, index_plus_one) \
+  (((uint64_t)(gen) << 32) | (uint64_t)(index_plus_one))
+#define LF_HEAD_GEN(head) ((uint32_t)((head) >> 32))
+#define LF_HEAD_INDEX(head) ((uint32_t)(head))
+
+// The slabs added by the growing pools. A pool can double its capacity
+// at most 32 times before the element count overflows, so a fixed size
+// array is enough, and it is only ever appended to, which lets the
+// lockless release paths search it while another slab gets added.
+// The pools of a rebalancing ranged pool keep all of their entries in
+// slabs of a fixed size, which may also be taken out of the array, as
+// these pools never release their entries without holding the lock.
+typedef struct mempool_slab {
+  uintptr_t lower_addr_limit;
+  uintptr_t upper_addr_limit;
+} mempool_slab;
+
+#define MAX_MEMPOOL_SLABS 32
+
+// The headerless pools keep their entries in naturally aligned slabs
+// of HEADERLESS_SLAB_SIZE bytes. The slab metadata, including a bitmap
+// of the entries handed out, sits at the start of the slab, so the
+// metadata of an entry is found by masking its address, and the
+// entries themselves carry no header at all.
+#define HEADERLESS_SLAB_SIZE ((uintptr_t)2 * 1024 * 1024)
+#define HEADERLESS_ENTRY_TO_SLAB(entry) \
+  ((headerless_slab *)((uintptr_t)(entry) & ~(HEADERLESS_SLAB_SIZE - 1)))
+
+typedef struct headerless_slab {
+  mempool *pool_ptr;
+  uintptr_t first_entry;
+  uint32_t elem_count;
+  uint64_t taken[];  // One bit per entry, set while it's handed out
+} headerless_slab;
+
+// A released mapping of a large entry, kept around for reuse.
+typedef struct cached_mapping {
+  void *base;
+  size_t length;
+} cached_mapping;
+
 struct mempool {
   const char *mempool_mark;  // This field is used for sanity checks
   uint32_t ext_elem_size;
@@ -76,703 +320,4003 @@ struct mempool {
   bool is_preallocated;
   bool should_use_locks;
   void *free_inst;
-  rw_lock_t lock;
+  uint32_t bump_index;  // The elements from here on were never handed out
+  pool_lock lock;
+  bool is_lock_free;
+  uint64_t free_head;  // Only used by the lock-free pools
+  uint32_t thread_cache_size;
+  thread_cache *thread_caches;  // MAX_THREAD_CACHE_SLOTS magazines
+  entry_header **thread_cache_entries;
+  uint32_t shard_count;
+  mempool **shards;  // Only used by the sharded pools
+  uint32_t max_elem_count;
+  uint32_t slab_count;
+  uint32_t max_slab_count;
+  mempool_slab *slabs;  // Only used by the growing and slabbed pools
+  uint32_t alignment;
+  uint32_t header_offset;  // From the start of an entry to its header
+  mempool_page_backing_t page_backing;
+  size_t objects_length;  // Only set when the buffer is mapped
+  // A bit per entry of the pool buffer, set for the free entries whose
+  // pages were given back by mempool_trim
+  uint64_t *trimmed_entries;
+  uint32_t trimmed_count;
+  uint32_t trimmed_cursor;  // No bits are set in the words before it
+  bool is_headerless;
+  uint32_t headerless_slab_count;
+  headerless_slab **headerless_slabs;  // Only used by the headerless pools
+  // Statistics, see mempool_stats
+  uint32_t peak_used_count;
+  uint32_t peak_dynamic_allocs_count;
+  uint64_t failed_allocs_count;
+  uint64_t fallback_count;
+  // Only set for the pools of a ranged pool, see r_mempool.nonempty_classes
+  uint64_t *nonempty_word;
+  uint64_t nonempty_bit;
+  // Only set for the large entry pool of a ranged pool, whose entries
+  // get mapped one by one, see r_mempool_enable_large_entries
+  bool maps_entries;
+  uint32_t cached_mapping_count;
+  uint32_t max_cached_mappings;
+  cached_mapping *cached_mappings;  // Protected by the pool lock
 };
 
+// Every pool gets cache line aligned storage of its own, so that
+// the shards of a sharded pool never share their locks and free
+// lists with each other.
+static mempool *mempool_alloc_struct(void) {
+  size_t size = (sizeof(mempool) + CACHE_LINE_SIZE - 1) &
+                ~(size_t)(CACHE_LINE_SIZE - 1);
+  mempool *mp = (mempool *)aligned_alloc(CACHE_LINE_SIZE, size);
+  if (mp) {
+    memset(mp, 0, size);
+  }
+
+  return mp;
+}
+
 const uint32_t elem_is_free = 0xdeadbeef;
 const uint32_t elem_is_taken = 0xfeedcafe;
 const uint32_t elem_is_not_a_pool_member = 0xfadeface;
 
-void _mempool_destroy(mempool *mp) {
-  if (mp) {
-    if (!mp->is_preallocated && mp->objects) {
-      mem_free(mp->objects);
-    }
-    if (mp->should_use_locks) {
-      rw_lock_destroy(&mp->lock);
-    }
-    mem_free(mp);
-  }
+static inline bool valid_mempool_alignment(uint32_t alignment) {
+  return alignment == 0 ||
+         (alignment >= sizeof(addr_t) && alignment <= MEMPOOL_MAX_ALIGNMENT &&
+          (alignment & (alignment - 1)) == 0);
 }
 
-void mempool_init_internal_scalars(mempool *mp, uint32_t elem_count,
-                                   uint32_t ext_elem_size,
-                                   bool fallback_to_dynamic_memory) {
-  for (uint32_t i = 0; i < elem_count; ++i) {
-    entry_header *header =
-        (entry_header *)((uintptr_t)mp->objects + i * ext_elem_size);
-    header->elem_status = elem_is_free;
-    header->pool_ptr = mp;
+static inline bool valid_mempool_page_backing(
+    mempool_page_backing_t page_backing) {
+  return page_backing >= page_backing_heap &&
+         page_backing < __page_backing_end_place_holder;
+}
 
-    if (i == (elem_count - 1)) {
-      header->next = NULL;
-    } else {
-      header->next = (addr_t)((uintptr_t)mp->objects + (i + 1) * ext_elem_size);
-    }
+// With a non-zero alignment, the entry size is rounded up to a multiple
+// of the alignment, and the first header sits at the end of the first
+// 'alignment' bytes of the pool buffer, so that every user pointer is
+// aligned. Every entry then ends with the header of the next one.
+static inline uint32_t aligned_header_offset(uint32_t alignment) {
+  return alignment > offsetof(entry_header, next)
+             ? alignment - (uint32_t)offsetof(entry_header, next)
+             : 0;
+}
+
+// Returns 0 if the entries would be too large.
+static inline uint32_t aligned_ext_elem_size(uint32_t elem_size,
+                                             uint32_t alignment) {
+  if (alignment == 0) {
+    return USER_SIZE_TO_EXT_SIZE(elem_size);
   }
 
-  mp->free_inst = mp->objects;
-  mp->mempool_mark = _mempool_mark;
-  mp->ext_elem_size = ext_elem_size;
-  mp->total_elem_count = elem_count;
-  mp->fallback_to_dynamic_memory = fallback_to_dynamic_memory;
-  mp->active_dynamic_memory_buffer_count = 0;
-  mp->lower_addr_limit = (uintptr_t)mp->objects;
-  mp->upper_addr_limit = (uintptr_t)mp->objects + ext_elem_size * elem_count;
-  mp->free_elem_count = elem_count;
+  uint64_t ext_elem_size = USER_SIZE_TO_EXT_SIZE((uint64_t)elem_size);
+  ext_elem_size = (ext_elem_size + alignment - 1) & ~(uint64_t)(alignment - 1);
+
+  return ext_elem_size < UINT32_MAX ? (uint32_t)ext_elem_size : 0;
 }
 
-mempool *mempool_create(uint32_t elem_count, uint32_t elem_size,
-                        bool fallback_to_dynamic_memory,
-                        bool will_be_accessed_by_only_one_thread) {
-  if (elem_count == 0 || elem_size == 0) {
-    return NULL;
-  } else if (elem_size < sizeof(addr_t)) {
-    elem_size = sizeof(addr_t);
-  }
+static inline void mempool_set_alignment(mempool *mp, uint32_t elem_size,
+                                         uint32_t alignment) {
+  mp->alignment = alignment;
+  mp->header_offset = aligned_header_offset(alignment);
+  mp->ext_elem_size = aligned_ext_elem_size(elem_size, alignment);
+}
 
-  mempool *mp = (mempool *)mem_calloc(1, sizeof(mempool));
-  if (!mp) {
-    return NULL;
+// Allocates the storage of elem_count entries of the given pool,
+// honouring its alignment.
+static void *mempool_alloc_objects(mempool *mp, uint32_t elem_count) {
+  if (mp->alignment) {
+    // The header offset is always less than the alignment.
+    return aligned_alloc(mp->alignment, (size_t)elem_count * mp->ext_elem_size +
+                                            mp->alignment);
   }
 
-  uint32_t ext_elem_size = USER_SIZE_TO_EXT_SIZE(elem_size);
-  mp->objects = mem_calloc(elem_count, ext_elem_size);
-  if (!mp->objects) {
-    mempool_destroy(mp);
-    return NULL;
-  }
+  return mem_calloc(elem_count, mp->ext_elem_size);
+}
 
-  mp->should_use_locks = !will_be_accessed_by_only_one_thread;
+static inline void mempool_count_dynamic_header(mempool *mp) {
+  uint32_t count = __atomic_add_fetch(&mp->active_dynamic_memory_buffer_count,
+                                      1, __ATOMIC_RELAXED);
+  counter_raise_peak(&mp->peak_dynamic_allocs_count, count);
+  __atomic_add_fetch(&mp->fallback_count, 1, __ATOMIC_RELAXED);
+}
 
-  if (mp->should_use_locks) {
-    if (rw_lock_init(&mp->lock) != 0) {
-      mempool_destroy(mp);
-      return NULL;
-    }
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGE_PAGE_SIZE_2MB ((size_t)1 << 21)
+#define HUGE_PAGE_SIZE_1GB ((size_t)1 << 30)
+
+// The granularity in which the mappings of the given backing can be
+// released. The transparent huge pages get split as needed.
+static inline size_t page_backing_page_size(
+    mempool_page_backing_t page_backing) {
+  if (page_backing == page_backing_huge_pages_1gb) {
+    return HUGE_PAGE_SIZE_1GB;
+  } else if (page_backing == page_backing_huge_pages_2mb) {
+    return HUGE_PAGE_SIZE_2MB;
   }
 
-  mempool_init_internal_scalars(mp, elem_count, ext_elem_size,
-                                fallback_to_dynamic_memory);
-
-  return mp;
+  return (size_t)sysconf(_SC_PAGESIZE);
 }
 
-mempool *mempool_create_from_preallocated_buffer(
-    void *buffer, uint32_t buf_size, uint32_t elem_size,
-    bool fallback_to_dynamic_memory, bool will_be_accessed_by_only_one_thread) {
-  if (!buffer || elem_size < sizeof(addr_t) ||
-      buf_size < (sizeof(entry_header))) {
+// Maps at least 'size' bytes with the given backing, rounded up to its
+// page size. The transparent huge pages need a 2 MiB aligned range, so
+// the mapping gets trimmed down to one, and they are only given when
+// the kernel accepts the madvise.
+static void *map_pages(size_t size, mempool_page_backing_t page_backing,
+                       size_t *length) {
+  size_t page_size = page_backing_page_size(page_backing);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  if (page_backing == page_backing_huge_pages_1gb) {
+    flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+  } else if (page_backing == page_backing_huge_pages_2mb) {
+    flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+  } else if (page_backing == page_backing_transparent_huge_pages) {
+    page_size = HUGE_PAGE_SIZE_2MB;
+  }
+
+  if (size > SIZE_MAX - 2 * page_size) {
     return NULL;
   }
+  *length = (size + page_size - 1) & ~(page_size - 1);
+
+  if (page_backing != page_backing_transparent_huge_pages) {
+    void *base = mmap(NULL, *length, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return base == MAP_FAILED ? NULL : base;
+  }
 
-  uint32_t ext_elem_size = USER_SIZE_TO_EXT_SIZE(elem_size);
-  uint32_t elem_count = buf_size / ext_elem_size;
-  if (elem_count == 0) {
+  uint8_t *base = (uint8_t *)mmap(NULL, *length + page_size,
+                                  PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (base == MAP_FAILED) {
     return NULL;
   }
 
-  mempool *mp = (mempool *)mem_calloc(1, sizeof(mempool));
-  if (!mp) {
+  uint8_t *aligned = (uint8_t *)(((uintptr_t)base + page_size - 1) &
+                                 ~(uintptr_t)(page_size - 1));
+  if (aligned > base) {
+    munmap(base, aligned - base);
+  }
+  munmap(aligned + *length, base + page_size - aligned);
+
+  if (madvise(aligned, *length, MADV_HUGEPAGE) != 0) {
+    munmap(aligned, *length);
     return NULL;
   }
-  mp->is_preallocated = true;
-  mp->objects = buffer;
 
-  mp->should_use_locks = !will_be_accessed_by_only_one_thread;
+  return aligned;
+}
 
-  if (mp->should_use_locks) {
-    if (rw_lock_init(&mp->lock) != 0) {
-      mempool_destroy(mp);
-      return NULL;
+// Maps the storage of elem_count entries of the given pool, falling
+// back to the next smaller pages whenever the requested ones aren't
+// available, and records the backing obtained.
+static void *mempool_map_objects(mempool *mp, uint32_t elem_count,
+                                 mempool_page_backing_t page_backing) {
+  size_t size = (size_t)elem_count * mp->ext_elem_size + mp->alignment;
+
+  for (; page_backing > page_backing_heap; --page_backing) {
+    void *objects = map_pages(size, page_backing, &mp->objects_length);
+    if (objects) {
+      mp->page_backing = page_backing;
+      return objects;
     }
   }
 
-  mempool_init_internal_scalars(mp, elem_count, ext_elem_size,
-                                fallback_to_dynamic_memory);
+  return NULL;
+}
 
-  return mp;
+static void *mempool_create_objects(mempool *mp, uint32_t elem_count,
+                                    const mempool_config *config) {
+  if (config->page_backing != page_backing_heap) {
+    return mempool_map_objects(mp, elem_count, config->page_backing);
+  }
+
+  return mempool_alloc_objects(mp, elem_count);
 }
 
-void *mempool_alloc_entry(mempool *mp) {
-  if (!mp) {
-    assert(false);
+static void mempool_release_objects(mempool *mp) {
+  if (mp->objects_length) {
+    munmap(mp->objects, mp->objects_length);
+  } else {
+    mem_free(mp->objects);
   }
+}
 
-  void *result = NULL;
+// Allocates a single entry of ext_elem_size bytes for the dynamic
+// memory fallback, which is not a member of the pool buffer, and
+// accounts for it.
+static entry_header *mempool_alloc_dynamic_header(mempool *mp,
+                                                  uint32_t ext_elem_size) {
+  uint8_t *buffer =
+      mp->alignment
+          ? (uint8_t *)aligned_alloc(mp->alignment,
+                                     (size_t)ext_elem_size + mp->alignment)
+          : (uint8_t *)mem_alloc(ext_elem_size);
+  if (!buffer) {
+    return NULL;
+  }
 
-  if (mp->should_use_locks) {
-    rw_lock_wrlock(&mp->lock);
+  entry_header *header = (entry_header *)(buffer + mp->header_offset);
+  header->elem_status = elem_is_not_a_pool_member;
+  header->pool_ptr = mp;
+  mempool_count_dynamic_header(mp);
+
+  return header;
+}
+
+// The mappings of the large entries start with their lengths, and their
+// headers sit right before the first user address that honours the
+// alignment of the pool. A released mapping of at least the required
+// length, but less than twice of it, gets reused from the cache.
+static entry_header *mempool_map_dynamic_header(mempool *mp, size_t size) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t user_offset = mp->header_offset + offsetof(entry_header, next);
+  if (size > SIZE_MAX - user_offset - page_size) {
+    return NULL;
   }
 
-  if (mp->free_inst) {
-    entry_header *header = (entry_header *)mp->free_inst;
+  size_t length = (user_offset + size + page_size - 1) & ~(page_size - 1);
+  uint8_t *base = NULL;
 
-    if (header->elem_status != elem_is_free || header->pool_ptr != mp) {
-      // We have a corruption!
-      if (mp->should_use_locks) {
-        rw_lock_unlock(&mp->lock);
+  if (mp->max_cached_mappings > 0) {
+    if (mp->should_use_locks) {
+      pool_lock_acquire(&mp->lock);
+    }
+
+    uint32_t best = mp->cached_mapping_count;
+    for (uint32_t i = 0; i < mp->cached_mapping_count; ++i) {
+      size_t cached_length = mp->cached_mappings[i].length;
+      if (cached_length >= length && cached_length / 2 < length &&
+          (best == mp->cached_mapping_count ||
+           cached_length < mp->cached_mappings[best].length)) {
+        best = i;
       }
-      assert(false);
     }
 
-    mp->free_inst = header->next;
-    header->elem_status = elem_is_taken;
-    result = (void *)&header->next;
-    --mp->free_elem_count;
-  } else if (mp->fallback_to_dynamic_memory) {
-    // Seems like we exhausted our buffers and
-    // we are asked to fallback to the dynamic
-    // memory allocation mechanisms.
-    void *new_buffer = mem_alloc(mp->ext_elem_size);
-    if (new_buffer) {
-      entry_header *header = (entry_header *)new_buffer;
-      header->elem_status = elem_is_not_a_pool_member;
-      header->pool_ptr = mp;
-      result = (void *)&header->next;
-      ++mp->active_dynamic_memory_buffer_count;
+    if (best < mp->cached_mapping_count) {
+      base = (uint8_t *)mp->cached_mappings[best].base;
+      length = mp->cached_mappings[best].length;
+      memmove(&mp->cached_mappings[best], &mp->cached_mappings[best + 1],
+              (mp->cached_mapping_count - best - 1) * sizeof(cached_mapping));
+      --mp->cached_mapping_count;
+    }
+
+    if (mp->should_use_locks) {
+      pool_lock_release(&mp->lock);
     }
   }
 
-  if (mp->should_use_locks) {
-    rw_lock_unlock(&mp->lock);
+  if (!base) {
+    base = (uint8_t *)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      return NULL;
+    }
   }
 
-  return result;
+  *(size_t *)base = length;
+  entry_header *header = (entry_header *)(base + mp->header_offset);
+  header->elem_status = elem_is_not_a_pool_member;
+  header->pool_ptr = mp;
+  mempool_count_dynamic_header(mp);
+
+  return header;
 }
 
-void *mempool_calloc_entry(mempool *mp) {
-  void *result = mempool_alloc_entry(mp);
+static inline size_t mempool_mapped_user_size(mempool *mp,
+                                              entry_header *header) {
+  uint8_t *base = (uint8_t *)header - mp->header_offset;
+  return *(size_t *)base - mp->header_offset - offsetof(entry_header, next);
+}
 
-  if (result) {
-    memset(result, 0, EXT_SIZE_TO_USER_SIZE(mp->ext_elem_size));
+// Resizes the mapping of a large entry, which may move it. The offset of
+// the header within the first page stays the same, so does the alignment.
+static entry_header *mempool_remap_dynamic_header(mempool *mp,
+                                                  entry_header *header,
+                                                  size_t size) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t user_offset = mp->header_offset + offsetof(entry_header, next);
+  uint8_t *base = (uint8_t *)header - mp->header_offset;
+  if (size > SIZE_MAX - user_offset - page_size) {
+    return NULL;
   }
 
-  return result;
-}
+  size_t length = (user_offset + size + page_size - 1) & ~(page_size - 1);
+  uint8_t *new_base =
+      (uint8_t *)mremap(base, *(size_t *)base, length, MREMAP_MAYMOVE);
+  if (new_base == MAP_FAILED) {
+    return NULL;
+  }
 
-static inline bool valid_mempool_addr(mempool *mp, uintptr_t c_entry) {
-  return (c_entry >= mp->lower_addr_limit) &&
-         (c_entry < mp->upper_addr_limit) &&
-         (c_entry - mp->lower_addr_limit) % mp->ext_elem_size == 0;
+  *(size_t *)new_base = length;
+  return (entry_header *)(new_base + mp->header_offset);
 }
 
-void __mempool_free_entry(mempool *mp, entry_header *header) {
-  if (!mp) {
-    assert(false);
-  }
-
-  uintptr_t c_header = (uintptr_t)header;
+// Puts the mapping of a released large entry into the cache, evicting
+// the oldest one if the cache is full.
+static void mempool_unmap_dynamic_header(mempool *mp, entry_header *header) {
+  uint8_t *base = (uint8_t *)header - mp->header_offset;
+  cached_mapping evicted = {base, *(size_t *)base};
 
-  if (mp->should_use_locks) {
-    rw_lock_wrlock(&mp->lock);
-  }
+  // Catches the double frees while the mapping sits in the cache.
+  header->elem_status = elem_is_free;
 
-  if (header->elem_status == elem_is_not_a_pool_member) {
-    // We allocated this buffer when we had exhausted
-    // our own buffers.
-    if (mp->active_dynamic_memory_buffer_count == 0) {
-      // Something is not right, most probably a double free
-      if (mp->should_use_locks) {
-        rw_lock_unlock(&mp->lock);
-      }
-      assert(false);
-    }
-    --mp->active_dynamic_memory_buffer_count;
-    mem_free(header);
+  if (mp->max_cached_mappings > 0) {
     if (mp->should_use_locks) {
-      rw_lock_unlock(&mp->lock);
+      pool_lock_acquire(&mp->lock);
     }
-    return;
-  }
-
-  if (valid_mempool_addr(mp, c_header)) {
-    if (header->elem_status != elem_is_taken) {
-      // This block seems to be tampered with
-      addr_t addr = header->next;
-      if (valid_mempool_addr(mp, (uintptr_t)(*addr))) {
-        // Was this address returned to the pool before?
-        if (header->elem_status == elem_is_free) {
-          // Double free!
-          if (mp->should_use_locks) {
-            rw_lock_unlock(&mp->lock);
-          }
-          assert(false);
-        }
-      }
 
-      // Somehow the entry got overwritten.
-      if (mp->should_use_locks) {
-        rw_lock_unlock(&mp->lock);
-      }
-      assert(false);
+    cached_mapping released = evicted;
+    evicted.base = NULL;
+    if (mp->cached_mapping_count == mp->max_cached_mappings) {
+      evicted = mp->cached_mappings[0];
+      memmove(&mp->cached_mappings[0], &mp->cached_mappings[1],
+              (mp->cached_mapping_count - 1) * sizeof(cached_mapping));
+      --mp->cached_mapping_count;
     }
+    mp->cached_mappings[mp->cached_mapping_count++] = released;
 
-    header->elem_status = elem_is_free;
-    header->next = (addr_t)mp->free_inst;
-    mp->free_inst = header;
-    ++mp->free_elem_count;
-  } else {
     if (mp->should_use_locks) {
-      rw_lock_unlock(&mp->lock);
+      pool_lock_release(&mp->lock);
     }
-    assert(false);
   }
 
-  if (mp->should_use_locks) {
-    rw_lock_unlock(&mp->lock);
+  if (evicted.base) {
+    munmap(evicted.base, evicted.length);
   }
 }
 
-void _mempool_free_entry(void *entry) {
-  if (!entry) {
-    // Let's resemble the dynamic memory allocation approach here.
-    // Releasing a NULL pointer is acceptable.
-    return;
-  }
+static inline void mempool_count_failed_allocs(mempool *mp, uint32_t count) {
+  __atomic_add_fetch(&mp->failed_allocs_count, count, __ATOMIC_RELAXED);
+}
 
-  entry_header *header = ENTRY_TO_HEADER(entry);
+// Called whenever entries get taken off the free list, with the free
+// element count left. The entries in the magazines count as used here.
+static inline void mempool_raise_peak_used(mempool *mp, uint32_t free_count) {
+  counter_raise_peak(&mp->peak_used_count, mp->total_elem_count - free_count);
+}
 
-  // Let's check the invariant parts.
-  if (!header) {
-    assert(false);
-  }
+// The dynamically allocated entries come with a header, even for the
+// headerless pools.
+static inline uint32_t mempool_dynamic_ext_elem_size(mempool *mp) {
+  return mp->is_headerless
+             ? aligned_ext_elem_size(mp->ext_elem_size, mp->alignment)
+             : mp->ext_elem_size;
+}
 
-  if (!header->pool_ptr) {
-    assert(false);
-  }
+static inline uint32_t mempool_user_size(mempool *mp) {
+  return mp->is_headerless ? mp->ext_elem_size
+                           : EXT_SIZE_TO_USER_SIZE(mp->ext_elem_size);
+}
 
-  if (header->pool_ptr->mempool_mark != _mempool_mark) {
-    assert(false);
+static inline void mempool_free_dynamic_header(mempool *mp,
+                                               entry_header *header) {
+  if (mp->maps_entries) {
+    mempool_unmap_dynamic_header(mp, header);
+    return;
   }
 
-  // Passed the initial checks, no corruption so far.
-  __mempool_free_entry(header->pool_ptr, header);
+  mem_free((uint8_t *)header - mp->header_offset);
 }
 
-uint32_t mempool_total_capacity(mempool *mp) {
-  if (!mp) {
-    assert(false);
+// Thread slot management for the per-thread magazines. A slot is
+// released when its thread exits, and the next thread acquiring it
+// inherits the entries left in its magazines, so nothing leaks.
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_cache_key;
+static pthread_mutex_t thread_cache_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool thread_cache_slot_taken[MAX_THREAD_CACHE_SLOTS];
+
+#define THREAD_CACHE_SLOT_UNASSIGNED (-1)
+#define THREAD_CACHE_SLOT_UNAVAILABLE (-2)
+static __thread int32_t thread_cache_slot = THREAD_CACHE_SLOT_UNASSIGNED;
+
+static void release_thread_cache_slot(void *value) {
+  int32_t slot = (int32_t)((intptr_t)value - 1);
+
+  // The frees made later on by the exiting thread, e.g. from the other
+  // key destructors, should go to the shared free lists, as the slot
+  // may be taken by another thread right away.
+  thread_cache_slot = THREAD_CACHE_SLOT_UNAVAILABLE;
+
+  pthread_mutex_lock(&thread_cache_slots_lock);
+  thread_cache_slot_taken[slot] = false;
+  pthread_mutex_unlock(&thread_cache_slots_lock);
+}
+
+static void create_thread_cache_key(void) {
+  if (pthread_key_create(&thread_cache_key, release_thread_cache_slot) != 0) {
+    // Without the key we can't give the slots back, so let's
+    // disable the magazines for good.
+    pthread_mutex_lock(&thread_cache_slots_lock);
+    for (uint32_t i = 0; i < MAX_THREAD_CACHE_SLOTS; ++i) {
+      thread_cache_slot_taken[i] = true;
+    }
+    pthread_mutex_unlock(&thread_cache_slots_lock);
   }
+}
 
-  uint32_t result = 0;
+static int32_t acquire_thread_cache_slot(void) {
+  pthread_once(&thread_cache_key_once, create_thread_cache_key);
 
-  if (mp->should_use_locks) {
-    rw_lock_rdlock(&mp->lock);
-  }
+  int32_t slot = THREAD_CACHE_SLOT_UNAVAILABLE;
 
-  result = mp->total_elem_count;
+  pthread_mutex_lock(&thread_cache_slots_lock);
+  for (int32_t i = 0; i < MAX_THREAD_CACHE_SLOTS; ++i) {
+    if (!thread_cache_slot_taken[i]) {
+      thread_cache_slot_taken[i] = true;
+      slot = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&thread_cache_slots_lock);
 
-  if (mp->should_use_locks) {
-    rw_lock_unlock(&mp->lock);
+  if (slot >= 0 &&
+      pthread_setspecific(thread_cache_key, (void *)(intptr_t)(slot + 1)) !=
+          0) {
+    release_thread_cache_slot((void *)(intptr_t)(slot + 1));
+    slot = THREAD_CACHE_SLOT_UNAVAILABLE;
   }
 
-  return result;
+  thread_cache_slot = slot;
+  return slot;
 }
 
-uint32_t mempool_used_count(mempool *mp) {
-  if (!mp) {
-    assert(false);
+static inline thread_cache *mempool_thread_cache(mempool *mp) {
+  int32_t slot = thread_cache_slot;
+  if (slot == THREAD_CACHE_SLOT_UNASSIGNED) {
+    slot = acquire_thread_cache_slot();
   }
 
-  uint32_t result = 0;
+  return slot >= 0 ? &mp->thread_caches[slot] : NULL;
+}
 
-  if (mp->should_use_locks) {
-    rw_lock_rdlock(&mp->lock);
+static inline void thread_cache_set_count(thread_cache *tc, uint32_t count) {
+  // Only the owner thread writes, the statistics functions may read.
+  __atomic_store_n(&tc->count, count, __ATOMIC_RELAXED);
+}
+
+bool mempool_init_thread_caches(mempool *mp, uint32_t thread_cache_size) {
+  if (thread_cache_size == 0) {
+    return true;
   }
 
-  result = mp->total_elem_count - mp->free_elem_count;
+  if (thread_cache_size > MEMPOOL_MAX_THREAD_CACHE_SIZE) {
+    return false;
+  }
 
-  if (mp->should_use_locks) {
-    rw_lock_unlock(&mp->lock);
+  mp->thread_caches = (thread_cache *)aligned_alloc(
+      sizeof(thread_cache), MAX_THREAD_CACHE_SLOTS * sizeof(thread_cache));
+  if (!mp->thread_caches) {
+    return false;
   }
+  memset(mp->thread_caches, 0, MAX_THREAD_CACHE_SLOTS * sizeof(thread_cache));
 
-  return result;
+  mp->thread_cache_entries = (entry_header **)mem_calloc(
+      MAX_THREAD_CACHE_SLOTS * thread_cache_size, sizeof(entry_header *));
+  if (!mp->thread_cache_entries) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < MAX_THREAD_CACHE_SLOTS; ++i) {
+    mp->thread_caches[i].entries =
+        &mp->thread_cache_entries[i * thread_cache_size];
+  }
+  mp->thread_cache_size = thread_cache_size;
+
+  return true;
 }
 
-uint32_t mempool_dynamic_allocs_count(mempool *mp) {
-  if (!mp) {
-    assert(false);
+// The registry of the headerless slabs, an open addressing hash set of
+// their base addresses. It lets _mempool_free_entry tell the headerless
+// entries apart from the ones with a header, and it is only looked up
+// while there are headerless slabs around. The lookups don't take the
+// lock, the slots are read and written atomically.
+#define HEADERLESS_REGISTRY_BITS 13
+#define HEADERLESS_REGISTRY_SIZE (1u << HEADERLESS_REGISTRY_BITS)
+#define HEADERLESS_REGISTRY_REMOVED ((uintptr_t)1)
+
+static pthread_mutex_t headerless_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static uintptr_t headerless_registry[HEADERLESS_REGISTRY_SIZE];
+static uint32_t headerless_registry_count;
+
+static inline uint32_t headerless_registry_hash(uintptr_t base) {
+  return (uint32_t)(((uint64_t)(base / HEADERLESS_SLAB_SIZE) *
+                     0x9e3779b97f4a7c15ull) >>
+                    (64 - HEADERLESS_REGISTRY_BITS));
+}
+
+static bool headerless_registry_add(headerless_slab *slab) {
+  uintptr_t base = (uintptr_t)slab;
+  bool result = false;
+
+  pthread_mutex_lock(&headerless_registry_lock);
+  // Keeping the load factor below one half keeps the probes short.
+  if (headerless_registry_count < HEADERLESS_REGISTRY_SIZE / 2) {
+    uint32_t i = headerless_registry_hash(base);
+    while (headerless_registry[i] > HEADERLESS_REGISTRY_REMOVED) {
+      i = (i + 1) & (HEADERLESS_REGISTRY_SIZE - 1);
+    }
+    __atomic_store_n(&headerless_registry[i], base, __ATOMIC_RELEASE);
+    __atomic_store_n(&headerless_registry_count, headerless_registry_count + 1,
+                     __ATOMIC_RELAXED);
+    result = true;
   }
+  pthread_mutex_unlock(&headerless_registry_lock);
 
-  uint32_t result = 0;
+  return result;
+}
 
-  if (mp->should_use_locks) {
-    rw_lock_rdlock(&mp->lock);
+static void headerless_registry_remove(headerless_slab *slab) {
+  uintptr_t base = (uintptr_t)slab;
+
+  pthread_mutex_lock(&headerless_registry_lock);
+  uint32_t i = headerless_registry_hash(base);
+  while (headerless_registry[i] != base) {
+    i = (i + 1) & (HEADERLESS_REGISTRY_SIZE - 1);
+  }
+  __atomic_store_n(&headerless_registry[i], HEADERLESS_REGISTRY_REMOVED,
+                   __ATOMIC_RELEASE);
+  // A tombstone followed by an empty slot ends every probe sequence
+  // passing through it, so it can become empty too, and so can the
+  // tombstones before it. Only the tombstones in front of the slabs
+  // still registered are kept, and the lookups that don't take the
+  // lock never skip past a slab this way, unlike with moving the slots
+  // back. Once the last slab is gone, the registry is empty again.
+  while (headerless_registry[i] == HEADERLESS_REGISTRY_REMOVED &&
+         headerless_registry[(i + 1) & (HEADERLESS_REGISTRY_SIZE - 1)] == 0) {
+    __atomic_store_n(&headerless_registry[i], 0, __ATOMIC_RELEASE);
+    i = (i - 1) & (HEADERLESS_REGISTRY_SIZE - 1);
   }
+  __atomic_store_n(&headerless_registry_count, headerless_registry_count - 1,
+                   __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&headerless_registry_lock);
+}
 
-  result = mp->active_dynamic_memory_buffer_count;
+#ifdef RUNNING_UNIT_TESTS
+// The number of the registry slots which aren't empty, the tombstones
+// included.
+uint32_t headerless_registry_used_slot_count(void) {
+  uint32_t result = 0;
 
-  if (mp->should_use_locks) {
-    rw_lock_unlock(&mp->lock);
+  pthread_mutex_lock(&headerless_registry_lock);
+  for (uint32_t i = 0; i < HEADERLESS_REGISTRY_SIZE; ++i) {
+    result += headerless_registry[i] != 0;
   }
+  pthread_mutex_unlock(&headerless_registry_lock);
 
   return result;
 }
 
-// Ranged memory pool implementation starts
-const uint32_t min_allowed_smallest_size = 16;
-const uint32_t max_allowed_largest_size = 2147483648;
+// The slabs of the pools land far apart in the registry, these let the
+// tests fill it with made up slab addresses to form clusters.
+bool headerless_registry_add_base(uintptr_t base) {
+  return headerless_registry_add((headerless_slab *)base);
+}
 
-struct r_mempool {
-  mempool **mem_pools;  // The real memory pools
-  mempool pseudo_pool;
-  r_memory_fallback_policy_t fb_policy;
-  bool should_use_locks;
-  uint32_t number_of_mempools;
-  uint32_t *reverse_size_lookup_array;
-  uint32_t reverse_size_lookup_array_length;
-  uint32_t smallest_size;
-  uint32_t largest_size;
-  uint32_t smallest_elem_count;
-};
+void headerless_registry_remove_base(uintptr_t base) {
+  headerless_registry_remove((headerless_slab *)base);
+}
+#endif
 
-void _r_mempool_destroy(r_mempool *rmp) {
-  if (rmp) {
-    if (rmp->mem_pools) {
-      for (uint32_t i = 0; i < rmp->number_of_mempools; ++i) {
-        if (rmp->mem_pools[i]) {
-          mempool_destroy(rmp->mem_pools[i]);
+// Returns the headerless slab holding the given entry, or NULL if the
+// entry has a header.
+static inline headerless_slab *headerless_slab_of(void *entry) {
+  if (__atomic_load_n(&headerless_registry_count, __ATOMIC_RELAXED) == 0) {
+    return NULL;
+  }
+
+  uintptr_t base = (uintptr_t)HEADERLESS_ENTRY_TO_SLAB(entry);
+  uint32_t i = headerless_registry_hash(base);
+  for (uint32_t probes = 0; probes < HEADERLESS_REGISTRY_SIZE; ++probes) {
+    uintptr_t slot = __atomic_load_n(&headerless_registry[i], __ATOMIC_ACQUIRE);
+    if (slot == base) {
+      return (headerless_slab *)base;
+    } else if (slot == 0) {
+      break;
+    }
+    i = (i + 1) & (HEADERLESS_REGISTRY_SIZE - 1);
+  }
+
+  return NULL;
+}
+
+void _mempool_destroy(mempool *mp) {
+  if (mp) {
+    if (mp->shards) {
+      for (uint32_t i = 0; i < mp->shard_count; ++i) {
+        if (mp->shards[i]) {
+          mempool_destroy(mp->shards[i]);
         }
       }
-      mem_free(rmp->mem_pools);
+      mem_free(mp->shards);
     }
-    if (rmp->reverse_size_lookup_array) {
-      mem_free(rmp->reverse_size_lookup_array);
+    if (!mp->is_preallocated && mp->objects) {
+      mempool_release_objects(mp);
+    }
+    if (mp->trimmed_entries) {
+      mem_free(mp->trimmed_entries);
+    }
+    if (mp->headerless_slabs) {
+      for (uint32_t i = 0; i < mp->headerless_slab_count; ++i) {
+        headerless_registry_remove(mp->headerless_slabs[i]);
+        mem_free(mp->headerless_slabs[i]);
+      }
+      mem_free(mp->headerless_slabs);
+    }
+    if (mp->slabs) {
+      for (uint32_t i = 0; i < mp->slab_count; ++i) {
+        mem_free((void *)(mp->slabs[i].lower_addr_limit - mp->header_offset));
+      }
+      mem_free(mp->slabs);
+    }
+    if (mp->thread_caches) {
+      mem_free(mp->thread_caches);
+    }
+    if (mp->thread_cache_entries) {
+      mem_free(mp->thread_cache_entries);
     }
+    if (mp->should_use_locks) {
+      pool_lock_destroy(&mp->lock);
+    }
+    mem_free(mp);
+  }
+}
+
+void mempool_init_internal_scalars(mempool *mp, uint32_t elem_count,
+                                   uint32_t ext_elem_size,
+                                   bool fallback_to_dynamic_memory,
+                                   bool lazy_init) {
+  if (lazy_init) {
+    // The entries will be carved out of the buffer on demand.
+    mp->free_inst = NULL;
+    mp->free_head = LF_HEAD(0, 0);
+    mp->bump_index = 0;
+  } else {
+    for (uint32_t i = 0; i < elem_count; ++i) {
+      entry_header *header =
+          (entry_header *)((uintptr_t)mp->objects + mp->header_offset +
+                           (uintptr_t)i * ext_elem_size);
+      header->elem_status = elem_is_free;
+      header->pool_ptr = mp;
 
-    if (rmp->fb_policy == fallback_at_last_exhaustion) {
-      if (rmp->should_use_locks) {
-        rw_lock_destroy(&rmp->pseudo_pool.lock);
+      if (i == (elem_count - 1)) {
+        header->next = NULL;
+      } else {
+        header->next = (addr_t)((uintptr_t)header + ext_elem_size);
       }
     }
 
-    mem_free(rmp);
+    mp->free_inst = (void *)((uintptr_t)mp->objects + mp->header_offset);
+    mp->free_head = LF_HEAD(0, 1);
+    mp->bump_index = elem_count;
   }
+
+  mp->mempool_mark = _mempool_mark;
+  mp->ext_elem_size = ext_elem_size;
+  mp->total_elem_count = elem_count;
+  mp->fallback_to_dynamic_memory = fallback_to_dynamic_memory;
+  mp->active_dynamic_memory_buffer_count = 0;
+  mp->lower_addr_limit = (uintptr_t)mp->objects + mp->header_offset;
+  mp->upper_addr_limit =
+      mp->lower_addr_limit + (uintptr_t)ext_elem_size * elem_count;
+  mp->free_elem_count = elem_count;
 }
 
-bool assess_r_mempool_create_inputs(r_mempool *rmp,
-                                    uint8_t smallest_size_power_of_two,
-                                    uint8_t largest_size_power_of_two,
-                                    uint8_t smallest_elem_count_power_of_two,
-                                    r_memory_fallback_policy_t fb_policy,
-                                    bool will_be_accessed_by_only_one_thread) {
-  if (smallest_size_power_of_two == 0 || largest_size_power_of_two == 0 ||
-      smallest_elem_count_power_of_two == 0) {
+bool mempool_init_locking(mempool *mp, const mempool_config *config) {
+  if (config->lock_policy < 0 ||
+      config->lock_policy >= __lock_policy_end_place_holder) {
     return false;
   }
 
-  if (largest_size_power_of_two <= smallest_size_power_of_two ||
-      (smallest_elem_count_power_of_two <
-       (largest_size_power_of_two - smallest_size_power_of_two))) {
+  mp->is_lock_free = config->lock_policy == lock_policy_lock_free;
+  mp->should_use_locks = !mp->is_lock_free &&
+                         config->lock_policy != lock_policy_none;
+
+  if (mp->should_use_locks) {
+    if (pool_lock_init(&mp->lock, config->lock_policy) != 0) {
+      mp->should_use_locks = false;
+      return false;
+    }
+  }
+
+  return mempool_init_thread_caches(mp, config->thread_cache_size);
+}
+
+bool mempool_init_growth(mempool *mp, uint32_t elem_count,
+                         const mempool_config *config) {
+  if (config->max_elem_count <= elem_count) {
+    return true;
+  }
+
+  if (mp->is_lock_free) {
+    return false;
+  }
+
+  mp->slabs =
+      (mempool_slab *)mem_calloc(MAX_MEMPOOL_SLABS, sizeof(mempool_slab));
+  if (!mp->slabs) {
     return false;
   }
+  mp->max_slab_count = MAX_MEMPOOL_SLABS;
+  mp->max_elem_count = config->max_elem_count;
+
+  return true;
+}
+
+// Carves a headerless slab out of a fresh, naturally aligned block and
+// registers it. Its entries get chained in front of the free list.
+static headerless_slab *mempool_add_headerless_slab(mempool *mp,
+                                                    uint32_t elem_count,
+                                                    uint32_t first_offset) {
+  headerless_slab *slab = (headerless_slab *)aligned_alloc(
+      HEADERLESS_SLAB_SIZE, HEADERLESS_SLAB_SIZE);
+  if (!slab) {
+    return NULL;
+  }
+
+  slab->pool_ptr = mp;
+  slab->first_entry = (uintptr_t)slab + first_offset;
+  slab->elem_count = elem_count;
+  memset(slab->taken, 0, ((elem_count + 63) / 64) * sizeof(uint64_t));
+
+  for (uint32_t i = 0; i < elem_count; ++i) {
+    addr_t entry =
+        (addr_t)(slab->first_entry + (uintptr_t)i * mp->ext_elem_size);
+    *entry = i == (elem_count - 1) ? (uintptr_t)mp->free_inst
+                                   : (uintptr_t)entry + mp->ext_elem_size;
+  }
+
+  if (!headerless_registry_add(slab)) {
+    mem_free(slab);
+    return NULL;
+  }
+  mp->free_inst = (void *)slab->first_entry;
+
+  return slab;
+}
+
+static mempool *mempool_create_headerless(uint32_t elem_count,
+                                          uint32_t elem_size,
+                                          const mempool_config *config) {
+  if (config->lock_policy == lock_policy_lock_free ||
+      config->thread_cache_size || config->lazy_init ||
+      config->max_elem_count || config->page_backing != page_backing_heap) {
+    return NULL;
+  }
+
+  // The free entries keep the free list links in themselves.
+  uint32_t entry_alignment =
+      config->alignment > sizeof(addr_t) ? config->alignment : sizeof(addr_t);
+  uint64_t ext_elem_size =
+      ((uint64_t)elem_size + entry_alignment - 1) &
+      ~(uint64_t)(entry_alignment - 1);
+
+  // Every entry costs a bit in the bitmap on top of its own size. The
+  // extra qword covers the rounding of the bitmap size.
+  uint64_t usable_size = HEADERLESS_SLAB_SIZE - sizeof(headerless_slab) -
+                         entry_alignment - sizeof(uint64_t);
+  uint32_t slab_elem_count =
+      (uint32_t)(usable_size * 8 / (ext_elem_size * 8 + 1));
+  if (slab_elem_count == 0) {
+    return NULL;
+  }
+
+  uint32_t first_offset =
+      (sizeof(headerless_slab) +
+       ((slab_elem_count + 63) / 64) * sizeof(uint64_t) + entry_alignment -
+       1) &
+      ~(entry_alignment - 1);
+
+  mempool *mp = mempool_alloc_struct();
+  if (!mp) {
+    return NULL;
+  }
+
+  mempool_set_alignment(mp, elem_size, config->alignment);
+  mp->ext_elem_size = (uint32_t)ext_elem_size;
+  mp->is_headerless = true;
+
+  uint32_t slab_count = (elem_count + slab_elem_count - 1) / slab_elem_count;
+  mp->headerless_slabs =
+      (headerless_slab **)mem_calloc(slab_count, sizeof(headerless_slab *));
+  if (!mp->headerless_slabs || !mempool_init_locking(mp, config)) {
+    mempool_destroy(mp);
+    return NULL;
+  }
+
+  // The last slab gets added first, so that the free list starts with
+  // the first one.
+  for (uint32_t i = slab_count; i > 0; --i) {
+    uint32_t count = i == slab_count
+                         ? elem_count - (slab_count - 1) * slab_elem_count
+                         : slab_elem_count;
+    headerless_slab *slab =
+        mempool_add_headerless_slab(mp, count, first_offset);
+    if (!slab) {
+      mempool_destroy(mp);
+      return NULL;
+    }
+    mp->headerless_slabs[mp->headerless_slab_count++] = slab;
+  }
+
+  mp->mempool_mark = _mempool_mark;
+  mp->total_elem_count = elem_count;
+  mp->free_elem_count = elem_count;
+  mp->fallback_to_dynamic_memory = config->fallback_to_dynamic_memory;
+
+  return mp;
+}
+
+mempool *mempool_create_with_config(uint32_t elem_count, uint32_t elem_size,
+                                    const mempool_config *config) {
+  if (!config || elem_count == 0 || elem_count == UINT32_MAX ||
+      elem_size == 0 || !valid_mempool_alignment(config->alignment) ||
+      !valid_mempool_page_backing(config->page_backing)) {
+    return NULL;
+  } else if (elem_size < sizeof(addr_t)) {
+    elem_size = sizeof(addr_t);
+  }
+
+  if (config->headerless) {
+    return mempool_create_headerless(elem_count, elem_size, config);
+  }
+
+  mempool *mp = mempool_alloc_struct();
+  if (!mp) {
+    return NULL;
+  }
+
+  mempool_set_alignment(mp, elem_size, config->alignment);
+  uint32_t ext_elem_size = mp->ext_elem_size;
+  mp->objects = ext_elem_size ? mempool_create_objects(mp, elem_count, config)
+                              : NULL;
+  if (!mp->objects) {
+    mempool_destroy(mp);
+    return NULL;
+  }
+
+  if (!mempool_init_locking(mp, config) ||
+      !mempool_init_growth(mp, elem_count, config)) {
+    mempool_destroy(mp);
+    return NULL;
+  }
+
+  mempool_init_internal_scalars(mp, elem_count, ext_elem_size,
+                                config->fallback_to_dynamic_memory,
+                                config->lazy_init);
+
+  return mp;
+}
+
+mempool *mempool_create(uint32_t elem_count, uint32_t elem_size,
+                        bool fallback_to_dynamic_memory,
+                        bool will_be_accessed_by_only_one_thread) {
+  mempool_config config = {
+      .fallback_to_dynamic_memory = fallback_to_dynamic_memory,
+      .lock_policy = will_be_accessed_by_only_one_thread ? lock_policy_none
+                                                         : lock_policy_rwlock,
+  };
+
+  return mempool_create_with_config(elem_count, elem_size, &config);
+}
+
+mempool *mempool_create_from_preallocated_buffer_with_config(
+    void *buffer, uint32_t buf_size, uint32_t elem_size,
+    const mempool_config *config) {
+  if (!config || !buffer || elem_size < sizeof(addr_t) ||
+      buf_size < (sizeof(entry_header)) ||
+      !valid_mempool_alignment(config->alignment) || config->headerless ||
+      config->page_backing != page_backing_heap) {
+    return NULL;
+  }
+
+  uint32_t ext_elem_size = aligned_ext_elem_size(elem_size, config->alignment);
+  // The unaligned head of the buffer, if any, is skipped.
+  uint32_t skipped_size =
+      config->alignment
+          ? (uint32_t)(-(uintptr_t)buffer & (config->alignment - 1)) +
+                aligned_header_offset(config->alignment)
+          : 0;
+  if (ext_elem_size == 0 || skipped_size >= buf_size) {
+    return NULL;
+  }
+
+  uint32_t elem_count = (buf_size - skipped_size) / ext_elem_size;
+  if (elem_count == 0 || elem_count == UINT32_MAX) {
+    return NULL;
+  }
+
+  mempool *mp = mempool_alloc_struct();
+  if (!mp) {
+    return NULL;
+  }
+  mempool_set_alignment(mp, elem_size, config->alignment);
+  mp->is_preallocated = true;
+  mp->objects = (uint8_t *)buffer + skipped_size - mp->header_offset;
+
+  if (!mempool_init_locking(mp, config) ||
+      !mempool_init_growth(mp, elem_count, config)) {
+    mempool_destroy(mp);
+    return NULL;
+  }
+
+  mempool_init_internal_scalars(mp, elem_count, ext_elem_size,
+                                config->fallback_to_dynamic_memory,
+                                config->lazy_init);
+
+  return mp;
+}
+
+mempool *mempool_create_from_preallocated_buffer(
+    void *buffer, uint32_t buf_size, uint32_t elem_size,
+    bool fallback_to_dynamic_memory, bool will_be_accessed_by_only_one_thread) {
+  mempool_config config = {
+      .fallback_to_dynamic_memory = fallback_to_dynamic_memory,
+      .lock_policy = will_be_accessed_by_only_one_thread ? lock_policy_none
+                                                         : lock_policy_rwlock,
+  };
+
+  return mempool_create_from_preallocated_buffer_with_config(
+      buffer, buf_size, elem_size, &config);
+}
+
+// Lock-free free list implementation. The head packs a generation
+// counter into its upper half and the index of the first free entry
+// plus one into its lower half (zero meaning an empty list). Every
+// successful update bumps the generation, so a head that was popped
+// and pushed back in between can't be mistaken for an unchanged one.
+static inline entry_header *lf_index_to_header(mempool *mp,
+                                               uint32_t index_plus_one) {
+  return (entry_header *)(mp->lower_addr_limit +
+                          (uintptr_t)(index_plus_one - 1) * mp->ext_elem_size);
+}
+
+static inline uint32_t lf_header_to_index(mempool *mp, uintptr_t header) {
+  // Garbage in, garbage out: a stale 'next' read by a racing pop only
+  // yields a bogus index, and the failing CAS throws it away.
+  return header ? (uint32_t)((header - mp->lower_addr_limit) /
+                             mp->ext_elem_size) + 1
+                : 0;
+}
+
+static inline entry_header *mempool_init_untouched_entry(mempool *mp,
+                                                         uint32_t index) {
+  entry_header *header = (entry_header *)(mp->lower_addr_limit +
+                                          (uintptr_t)index * mp->ext_elem_size);
+  header->elem_status = elem_is_free;
+  header->pool_ptr = mp;
+
+  return header;
+}
+
+static entry_header *mempool_lf_bump_entry(mempool *mp) {
+  uint32_t index = __atomic_load_n(&mp->bump_index, __ATOMIC_RELAXED);
+
+  do {
+    if (index >= mp->total_elem_count) {
+      return NULL;
+    }
+  } while (!__atomic_compare_exchange_n(&mp->bump_index, &index, index + 1,
+                                        true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+
+  mempool_raise_peak_used(
+      mp, __atomic_sub_fetch(&mp->free_elem_count, 1, __ATOMIC_RELAXED));
+  return mempool_init_untouched_entry(mp, index);
+}
+
+static entry_header *mempool_lf_pop(mempool *mp) {
+  uint64_t head = __atomic_load_n(&mp->free_head, __ATOMIC_ACQUIRE);
+
+  for (;;) {
+    uint32_t index_plus_one = LF_HEAD_INDEX(head);
+    if (index_plus_one == 0) {
+      return mempool_lf_bump_entry(mp);
+    }
+
+    entry_header *header = lf_index_to_header(mp, index_plus_one);
+    uintptr_t next =
+        (uintptr_t)__atomic_load_n(&header->next, __ATOMIC_RELAXED);
+    uint64_t new_head =
+        LF_HEAD(LF_HEAD_GEN(head) + 1, lf_header_to_index(mp, next));
+
+    if (__atomic_compare_exchange_n(&mp->free_head, &head, new_head, true,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      mempool_raise_peak_used(
+          mp, __atomic_sub_fetch(&mp->free_elem_count, 1, __ATOMIC_RELAXED));
+
+      if (header->elem_status != elem_is_free || header->pool_ptr != mp) {
+        // We have a corruption!
+        assert(false);
+      }
+
+      return header;
+    }
+  }
+}
+
+// Pushes the chain first -> ... -> last of 'count' entries, all of
+// which should already be marked as free.
+static void mempool_lf_push_chain(mempool *mp, entry_header *first,
+                                  entry_header *last, uint32_t count) {
+  uint32_t first_index = lf_header_to_index(mp, (uintptr_t)first);
+  uint64_t head = __atomic_load_n(&mp->free_head, __ATOMIC_RELAXED);
+  uint64_t new_head = 0;
+
+  do {
+    uint32_t index_plus_one = LF_HEAD_INDEX(head);
+    last->next = index_plus_one
+                     ? (addr_t)lf_index_to_header(mp, index_plus_one)
+                     : NULL;
+    new_head = LF_HEAD(LF_HEAD_GEN(head) + 1, first_index);
+  } while (!__atomic_compare_exchange_n(&mp->free_head, &head, new_head, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  uint32_t free_count =
+      __atomic_fetch_add(&mp->free_elem_count, count, __ATOMIC_RELAXED);
+  if (mp->nonempty_word && free_count == 0) {
+    __atomic_or_fetch(mp->nonempty_word, mp->nonempty_bit, __ATOMIC_RELEASE);
+  }
+}
+
+mempool *mempool_create_sharded(uint32_t elem_count, uint32_t elem_size,
+                                uint32_t shard_count,
+                                const mempool_config *config) {
+  if (shard_count == 0) {
+    long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+    shard_count = cpu_count > 0 ? (uint32_t)cpu_count : 1;
+  }
+
+  if (!config || elem_count == 0 || elem_size == 0 ||
+      elem_count < shard_count || !valid_mempool_alignment(config->alignment) ||
+      !valid_mempool_page_backing(config->page_backing) || config->headerless) {
+    return NULL;
+  } else if (elem_size < sizeof(addr_t)) {
+    elem_size = sizeof(addr_t);
+  }
+
+  if (config->lock_policy < 0 ||
+      config->lock_policy >= __lock_policy_end_place_holder) {
+    return NULL;
+  }
+
+  mempool *mp = mempool_alloc_struct();
+  if (!mp) {
+    return NULL;
+  }
+
+  mempool_set_alignment(mp, elem_size, config->alignment);
+  uint32_t ext_elem_size = mp->ext_elem_size;
+  mp->objects = ext_elem_size ? mempool_create_objects(mp, elem_count, config)
+                              : NULL;
+  mp->shards = (mempool **)mem_calloc(shard_count, sizeof(mempool *));
+  if (!mp->objects || !mp->shards) {
+    mempool_destroy(mp);
+    return NULL;
+  }
+  mp->shard_count = shard_count;
+
+  // The shards use adjacent segments of the pool buffer, the first
+  // (elem_count % shard_count) of them get one extra element.
+  mempool_config shard_config = *config;
+  shard_config.fallback_to_dynamic_memory = false;
+  shard_config.page_backing = page_backing_heap;
+
+  uintptr_t sub_buffer = (uintptr_t)mp->objects;
+  for (uint32_t i = 0; i < shard_count; ++i) {
+    uint32_t shard_elem_count =
+        elem_count / shard_count + (i < elem_count % shard_count ? 1 : 0);
+    shard_config.max_elem_count =
+        config->max_elem_count / shard_count +
+        (i < config->max_elem_count % shard_count ? 1 : 0);
+    // An aligned shard also needs the header offset, which overlaps
+    // the unused head of the next segment.
+    mp->shards[i] = mempool_create_from_preallocated_buffer_with_config(
+        (void *)sub_buffer,
+        shard_elem_count * ext_elem_size + mp->header_offset, elem_size,
+        &shard_config);
+    if (!mp->shards[i]) {
+      mempool_destroy(mp);
+      return NULL;
+    }
+    // The shards live in the mapping of the pool, if any.
+    mp->shards[i]->page_backing = mp->page_backing;
+    sub_buffer += (uintptr_t)shard_elem_count * ext_elem_size;
+  }
+
+  mp->mempool_mark = _mempool_mark;
+  mp->total_elem_count = elem_count;
+  mp->fallback_to_dynamic_memory = config->fallback_to_dynamic_memory;
+  mp->lower_addr_limit = (uintptr_t)mp->objects + mp->header_offset;
+  mp->upper_addr_limit = sub_buffer + mp->header_offset;
+
+  return mp;
+}
+
+static inline uint32_t mempool_home_shard(mempool *mp) {
+  // With glibc 2.35+ sched_getcpu reads the CPU id registered via
+  // rseq, so this doesn't even cost a vDSO call.
+  int cpu = sched_getcpu();
+  return cpu > 0 ? (uint32_t)cpu % mp->shard_count : 0;
+}
+
+static void *mempool_alloc_dynamic_entry(mempool *mp) {
+  entry_header *header =
+      mempool_alloc_dynamic_header(mp, mempool_dynamic_ext_elem_size(mp));
+
+  return header ? (void *)&header->next : NULL;
+}
+
+static void mempool_free_dynamic_entry(mempool *mp, entry_header *header) {
+  uint32_t count = __atomic_load_n(&mp->active_dynamic_memory_buffer_count,
+                                   __ATOMIC_RELAXED);
+  do {
+    if (count == 0) {
+      // Something is not right, most probably a double free
+      assert(false);
+    }
+  } while (!__atomic_compare_exchange_n(&mp->active_dynamic_memory_buffer_count,
+                                        &count, count - 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  mempool_free_dynamic_header(mp, header);
+}
+
+// Headerless pool implementation. The free entries are chained via
+// their first word, and the bitmaps of the slabs tell the entries
+// handed out apart from the free ones. Both are protected by the
+// pool lock.
+static inline uint32_t headerless_entry_index(headerless_slab *slab,
+                                              uintptr_t entry) {
+  return (uint32_t)((entry - slab->first_entry) /
+                    slab->pool_ptr->ext_elem_size);
+}
+
+static inline bool headerless_entry_is_taken(headerless_slab *slab,
+                                             uint32_t index) {
+  return (slab->taken[index / 64] >> (index % 64)) & 1;
+}
+
+// Pops the first entry of the free list of a headerless pool. The pool
+// lock should be held by the caller. On corruption, the lock gets
+// released before the assertion fires.
+static inline void *mempool_headerless_pop_entry(mempool *mp) {
+  void *entry = mp->free_inst;
+  if (!entry) {
+    return NULL;
+  }
+
+  headerless_slab *slab = HEADERLESS_ENTRY_TO_SLAB(entry);
+  uint32_t index = headerless_entry_index(slab, (uintptr_t)entry);
+  if (slab->pool_ptr != mp || headerless_entry_is_taken(slab, index)) {
+    // We have a corruption!
+    if (mp->should_use_locks) {
+      pool_lock_release(&mp->lock);
+    }
+    assert(false);
+  }
+
+  slab->taken[index / 64] |= (uint64_t)1 << (index % 64);
+  mp->free_inst = (void *)*(addr_t)entry;
+  COUNTER_SUB(mp->free_elem_count, 1);
+  mempool_raise_peak_used(mp, mp->free_elem_count);
+
+  return entry;
+}
+
+static void mempool_headerless_free_entry(headerless_slab *slab,
+                                          void *entry) {
+  mempool *mp = slab->pool_ptr;
+  if (!mp || mp->mempool_mark != _mempool_mark) {
+    assert(false);
+  }
+
+  uintptr_t c_entry = (uintptr_t)entry;
+  if (c_entry < slab->first_entry ||
+      (c_entry - slab->first_entry) % mp->ext_elem_size != 0) {
+    // Not an entry of this slab at all.
+    assert(false);
+  }
+
+  uint32_t index = headerless_entry_index(slab, c_entry);
+  if (index >= slab->elem_count) {
+    assert(false);
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_acquire(&mp->lock);
+  }
+
+  if (!headerless_entry_is_taken(slab, index)) {
+    // Double free!
+    if (mp->should_use_locks) {
+      pool_lock_release(&mp->lock);
+    }
+    assert(false);
+  }
+
+  slab->taken[index / 64] &= ~((uint64_t)1 << (index % 64));
+  *(addr_t)entry = (uintptr_t)mp->free_inst;
+  mp->free_inst = entry;
+  COUNTER_ADD(mp->free_elem_count, 1);
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+}
+
+static void *mempool_sharded_alloc_entry(mempool *mp) {
+  uint32_t home = mempool_home_shard(mp);
+
+  void *result = mempool_alloc_entry(mp->shards[home]);
+  if (result) {
+    return result;
+  }
+
+  // The home shard is exhausted, let's steal from the neighbours,
+  // skipping the ones that look exhausted without locking them.
+  for (uint32_t i = 1; i < mp->shard_count; ++i) {
+    mempool *shard = mp->shards[(home + i) % mp->shard_count];
+    if (__atomic_load_n(&shard->free_elem_count, __ATOMIC_RELAXED) == 0 &&
+        !shard->thread_caches) {
+      continue;
+    }
+    result = mempool_alloc_entry(shard);
+    if (result) {
+      return result;
+    }
+  }
+
+  if (mp->fallback_to_dynamic_memory) {
+    result = mempool_alloc_dynamic_entry(mp);
+  }
+
+  if (!result) {
+    mempool_count_failed_allocs(mp, 1);
+  }
+
+  return result;
+}
+
+// Carves elem_count entries out of the given storage, puts them on the
+// free list, and records the storage as a new slab of the pool. The pool
+// lock should be held by the caller.
+static void mempool_add_slab_entries(mempool *mp, uint8_t *objects,
+                                     uint32_t elem_count) {
+  uintptr_t lower_addr_limit = (uintptr_t)objects + mp->header_offset;
+  for (uint32_t i = 0; i < elem_count; ++i) {
+    entry_header *header = (entry_header *)(lower_addr_limit +
+                                            (uintptr_t)i * mp->ext_elem_size);
+    header->elem_status = elem_is_free;
+    header->pool_ptr = mp;
+
+    if (i == (elem_count - 1)) {
+      header->next = (addr_t)mp->free_inst;
+    } else {
+      header->next = (addr_t)((uintptr_t)header + mp->ext_elem_size);
+    }
+  }
+
+  mp->slabs[mp->slab_count].lower_addr_limit = lower_addr_limit;
+  mp->slabs[mp->slab_count].upper_addr_limit =
+      lower_addr_limit + (uintptr_t)elem_count * mp->ext_elem_size;
+  __atomic_store_n(&mp->slab_count, mp->slab_count + 1, __ATOMIC_RELEASE);
+
+  mp->free_inst = (void *)lower_addr_limit;
+  COUNTER_ADD(mp->total_elem_count, elem_count);
+  COUNTER_ADD(mp->free_elem_count, elem_count);
+  // The slab entries are all initialized, there's nothing to bump.
+  mp->bump_index = mp->total_elem_count;
+}
+
+// Adds a new slab to an exhausted growing pool, as large as the pool
+// itself unless that exceeds max_elem_count, and puts its entries on
+// the free list. The pool lock should be held by the caller.
+static bool mempool_grow(mempool *mp) {
+  uint32_t elem_count = mp->total_elem_count;
+  if (elem_count >= mp->max_elem_count ||
+      mp->slab_count == mp->max_slab_count) {
+    return false;
+  } else if (elem_count > mp->max_elem_count - mp->total_elem_count) {
+    elem_count = mp->max_elem_count - mp->total_elem_count;
+  }
+
+  uint8_t *objects = (uint8_t *)mempool_alloc_objects(mp, elem_count);
+  if (!objects) {
+    return false;
+  }
+
+  mempool_add_slab_entries(mp, objects, elem_count);
+
+  return true;
+}
+
+// Creates a pool without any storage of its own, whose entries all come
+// from the slabs added by mempool_add_slab later on. Such a pool never
+// grows by itself, see the rebalancing ranged pools.
+static mempool *mempool_create_slabbed(uint32_t elem_size,
+                                       uint32_t max_slab_count,
+                                       const mempool_config *config) {
+  mempool *mp = mempool_alloc_struct();
+  if (!mp) {
+    return NULL;
+  }
+
+  mempool_set_alignment(mp, elem_size, 0);
+  if (!mempool_init_locking(mp, config)) {
+    mempool_destroy(mp);
+    return NULL;
+  }
+
+  mp->slabs = (mempool_slab *)mem_calloc(max_slab_count, sizeof(mempool_slab));
+  if (!mp->slabs) {
+    mempool_destroy(mp);
+    return NULL;
+  }
+  mp->max_slab_count = max_slab_count;
+
+  mempool_init_internal_scalars(mp, 0, mp->ext_elem_size,
+                                config->fallback_to_dynamic_memory, true);
+
+  return mp;
+}
+
+// Hands the given buffer of buf_size bytes over to a slabbed pool. The
+// pool owns the buffer afterwards, unless it gets taken back with
+// mempool_release_free_slab.
+static bool mempool_add_slab(mempool *mp, void *buffer, uint32_t buf_size) {
+  uint32_t elem_count = buf_size / mp->ext_elem_size;
+  bool result = false;
+
+  if (mp->should_use_locks) {
+    pool_lock_acquire(&mp->lock);
+  }
+
+  if (elem_count > 0 && mp->slab_count < mp->max_slab_count) {
+    bool was_exhausted = mp->free_elem_count == 0;
+    mempool_add_slab_entries(mp, (uint8_t *)buffer, elem_count);
+    if (was_exhausted && mp->nonempty_word) {
+      __atomic_or_fetch(mp->nonempty_word, mp->nonempty_bit, __ATOMIC_RELEASE);
+    }
+    result = true;
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+
+  return result;
+}
+
+static inline uint32_t mempool_slab_of(mempool *mp, uintptr_t c_entry,
+                                       uint32_t hint) {
+  if (c_entry >= mp->slabs[hint].lower_addr_limit &&
+      c_entry < mp->slabs[hint].upper_addr_limit) {
+    return hint;
+  }
+
+  for (uint32_t i = 0; i < mp->slab_count; ++i) {
+    if (c_entry >= mp->slabs[i].lower_addr_limit &&
+        c_entry < mp->slabs[i].upper_addr_limit) {
+      return i;
+    }
+  }
+
+  return mp->slab_count;
+}
+
+// Takes a slab whose entries are all free out of a slabbed pool, and
+// returns its buffer, or NULL if there is none. The last slab is always
+// kept. The free list gets walked twice, once to count the free entries
+// of every slab and once to unlink the ones of the chosen slab, which is
+// acceptable for the rebalancing, but not for an allocation path.
+static void *mempool_release_free_slab(mempool *mp) {
+  uint32_t *free_counts =
+      (uint32_t *)mem_calloc(mp->max_slab_count, sizeof(uint32_t));
+  if (!free_counts) {
+    return NULL;
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_acquire(&mp->lock);
+  }
+
+  uint32_t slab_index = mp->slab_count;
+  if (mp->slab_count > 1) {
+    uint32_t hint = 0;
+    for (entry_header *header = (entry_header *)mp->free_inst; header;
+         header = (entry_header *)header->next) {
+      hint = mempool_slab_of(mp, (uintptr_t)header, hint);
+      if (hint == mp->slab_count) {
+        // Not an entry of this pool, we have a corruption!
+        if (mp->should_use_locks) {
+          pool_lock_release(&mp->lock);
+        }
+        assert(false);
+      }
+      ++free_counts[hint];
+    }
+
+    for (uint32_t i = 0; i < mp->slab_count; ++i) {
+      uint32_t elem_count =
+          (uint32_t)((mp->slabs[i].upper_addr_limit -
+                      mp->slabs[i].lower_addr_limit) /
+                     mp->ext_elem_size);
+      if (free_counts[i] == elem_count) {
+        slab_index = i;
+        break;
+      }
+    }
+  }
+
+  void *result = NULL;
+  if (slab_index < mp->slab_count) {
+    mempool_slab slab = mp->slabs[slab_index];
+    uint32_t elem_count = free_counts[slab_index];
+
+    entry_header *previous = NULL;
+    entry_header *header = (entry_header *)mp->free_inst;
+    while (header) {
+      entry_header *next = (entry_header *)header->next;
+      if ((uintptr_t)header < slab.lower_addr_limit ||
+          (uintptr_t)header >= slab.upper_addr_limit) {
+        previous = header;
+      } else if (previous) {
+        previous->next = (addr_t)next;
+      } else {
+        mp->free_inst = next;
+      }
+      header = next;
+    }
+
+    // The order of the slabs doesn't matter, see valid_mempool_addr.
+    mp->slabs[slab_index] = mp->slabs[mp->slab_count - 1];
+    COUNTER_SUB(mp->slab_count, 1);
+    COUNTER_SUB(mp->total_elem_count, elem_count);
+    COUNTER_SUB(mp->free_elem_count, elem_count);
+    mp->bump_index = mp->total_elem_count;
+    result = (void *)(slab.lower_addr_limit - mp->header_offset);
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+
+  mem_free(free_counts);
+  return result;
+}
+
+// Takes the first trimmed entry, see mempool_trim. The caller should
+// make sure that there is one.
+static uint32_t mempool_untrim_entry(mempool *mp) {
+  uint32_t word = mp->trimmed_cursor;
+  while (mp->trimmed_entries[word] == 0) {
+    ++word;
+  }
+
+  uint32_t index = word * 64 + __builtin_ctzll(mp->trimmed_entries[word]);
+  mp->trimmed_entries[word] &= mp->trimmed_entries[word] - 1;
+  mp->trimmed_cursor = word;
+  COUNTER_SUB(mp->trimmed_count, 1);
+
+  return index;
+}
+
+// Pops the first entry of the free list, or carves a new one out of
+// the untouched part of a lazily initialized pool, or takes a trimmed
+// one, or one out of a new slab of a growing pool. The pool lock should
+// be held by the caller.
+static inline entry_header *mempool_pop_free_entry(mempool *mp) {
+  entry_header *header = (entry_header *)mp->free_inst;
+
+  if (header) {
+    if (header->elem_status != elem_is_free || header->pool_ptr != mp) {
+      // We have a corruption!
+      if (mp->should_use_locks) {
+        pool_lock_release(&mp->lock);
+      }
+      assert(false);
+    }
+    mp->free_inst = header->next;
+  } else if (mp->bump_index < mp->total_elem_count) {
+    header = mempool_init_untouched_entry(mp, mp->bump_index++);
+  } else if (mp->trimmed_count > 0) {
+    // Writing the header faults the page back in.
+    header = mempool_init_untouched_entry(mp, mempool_untrim_entry(mp));
+  } else if (mp->slabs && mempool_grow(mp)) {
+    header = (entry_header *)mp->free_inst;
+    mp->free_inst = header->next;
+  } else {
+    return NULL;
+  }
+
+  COUNTER_SUB(mp->free_elem_count, 1);
+  mempool_raise_peak_used(mp, mp->free_elem_count);
+  return header;
+}
+
+// Moves up to half a magazine worth of entries from the shared free
+// list into the given magazine, taking the lock only once.
+static void mempool_refill_thread_cache(mempool *mp, thread_cache *tc) {
+  uint32_t count = tc->count;
+  uint32_t target = (mp->thread_cache_size + 1) / 2;
+
+  if (mp->is_lock_free) {
+    entry_header *header = NULL;
+    while (count < target && (header = mempool_lf_pop(mp))) {
+      tc->entries[count++] = header;
+    }
+    thread_cache_set_count(tc, count);
+    return;
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_acquire(&mp->lock);
+  }
+
+  entry_header *header = NULL;
+  while (count < target && (header = mempool_pop_free_entry(mp))) {
+    tc->entries[count++] = header;
+  }
+  thread_cache_set_count(tc, count);
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+}
+
+// Moves the older half of the given magazine back to the shared free
+// list, taking the lock only once.
+static void mempool_drain_thread_cache(mempool *mp, thread_cache *tc) {
+  uint32_t drain_count = (tc->count + 1) / 2;
+
+  if (mp->is_lock_free) {
+    for (uint32_t i = 1; i < drain_count; ++i) {
+      tc->entries[i]->next = (addr_t)tc->entries[i - 1];
+    }
+    mempool_lf_push_chain(mp, tc->entries[drain_count - 1], tc->entries[0],
+                          drain_count);
+  } else {
+    if (mp->should_use_locks) {
+      pool_lock_acquire(&mp->lock);
+    }
+
+    for (uint32_t i = 0; i < drain_count; ++i) {
+      entry_header *header = tc->entries[i];
+      header->next = (addr_t)mp->free_inst;
+      mp->free_inst = header;
+    }
+    COUNTER_ADD(mp->free_elem_count, drain_count);
+
+    if (mp->nonempty_word && mp->free_elem_count == drain_count) {
+      __atomic_or_fetch(mp->nonempty_word, mp->nonempty_bit, __ATOMIC_RELEASE);
+    }
+  }
+
+  uint32_t remaining = tc->count - drain_count;
+  memmove(tc->entries, &tc->entries[drain_count],
+          remaining * sizeof(entry_header *));
+  thread_cache_set_count(tc, remaining);
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+}
+
+static void *mempool_lf_alloc_entry(mempool *mp) {
+  entry_header *header = mempool_lf_pop(mp);
+
+  if (header) {
+    header->elem_status = elem_is_taken;
+    return (void *)&header->next;
+  }
+
+  void *result = NULL;
+  if (mp->fallback_to_dynamic_memory) {
+    result = mempool_alloc_dynamic_entry(mp);
+  }
+
+  if (!result) {
+    mempool_count_failed_allocs(mp, 1);
+  }
+
+  return result;
+}
+
+static inline void *mempool_alloc_cached_entry(mempool *mp,
+                                               thread_cache *tc) {
+  if (tc->count == 0) {
+    mempool_refill_thread_cache(mp, tc);
+    if (tc->count == 0) {
+      return NULL;
+    }
+  }
+
+  entry_header *header = tc->entries[tc->count - 1];
+  if (header->elem_status != elem_is_free || header->pool_ptr != mp) {
+    // We have a corruption!
+    assert(false);
+  }
+  thread_cache_set_count(tc, tc->count - 1);
+
+  header->elem_status = elem_is_taken;
+  return (void *)&header->next;
+}
+
+void *mempool_alloc_entry(mempool *mp) {
+  if (!mp) {
+    assert(false);
+  }
+
+  void *result = NULL;
+
+  if (mp->shards) {
+    return mempool_sharded_alloc_entry(mp);
+  }
+
+  if (mp->thread_caches) {
+    thread_cache *tc = mempool_thread_cache(mp);
+    if (tc) {
+      result = mempool_alloc_cached_entry(mp, tc);
+      if (result) {
+        return result;
+      }
+      // The shared list is exhausted too, the following part
+      // will take care of the fallback, if there's any.
+    }
+  }
+
+  if (mp->is_lock_free) {
+    return mempool_lf_alloc_entry(mp);
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_acquire(&mp->lock);
+  }
+
+  if (mp->is_headerless) {
+    result = mempool_headerless_pop_entry(mp);
+  } else {
+    entry_header *header = mempool_pop_free_entry(mp);
+    if (header) {
+      header->elem_status = elem_is_taken;
+      result = (void *)&header->next;
+    }
+  }
+
+  if (!result && mp->fallback_to_dynamic_memory) {
+    // Seems like we exhausted our buffers and
+    // we are asked to fallback to the dynamic
+    // memory allocation mechanisms.
+    result = mempool_alloc_dynamic_entry(mp);
+  }
+
+  if (!result) {
+    mempool_count_failed_allocs(mp, 1);
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+
+  return result;
+}
+
+void *mempool_calloc_entry(mempool *mp) {
+  void *result = mempool_alloc_entry(mp);
+
+  if (result) {
+    memset(result, 0, mempool_user_size(mp));
+  }
+
+  return result;
+}
+
+static inline bool valid_mempool_addr(mempool *mp, uintptr_t c_entry) {
+  uintptr_t lower_addr_limit = mp->lower_addr_limit;
+  uintptr_t upper_addr_limit = mp->upper_addr_limit;
+
+  if ((c_entry < lower_addr_limit || c_entry >= upper_addr_limit) &&
+      mp->slabs) {
+    // Not in the initial buffer, let's look for it in the slabs,
+    // starting from the most recent and largest one.
+    uint32_t i = __atomic_load_n(&mp->slab_count, __ATOMIC_ACQUIRE);
+    while (i > 0) {
+      --i;
+      if (c_entry >= mp->slabs[i].lower_addr_limit &&
+          c_entry < mp->slabs[i].upper_addr_limit) {
+        lower_addr_limit = mp->slabs[i].lower_addr_limit;
+        upper_addr_limit = mp->slabs[i].upper_addr_limit;
+        break;
+      }
+    }
+  }
+
+  return (c_entry >= lower_addr_limit) && (c_entry < upper_addr_limit) &&
+         (c_entry - lower_addr_limit) % mp->ext_elem_size == 0;
+}
+
+static inline void mempool_lf_mark_entry_free(mempool *mp,
+                                              entry_header *header) {
+  uint32_t expected = elem_is_taken;
+  if (!valid_mempool_addr(mp, (uintptr_t)header) ||
+      !__atomic_compare_exchange_n(&header->elem_status, &expected,
+                                   elem_is_free, false, __ATOMIC_RELAXED,
+                                   __ATOMIC_RELAXED)) {
+    // Either a double free, or the entry got overwritten.
+    assert(false);
+  }
+}
+
+static void mempool_lf_free_entry(mempool *mp, entry_header *header) {
+  if (header->elem_status == elem_is_not_a_pool_member) {
+    mempool_free_dynamic_entry(mp, header);
+    return;
+  }
+
+  mempool_lf_mark_entry_free(mp, header);
+  mempool_lf_push_chain(mp, header, header, 1);
+}
+
+// Returns the given entry to its pool, the pool lock should be held
+// by the caller. On corruption, the lock gets released before the
+// assertion fires.
+static void mempool_free_entry_locked(mempool *mp, entry_header *header) {
+  if (header->elem_status == elem_is_not_a_pool_member) {
+    // We allocated this buffer when we had exhausted
+    // our own buffers.
+    if (mp->active_dynamic_memory_buffer_count == 0) {
+      // Something is not right, most probably a double free
+      if (mp->should_use_locks) {
+        pool_lock_release(&mp->lock);
+      }
+      assert(false);
+    }
+    COUNTER_SUB(mp->active_dynamic_memory_buffer_count, 1);
+    mempool_free_dynamic_header(mp, header);
+    return;
+  }
+
+  if (valid_mempool_addr(mp, (uintptr_t)header)) {
+    if (header->elem_status != elem_is_taken) {
+      // This block seems to be tampered with
+      addr_t addr = header->next;
+      if (valid_mempool_addr(mp, (uintptr_t)(*addr))) {
+        // Was this address returned to the pool before?
+        if (header->elem_status == elem_is_free) {
+          // Double free!
+          if (mp->should_use_locks) {
+            pool_lock_release(&mp->lock);
+          }
+          assert(false);
+        }
+      }
+
+      // Somehow the entry got overwritten.
+      if (mp->should_use_locks) {
+        pool_lock_release(&mp->lock);
+      }
+      assert(false);
+    }
+
+    header->elem_status = elem_is_free;
+    header->next = (addr_t)mp->free_inst;
+    mp->free_inst = header;
+    COUNTER_ADD(mp->free_elem_count, 1);
+
+    // The pool isn't exhausted anymore. The count is published along
+    // with the bit, see r_mempool_mark_exhausted.
+    if (mp->nonempty_word && mp->free_elem_count == 1) {
+      __atomic_or_fetch(mp->nonempty_word, mp->nonempty_bit, __ATOMIC_RELEASE);
+    }
+  } else {
+    if (mp->should_use_locks) {
+      pool_lock_release(&mp->lock);
+    }
+    assert(false);
+  }
+}
+
+void __mempool_free_entry(mempool *mp, entry_header *header) {
+  if (!mp) {
+    assert(false);
+  }
+
+  uintptr_t c_header = (uintptr_t)header;
+
+  if (mp->shards || mp->maps_entries) {
+    // The pool entries point at their shards, only the dynamically
+    // allocated ones point at the sharded pool itself. The large entry
+    // pools have no entries of their own either, and they only lock
+    // their mapping caches.
+    if (header->elem_status != elem_is_not_a_pool_member) {
+      assert(false);
+    }
+    mempool_free_dynamic_entry(mp, header);
+    return;
+  }
+
+  if (mp->thread_caches && header->elem_status != elem_is_not_a_pool_member) {
+    thread_cache *tc = mempool_thread_cache(mp);
+    if (tc) {
+      if (!valid_mempool_addr(mp, c_header) ||
+          header->elem_status != elem_is_taken) {
+        // Either a double free, or the entry got overwritten.
+        assert(false);
+      }
+
+      if (tc->count == mp->thread_cache_size) {
+        mempool_drain_thread_cache(mp, tc);
+      }
+
+      header->elem_status = elem_is_free;
+      tc->entries[tc->count] = header;
+      thread_cache_set_count(tc, tc->count + 1);
+      return;
+    }
+  }
+
+  if (mp->is_lock_free) {
+    mempool_lf_free_entry(mp, header);
+    return;
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_acquire(&mp->lock);
+  }
+
+  mempool_free_entry_locked(mp, header);
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+}
+
+static inline entry_header *mempool_checked_header(void *entry) {
+  entry_header *header = ENTRY_TO_HEADER(entry);
+
+  // Let's check the invariant parts.
+  if (!header) {
+    assert(false);
+  }
+
+  if (!header->pool_ptr) {
+    assert(false);
+  }
+
+  if (header->pool_ptr->mempool_mark != _mempool_mark) {
+    assert(false);
+  }
+
+  return header;
+}
+
+void _mempool_free_entry(void *entry) {
+  if (!entry) {
+    // Let's resemble the dynamic memory allocation approach here.
+    // Releasing a NULL pointer is acceptable.
+    return;
+  }
+
+  headerless_slab *slab = headerless_slab_of(entry);
+  if (slab) {
+    mempool_headerless_free_entry(slab, entry);
+    return;
+  }
+
+  entry_header *header = mempool_checked_header(entry);
+
+  // Passed the initial checks, no corruption so far.
+  __mempool_free_entry(header->pool_ptr, header);
+}
+
+static uint32_t mempool_sharded_alloc_bulk(mempool *mp, void **entries,
+                                           uint32_t count) {
+  uint32_t home = mempool_home_shard(mp);
+  uint32_t result = 0;
+
+  for (uint32_t i = 0; i < mp->shard_count && result < count; ++i) {
+    result += mempool_alloc_bulk(mp->shards[(home + i) % mp->shard_count],
+                                 &entries[result], count - result);
+  }
+
+  while (result < count && mp->fallback_to_dynamic_memory) {
+    void *entry = mempool_alloc_dynamic_entry(mp);
+    if (!entry) {
+      break;
+    }
+    entries[result++] = entry;
+  }
+
+  if (result < count) {
+    mempool_count_failed_allocs(mp, count - result);
+  }
+
+  return result;
+}
+
+uint32_t mempool_alloc_bulk(mempool *mp, void **entries, uint32_t count) {
+  if (!mp) {
+    assert(false);
+  }
+
+  if (!entries) {
+    return 0;
+  }
+
+  if (mp->shards) {
+    return mempool_sharded_alloc_bulk(mp, entries, count);
+  }
+
+  uint32_t result = 0;
+  entry_header *header = NULL;
+
+  if (mp->thread_caches) {
+    // Let's empty the magazine first, the rest comes from the
+    // shared list at once.
+    thread_cache *tc = mempool_thread_cache(mp);
+    if (tc) {
+      uint32_t cached = tc->count;
+      while (result < count && cached > 0) {
+        header = tc->entries[--cached];
+        if (header->elem_status != elem_is_free || header->pool_ptr != mp) {
+          // We have a corruption!
+          assert(false);
+        }
+        header->elem_status = elem_is_taken;
+        entries[result++] = (void *)&header->next;
+      }
+      thread_cache_set_count(tc, cached);
+    }
+  }
+
+  if (mp->is_lock_free) {
+    while (result < count && (header = mempool_lf_pop(mp))) {
+      header->elem_status = elem_is_taken;
+      entries[result++] = (void *)&header->next;
+    }
+    while (result < count && mp->fallback_to_dynamic_memory) {
+      void *entry = mempool_alloc_dynamic_entry(mp);
+      if (!entry) {
+        break;
+      }
+      entries[result++] = entry;
+    }
+    if (result < count) {
+      mempool_count_failed_allocs(mp, count - result);
+    }
+    return result;
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_acquire(&mp->lock);
+  }
+
+  if (mp->is_headerless) {
+    void *entry = NULL;
+    while (result < count && (entry = mempool_headerless_pop_entry(mp))) {
+      entries[result++] = entry;
+    }
+  } else {
+    while (result < count && (header = mempool_pop_free_entry(mp))) {
+      header->elem_status = elem_is_taken;
+      entries[result++] = (void *)&header->next;
+    }
+  }
+
+  while (result < count && mp->fallback_to_dynamic_memory) {
+    void *entry = mempool_alloc_dynamic_entry(mp);
+    if (!entry) {
+      break;
+    }
+    entries[result++] = entry;
+  }
+
+  if (result < count) {
+    mempool_count_failed_allocs(mp, count - result);
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+
+  return result;
+}
+
+// Releases all the entries in entries[first..count) that belong to the
+// given lock-free pool with a single push.
+static void mempool_lf_free_bulk(mempool *mp, void **entries, uint32_t first,
+                                 uint32_t count) {
+  entry_header *chain_first = NULL;
+  entry_header *chain_last = NULL;
+  uint32_t chain_length = 0;
+
+  for (uint32_t i = first; i < count; ++i) {
+    if (!entries[i] || headerless_slab_of(entries[i])) {
+      continue;
+    }
+
+    entry_header *header = mempool_checked_header(entries[i]);
+    if (header->pool_ptr != mp) {
+      continue;
+    }
+    entries[i] = NULL;
+
+    if (header->elem_status == elem_is_not_a_pool_member) {
+      mempool_free_dynamic_entry(mp, header);
+      continue;
+    }
+
+    mempool_lf_mark_entry_free(mp, header);
+    header->next = (addr_t)chain_first;
+    chain_first = header;
+    if (!chain_last) {
+      chain_last = header;
+    }
+    ++chain_length;
+  }
+
+  if (chain_first) {
+    mempool_lf_push_chain(mp, chain_first, chain_last, chain_length);
+  }
+}
+
+// Releases all the entries in entries[first..count) that belong to the
+// given locked pool, taking the lock only once.
+static void mempool_locked_free_bulk(mempool *mp, void **entries,
+                                     uint32_t first, uint32_t count) {
+  if (mp->should_use_locks) {
+    pool_lock_acquire(&mp->lock);
+  }
+
+  for (uint32_t i = first; i < count; ++i) {
+    if (!entries[i] || headerless_slab_of(entries[i])) {
+      continue;
+    }
+
+    entry_header *header = mempool_checked_header(entries[i]);
+    if (header->pool_ptr != mp) {
+      continue;
+    }
+    entries[i] = NULL;
+
+    mempool_free_entry_locked(mp, header);
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+}
+
+void mempool_free_bulk(void **entries, uint32_t count) {
+  if (!entries) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    if (!entries[i]) {
+      continue;
+    }
+
+    headerless_slab *slab = headerless_slab_of(entries[i]);
+    if (slab) {
+      mempool_headerless_free_entry(slab, entries[i]);
+      entries[i] = NULL;
+      continue;
+    }
+
+    entry_header *header = mempool_checked_header(entries[i]);
+    mempool *mp = header->pool_ptr;
+
+    if (mp->shards || mp->thread_caches || mp->maps_entries) {
+      // These have cheaper paths for the individual entries already, and
+      // the mapping cache takes the pool lock by itself.
+      __mempool_free_entry(mp, header);
+      entries[i] = NULL;
+    } else if (mp->is_lock_free) {
+      mempool_lf_free_bulk(mp, entries, i, count);
+    } else {
+      mempool_locked_free_bulk(mp, entries, i, count);
+    }
+  }
+}
+
+// Whether none of the entries from 'first' to 'last' of the pool buffer
+// are in use, and at least one of them sits on the free list. The
+// entries in the magazines count as used.
+static bool mempool_entries_are_trimmable(mempool *mp,
+                                          const uint64_t *free_entries,
+                                          uint32_t first, uint32_t last) {
+  bool has_free_entry = false;
+
+  for (uint32_t i = first; i <= last; ++i) {
+    uint64_t bit = 1ULL << (i % 64);
+    if (free_entries[i / 64] & bit) {
+      has_free_entry = true;
+    } else if (i < mp->bump_index && !(mp->trimmed_entries[i / 64] & bit)) {
+      return false;
+    }
+  }
+
+  return has_free_entry;
+}
+
+// Returns the length of the given run of pages if the kernel released
+// it, e.g. the hugetlb mappings can't be released before Linux 5.18.
+static inline size_t release_pages(uintptr_t start, uintptr_t end) {
+  if (end > start &&
+      madvise((void *)start, end - start, MADV_DONTNEED) == 0) {
+    return end - start;
+  }
+
+  return 0;
+}
+
+// Walks the pages of the pool buffer whose entries are trimmable, see
+// mempool_entries_are_trimmable. The free entries of those pages get
+// marked as trimmed first, they stay in the free bitmap so that the
+// pages they share are still found. Once they are off the free list,
+// the second walk releases the pages, with a single madvise for each
+// run of them, and returns the number of bytes released.
+static size_t mempool_trim_pages(mempool *mp, const uint64_t *free_entries,
+                                 uint32_t elem_count, bool release) {
+  size_t page_size = page_backing_page_size(mp->page_backing);
+  // Every entry spans ext_elem_size bytes from its header, the padding
+  // of the aligned pools sits in front of the first header only.
+  uintptr_t start = mp->lower_addr_limit;
+  uintptr_t end = start + (uintptr_t)elem_count * mp->ext_elem_size;
+  uintptr_t page = (start + page_size - 1) & ~(uintptr_t)(page_size - 1);
+  uintptr_t run_start = page;
+  uintptr_t run_end = page;
+  size_t released = 0;
+
+  for (; page + page_size <= end; page += page_size) {
+    uint32_t first = (uint32_t)((page - start) / mp->ext_elem_size);
+    uint32_t last =
+        (uint32_t)((page + page_size - 1 - start) / mp->ext_elem_size);
+    if (!mempool_entries_are_trimmable(mp, free_entries, first, last)) {
+      continue;
+    }
+
+    if (release) {
+      if (page != run_end) {
+        released += release_pages(run_start, run_end);
+        run_start = page;
+      }
+      run_end = page + page_size;
+      continue;
+    }
+
+    for (uint32_t i = first; i <= last; ++i) {
+      uint64_t bit = 1ULL << (i % 64);
+      if ((free_entries[i / 64] & bit) &&
+          !(mp->trimmed_entries[i / 64] & bit)) {
+        mp->trimmed_entries[i / 64] |= bit;
+        COUNTER_ADD(mp->trimmed_count, 1);
+        if (i / 64 < mp->trimmed_cursor) {
+          mp->trimmed_cursor = i / 64;
+        }
+      }
+    }
+  }
+
+  if (release) {
+    released += release_pages(run_start, run_end);
+  }
+
+  return released;
+}
+
+// Gives the pages of the pool buffer that only hold free entries back
+// to the OS. The free entries on those pages leave the free list, and
+// get handed out again once the free list and the untouched entries run
+// out. All of it happens under the pool lock, as an entry taken before
+// its page is released would lose its contents.
+static size_t mempool_trim_entries(mempool *mp) {
+  if (mp->page_backing == page_backing_heap || mp->is_lock_free) {
+    return 0;
+  }
+
+  uint32_t elem_count = (uint32_t)((mp->upper_addr_limit -
+                                    mp->lower_addr_limit) /
+                                   mp->ext_elem_size);
+  uint32_t word_count = (elem_count + 63) / 64;
+  if (word_count == 0) {
+    return 0;
+  }
+
+  uint64_t *free_entries =
+      (uint64_t *)mem_calloc(word_count, sizeof(uint64_t));
+  uint64_t *trimmed_entries =
+      (uint64_t *)mem_calloc(word_count, sizeof(uint64_t));
+  if (!free_entries || !trimmed_entries) {
+    mem_free(free_entries);
+    mem_free(trimmed_entries);
+    return 0;
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_acquire(&mp->lock);
+  }
+
+  if (!mp->trimmed_entries) {
+    mp->trimmed_entries = trimmed_entries;
+    trimmed_entries = NULL;
+  }
+
+  // The entries of the slabs of a growing pool are left alone.
+  for (entry_header *header = (entry_header *)mp->free_inst; header;
+       header = (entry_header *)header->next) {
+    if ((uintptr_t)header >= mp->lower_addr_limit &&
+        (uintptr_t)header < mp->upper_addr_limit) {
+      uint32_t index = (uint32_t)(((uintptr_t)header - mp->lower_addr_limit) /
+                                  mp->ext_elem_size);
+      free_entries[index / 64] |= 1ULL << (index % 64);
+    }
+  }
+
+  uint32_t trimmed_count = mp->trimmed_count;
+  mempool_trim_pages(mp, free_entries, elem_count, false);
+
+  size_t released = 0;
+  if (mp->trimmed_count > trimmed_count) {
+    // The links live in the entries, so the trimmed ones should leave
+    // the free list before their pages are released.
+    entry_header *previous = NULL;
+    entry_header *header = (entry_header *)mp->free_inst;
+    while (header) {
+      entry_header *next = (entry_header *)header->next;
+      uint32_t index = (uint32_t)(((uintptr_t)header - mp->lower_addr_limit) /
+                                  mp->ext_elem_size);
+      if ((uintptr_t)header < mp->lower_addr_limit ||
+          (uintptr_t)header >= mp->upper_addr_limit ||
+          !(mp->trimmed_entries[index / 64] & (1ULL << (index % 64)))) {
+        previous = header;
+      } else if (previous) {
+        previous->next = (addr_t)next;
+      } else {
+        mp->free_inst = next;
+      }
+      header = next;
+    }
+
+    released = mempool_trim_pages(mp, free_entries, elem_count, true);
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+
+  mem_free(free_entries);
+  mem_free(trimmed_entries);
+
+  return released;
+}
+
+size_t mempool_trim(mempool *mp) {
+  if (!mp) {
+    assert(false);
+  }
+
+  size_t result = 0;
+  if (mp->shards) {
+    for (uint32_t i = 0; i < mp->shard_count; ++i) {
+      result += mempool_trim_entries(mp->shards[i]);
+    }
+  } else if (!mp->is_headerless) {
+    result = mempool_trim_entries(mp);
+  }
+
+  return result;
+}
+
+static uint32_t mempool_thread_caches_count(mempool *mp) {
+  uint32_t result = 0;
+
+  if (mp->thread_caches) {
+    for (uint32_t i = 0; i < MAX_THREAD_CACHE_SLOTS; ++i) {
+      result += __atomic_load_n(&mp->thread_caches[i].count, __ATOMIC_RELAXED);
+    }
+  }
+
+  return result;
+}
+
+// Adds the counters of the given pool to the ones in 'stats'. None of
+// the counters are read under the pool lock, so that the readers never
+// block the allocators, and the snapshot may be slightly stale while
+// the pool is being used.
+static void mempool_accumulate_stats(mempool *mp, mempool_stats *stats) {
+  if (mp->shards) {
+    // Only the entry counts of the shards matter: their fallback is
+    // disabled, and their failures are mere failed attempts to steal.
+    for (uint32_t i = 0; i < mp->shard_count; ++i) {
+      mempool_stats shard_stats = {0};
+      mempool_accumulate_stats(mp->shards[i], &shard_stats);
+      stats->total_capacity += shard_stats.total_capacity;
+      stats->used_count += shard_stats.used_count;
+      stats->cached_count += shard_stats.cached_count;
+      stats->peak_used_count += shard_stats.peak_used_count;
+      stats->trimmed_count += shard_stats.trimmed_count;
+    }
+  } else {
+    // The counters aren't read together atomically, e.g. an entry moved
+    // from the free list into a magazine may be counted in both for a
+    // moment, hence the clamping.
+    uint32_t free_count = COUNTER_LOAD(mp->free_elem_count);
+    uint32_t total_count = COUNTER_LOAD(mp->total_elem_count);
+    uint32_t cached_count = mempool_thread_caches_count(mp);
+    uint64_t unused_count = (uint64_t)free_count + cached_count;
+
+    stats->total_capacity += total_count;
+    stats->used_count +=
+        total_count > unused_count ? total_count - (uint32_t)unused_count : 0;
+    stats->cached_count += cached_count;
+    stats->peak_used_count += COUNTER_LOAD(mp->peak_used_count);
+    stats->trimmed_count += COUNTER_LOAD(mp->trimmed_count);
+  }
+
+  stats->dynamic_allocs_count +=
+      COUNTER_LOAD(mp->active_dynamic_memory_buffer_count);
+  stats->peak_dynamic_allocs_count +=
+      COUNTER_LOAD(mp->peak_dynamic_allocs_count);
+  stats->failed_allocs_count += COUNTER_LOAD(mp->failed_allocs_count);
+  stats->fallback_count += COUNTER_LOAD(mp->fallback_count);
+}
+
+void mempool_get_stats(mempool *mp, mempool_stats *stats) {
+  if (!mp || !stats) {
+    assert(false);
+  }
+
+  memset(stats, 0, sizeof(mempool_stats));
+  mempool_accumulate_stats(mp, stats);
+  stats->page_backing = mp->page_backing;
+}
+
+void mempool_reset_stats(mempool *mp) {
+  if (!mp) {
+    assert(false);
+  }
+
+  // The peaks start over from the current values.
+  if (mp->shards) {
+    for (uint32_t i = 0; i < mp->shard_count; ++i) {
+      mempool_reset_stats(mp->shards[i]);
+    }
+  } else {
+    __atomic_store_n(&mp->peak_used_count,
+                     COUNTER_LOAD(mp->total_elem_count) -
+                         COUNTER_LOAD(mp->free_elem_count),
+                     __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&mp->peak_dynamic_allocs_count,
+                   COUNTER_LOAD(mp->active_dynamic_memory_buffer_count),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&mp->failed_allocs_count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&mp->fallback_count, 0, __ATOMIC_RELAXED);
+}
+
+uint32_t mempool_total_capacity(mempool *mp) {
+  mempool_stats stats;
+  mempool_get_stats(mp, &stats);
+  return stats.total_capacity;
+}
+
+uint32_t mempool_used_count(mempool *mp) {
+  mempool_stats stats;
+  mempool_get_stats(mp, &stats);
+  return stats.used_count;
+}
+
+uint32_t mempool_dynamic_allocs_count(mempool *mp) {
+  mempool_stats stats;
+  mempool_get_stats(mp, &stats);
+  return stats.dynamic_allocs_count;
+}
+
+uint32_t mempool_cached_count(mempool *mp) {
+  mempool_stats stats;
+  mempool_get_stats(mp, &stats);
+  return stats.cached_count;
+}
+
+// Allocation trace recording. The recording threads write the records
+// with the trace lock held on the reader side, so that the trace can't
+// be closed under their feet, while stdio keeps the records intact.
+static FILE *trace_file = NULL;
+static pthread_rwlock_t trace_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint64_t trace_start_ns;
+static uint32_t trace_thread_count;
+static __thread uint16_t trace_thread_id;
+
+static inline uint64_t trace_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+bool r_mempool_trace_start(const char *path) {
+  if (!path) {
+    return false;
+  }
+
+  bool result = false;
+
+  pthread_rwlock_wrlock(&trace_lock);
+  if (!trace_file) {
+    FILE *file = fopen(path, "wb");
+    if (file) {
+      uint32_t preamble[2] = {R_MEMPOOL_TRACE_VERSION,
+                              sizeof(r_mempool_trace_record)};
+      if (fwrite(R_MEMPOOL_TRACE_MAGIC, 8, 1, file) == 1 &&
+          fwrite(preamble, sizeof(preamble), 1, file) == 1) {
+        trace_start_ns = trace_now_ns();
+        __atomic_store_n(&trace_file, file, __ATOMIC_RELEASE);
+        result = true;
+      } else {
+        fclose(file);
+      }
+    }
+  }
+  pthread_rwlock_unlock(&trace_lock);
+
+  return result;
+}
+
+void r_mempool_trace_stop(void) {
+  pthread_rwlock_wrlock(&trace_lock);
+  if (trace_file) {
+    fclose(trace_file);
+    __atomic_store_n(&trace_file, NULL, __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&trace_lock);
+}
+
+static void __attribute__((noinline))
+r_mempool_trace_record_op(r_mempool_trace_op_t op, void *entry,
+                          void *old_entry, uint32_t size) {
+  if (trace_thread_id == 0) {
+    trace_thread_id = (uint16_t)__atomic_add_fetch(&trace_thread_count, 1,
+                                                   __ATOMIC_RELAXED);
+  }
+
+  r_mempool_trace_record record = {
+      .entry = (uint64_t)(uintptr_t)entry,
+      .old_entry = (uint64_t)(uintptr_t)old_entry,
+      .size = size,
+      .thread_id = trace_thread_id,
+      .op = (uint8_t)op,
+  };
+
+  pthread_rwlock_rdlock(&trace_lock);
+  if (trace_file) {
+    record.timestamp_ns = trace_now_ns() - trace_start_ns;
+    fwrite(&record, sizeof(record), 1, trace_file);
+  }
+  pthread_rwlock_unlock(&trace_lock);
+}
+
+static inline void r_mempool_trace(r_mempool_trace_op_t op, void *entry,
+                                   void *old_entry, uint32_t size) {
+  if (__atomic_load_n(&trace_file, __ATOMIC_RELAXED)) {
+    r_mempool_trace_record_op(op, entry, old_entry, size);
+  }
+}
+
+// Ranged memory pool implementation starts
+const uint32_t min_allowed_smallest_size = 16;
+const uint32_t max_allowed_largest_size = 2147483648;
+const uint8_t max_allowed_spacing_power_of_two = 3;
+// The rebalancing considers a class hot once this much of it is in use.
+const uint32_t rebalancing_hot_percentage = 75;
+
+// The counters of a size class that its pool can't keep by itself,
+// see r_mempool_stats.
+typedef struct r_mempool_class_counters {
+  uint64_t escalated_count;
+  uint64_t last_exhaustion_fallback_count;
+  uint64_t failed_allocs_count;
+} r_mempool_class_counters;
+
+// The requested size histograms get striped by CPU, so that the
+// threads recording the sizes rarely share their cache lines.
+#define SIZE_HISTOGRAM_STRIPES 8
+
+typedef struct size_histogram_stripe {
+  uint64_t counts[R_MEMPOOL_SIZE_HISTOGRAM_BUCKETS];
+  uint64_t requested_bytes;
+  uint64_t handed_out_bytes;
+} __attribute__((aligned(CACHE_LINE_SIZE))) size_histogram_stripe;
+
+struct r_mempool {
+  mempool **mem_pools;  // The real memory pools
+  r_mempool_class_counters *class_counters;  // One per pool
+  bool size_histogram_enabled;
+  // SIZE_HISTOGRAM_STRIPES per pool, allocated once enabled
+  size_histogram_stripe *size_histograms;
+  mempool pseudo_pool;
+  mempool large_pool;  // Maps the large entries, once enabled
+  bool large_entries_enabled;
+  r_memory_fallback_policy_t fb_policy;
+  bool should_use_locks;
+  uint32_t number_of_mempools;
+  uint8_t smallest_size_power_of_two;
+  uint8_t spacing_power_of_two;  // There are 2^spacing classes per doubling
+  r_mempool_class_spec *classes;  // The explicit classes, if any
+  // A bit per pool, which is only clear once the pool is exhausted
+  uint64_t *nonempty_classes;
+  uint32_t slab_size;  // Only set for the rebalancing pools
+  bool rebalance_on_exhaustion;
+  uint32_t realloc_in_place_percentage;
+  // The settings of the class pools, which only the malloc shim changes
+  mempool_lock_policy_t lock_policy;  // When the pools use locks
+  uint32_t thread_cache_size;
+  bool lazy_init;
+  mempool_page_backing_t page_backing;
+  // The mapping the classes of a backed pool are carved out of
+  uint8_t *objects;
+  size_t objects_length;
+  uint32_t smallest_size;
+  uint32_t largest_size;
+  uint32_t smallest_elem_count;
+  uint32_t alignment;
+};
+
+void _r_mempool_destroy(r_mempool *rmp) {
+  if (rmp) {
+    if (rmp->mem_pools) {
+      for (uint32_t i = 0; i < rmp->number_of_mempools; ++i) {
+        if (rmp->mem_pools[i]) {
+          mempool_destroy(rmp->mem_pools[i]);
+        }
+      }
+      mem_free(rmp->mem_pools);
+    }
+    if (rmp->objects_length) {
+      munmap(rmp->objects, rmp->objects_length);
+    }
+    if (rmp->class_counters) {
+      mem_free(rmp->class_counters);
+    }
+    if (rmp->size_histograms) {
+      mem_free(rmp->size_histograms);
+    }
+    if (rmp->classes) {
+      mem_free(rmp->classes);
+    }
+    if (rmp->nonempty_classes) {
+      mem_free(rmp->nonempty_classes);
+    }
+    if (rmp->pseudo_pool.should_use_locks) {
+      pool_lock_destroy(&rmp->pseudo_pool.lock);
+    }
+    if (rmp->large_entries_enabled) {
+      mempool *mp = &rmp->large_pool;
+      for (uint32_t i = 0; i < mp->cached_mapping_count; ++i) {
+        munmap(mp->cached_mappings[i].base, mp->cached_mappings[i].length);
+      }
+      mem_free(mp->cached_mappings);
+      if (mp->should_use_locks) {
+        pool_lock_destroy(&mp->lock);
+      }
+    }
+
+    mem_free(rmp);
+  }
+}
+
+bool assess_r_mempool_create_inputs(r_mempool *rmp,
+                                    uint8_t smallest_size_power_of_two,
+                                    uint8_t largest_size_power_of_two,
+                                    uint8_t smallest_elem_count_power_of_two,
+                                    uint8_t spacing_power_of_two,
+                                    r_memory_fallback_policy_t fb_policy,
+                                    bool will_be_accessed_by_only_one_thread) {
+  if (smallest_size_power_of_two == 0 || largest_size_power_of_two == 0 ||
+      smallest_elem_count_power_of_two == 0) {
+    return false;
+  }
+
+  if (largest_size_power_of_two <= smallest_size_power_of_two ||
+      (smallest_elem_count_power_of_two <
+       (largest_size_power_of_two - smallest_size_power_of_two))) {
+    return false;
+  }
+
+  if (fb_policy < 0 || fb_policy >= __fallback_end_place_holder) {
+    return false;
+  }
+
+  uint32_t smallest_size = 1 << smallest_size_power_of_two;
+  uint32_t largest_size = 1 << largest_size_power_of_two;
+  uint32_t smallest_elem_count = 1 << smallest_elem_count_power_of_two;
+
+  if (largest_size > max_allowed_largest_size ||
+      smallest_size < min_allowed_smallest_size) {
+    return false;
+  }
+
+  // The class sizes should stay multiples of the pointer size, so that
+  // the entries remain aligned.
+  if (spacing_power_of_two > max_allowed_spacing_power_of_two ||
+      (smallest_size >> spacing_power_of_two) < sizeof(addr_t)) {
+    return false;
+  }
+
+  rmp->should_use_locks = !will_be_accessed_by_only_one_thread;
+  rmp->realloc_in_place_percentage = 100;
+  rmp->smallest_size_power_of_two = smallest_size_power_of_two;
+  rmp->spacing_power_of_two = spacing_power_of_two;
+  rmp->smallest_size = smallest_size;
+  rmp->largest_size = largest_size;
+  rmp->smallest_elem_count = smallest_elem_count;
+  rmp->number_of_mempools =
+      1 + ((largest_size_power_of_two - smallest_size_power_of_two)
+           << spacing_power_of_two);
+
+  return true;
+}
+
+bool assess_r_mempool_class_specs(r_mempool *rmp,
+                                  const r_mempool_class_spec *specs,
+                                  uint32_t number_of_classes,
+                                  r_memory_fallback_policy_t fb_policy,
+                                  bool will_be_accessed_by_only_one_thread) {
+  if (!specs || number_of_classes == 0) {
+    return false;
+  }
+
+  if (fb_policy < 0 || fb_policy >= __fallback_end_place_holder) {
+    return false;
+  }
+
+  // The sizes should be increasing multiples of the pointer size, so
+  // that the entries remain aligned.
+  uint32_t previous_size = 0;
+  for (uint32_t i = 0; i < number_of_classes; ++i) {
+    if (specs[i].size <= previous_size || specs[i].count == 0 ||
+        specs[i].size % sizeof(addr_t) != 0) {
+      return false;
+    }
+    previous_size = specs[i].size;
+  }
+
+  if (specs[number_of_classes - 1].size > max_allowed_largest_size ||
+      specs[0].size < min_allowed_smallest_size) {
+    return false;
+  }
+
+  rmp->classes = (r_mempool_class_spec *)mem_alloc(
+      number_of_classes * sizeof(r_mempool_class_spec));
+  if (!rmp->classes) {
+    return false;
+  }
+  memcpy(rmp->classes, specs, number_of_classes * sizeof(r_mempool_class_spec));
+
+  rmp->should_use_locks = !will_be_accessed_by_only_one_thread;
+  rmp->realloc_in_place_percentage = 100;
+  rmp->smallest_size = specs[0].size;
+  rmp->largest_size = specs[number_of_classes - 1].size;
+  rmp->smallest_elem_count = specs[0].count;
+  rmp->number_of_mempools = number_of_classes;
+
+  return true;
+}
+
+// Unless the classes are given explicitly, the first size class holds
+// the sizes up to the smallest size, and every doubling of the size
+// after that gets split into 2^spacing classes of equal steps, e.g.
+// 32, 40, 48, 56, 64, 80, 96, ... for 4 classes per doubling. The size
+// class 'index' holds the sizes in (lower, upper], and as many elements
+// as the power of two class covering it would.
+static inline uint32_t r_mempool_class_upper_size(r_mempool *rmp,
+                                                  uint32_t index) {
+  if (rmp->classes) {
+    return rmp->classes[index].size;
+  }
+
+  if (index == 0) {
+    return rmp->smallest_size;
+  }
+
+  uint32_t group = (index - 1) >> rmp->spacing_power_of_two;
+  uint32_t step = (index - 1) & ((1u << rmp->spacing_power_of_two) - 1);
+  uint32_t group_size = rmp->smallest_size << group;
+
+  return group_size + (step + 1) * (group_size >> rmp->spacing_power_of_two);
+}
+
+static inline uint32_t r_mempool_class_lower_size(r_mempool *rmp,
+                                                  uint32_t index) {
+  return index ? r_mempool_class_upper_size(rmp, index - 1) : 0;
+}
+
+static inline uint32_t r_mempool_class_elem_count(r_mempool *rmp,
+                                                  uint32_t index) {
+  if (rmp->classes) {
+    return rmp->classes[index].count;
+  }
+
+  if (index == 0) {
+    return rmp->smallest_elem_count;
+  }
+
+  uint32_t group = (index - 1) >> rmp->spacing_power_of_two;
+  return rmp->smallest_elem_count >> (group + 1);
+}
+
+bool init_r_mempool_pseudo_pool(r_mempool *rmp) {
+  memset(&rmp->pseudo_pool, 0, sizeof(mempool));
+  if (rmp->fb_policy == fallback_at_last_exhaustion) {
+    if (rmp->should_use_locks) {
+      if (pool_lock_init(&rmp->pseudo_pool.lock, lock_policy_rwlock) != 0) {
+        return false;
+      }
+      rmp->pseudo_pool.should_use_locks = true;
+    }
+    rmp->pseudo_pool.fallback_to_dynamic_memory = true;
+    rmp->pseudo_pool.mempool_mark = _mempool_mark;
+    rmp->pseudo_pool.alignment = rmp->alignment;
+    rmp->pseudo_pool.header_offset = aligned_header_offset(rmp->alignment);
+  }
+
+  // The class counters are allocated along with the pseudo pool, as
+  // every ranged pool needs both.
+  rmp->class_counters = (r_mempool_class_counters *)mem_calloc(
+      rmp->number_of_mempools, sizeof(r_mempool_class_counters));
+
+  return rmp->class_counters != NULL;
+}
+
+// Starts with all the pools marked as non-empty, and lets them set
+// their bits again whenever they get an entry back after exhaustion.
+static bool init_r_mempool_nonempty_classes(r_mempool *rmp) {
+  uint32_t words = (rmp->number_of_mempools + 63) / 64;
+  rmp->nonempty_classes = (uint64_t *)mem_calloc(words, sizeof(uint64_t));
+  if (!rmp->nonempty_classes) {
+    return false;
+  }
+
+  for (uint32_t index = 0; index < rmp->number_of_mempools; ++index) {
+    mempool *mp = rmp->mem_pools[index];
+    mp->nonempty_word = &rmp->nonempty_classes[index / 64];
+    mp->nonempty_bit = 1ull << (index % 64);
+    *mp->nonempty_word |= mp->nonempty_bit;
+  }
+
+  return true;
+}
+
+// Maps a single buffer for all the classes of a backed pool, so that
+// the huge pages aren't rounded up once per class, and carves the
+// classes out of its adjacent segments the same way the sharded pools
+// carve their shards. The mapping falls back to the smaller pages like
+// the one of a single pool does.
+static bool init_r_mempool_backed_pools(r_mempool *rmp,
+                                        const mempool_config *config) {
+  uint32_t header_offset = aligned_header_offset(rmp->alignment);
+  size_t size = header_offset;
+  for (uint32_t index = 0; index < rmp->number_of_mempools; ++index) {
+    uint32_t esize = r_mempool_class_upper_size(rmp, index);
+    uint32_t ext_elem_size = aligned_ext_elem_size(
+        esize < sizeof(addr_t) ? sizeof(addr_t) : esize, rmp->alignment);
+    uint64_t class_size =
+        (uint64_t)r_mempool_class_elem_count(rmp, index) * ext_elem_size;
+    // Each segment is handed to its class with a 32 bit size.
+    if (ext_elem_size == 0 || class_size + header_offset > UINT32_MAX) {
+      return false;
+    }
+    size += class_size;
+  }
+
+  mempool_page_backing_t page_backing = rmp->page_backing;
+  for (; page_backing > page_backing_heap; --page_backing) {
+    rmp->objects =
+        (uint8_t *)map_pages(size, page_backing, &rmp->objects_length);
+    if (rmp->objects) {
+      break;
+    }
+  }
+  if (!rmp->objects) {
+    return false;
+  }
+
+  mempool_config class_config = *config;
+  class_config.page_backing = page_backing_heap;
+
+  uint8_t *sub_buffer = rmp->objects;
+  for (uint32_t index = 0; index < rmp->number_of_mempools; ++index) {
+    uint32_t esize = r_mempool_class_upper_size(rmp, index);
+    if (esize < sizeof(addr_t)) {
+      esize = sizeof(addr_t);
+    }
+    uint32_t class_size = r_mempool_class_elem_count(rmp, index) *
+                          aligned_ext_elem_size(esize, rmp->alignment);
+    // An aligned class also needs the header offset, which overlaps
+    // the unused head of the next segment.
+    rmp->mem_pools[index] = mempool_create_from_preallocated_buffer_with_config(
+        sub_buffer, class_size + header_offset, esize, &class_config);
+    if (!rmp->mem_pools[index]) {
+      // The cleanup will be performed by the caller.
+      return false;
+    }
+    // The classes live in the mapping of the ranged pool.
+    rmp->mem_pools[index]->page_backing = page_backing;
+    sub_buffer += class_size;
+  }
+
+  return true;
+}
+
+bool init_r_mempool_internal_pools(r_mempool *rmp) {
+  if (!init_r_mempool_pseudo_pool(rmp)) {
+    return false;
+  }
+
+  rmp->mem_pools =
+      (mempool **)mem_alloc(rmp->number_of_mempools * sizeof(mempool));
+  if (!rmp->mem_pools) {
+    // The cleanup will be performed by the caller.
+    return false;
+  }
+  memset(rmp->mem_pools, 0, rmp->number_of_mempools * sizeof(mempool));
+
+  mempool_config config = {
+      .fallback_to_dynamic_memory =
+          rmp->fb_policy == fallback_at_first_exhaustion,
+      .lock_policy =
+          rmp->should_use_locks ? rmp->lock_policy : lock_policy_none,
+      .thread_cache_size = rmp->thread_cache_size,
+      .lazy_init = rmp->lazy_init,
+      .alignment = rmp->alignment,
+      .page_backing = rmp->page_backing,
+  };
+
+  if (rmp->page_backing != page_backing_heap) {
+    return init_r_mempool_backed_pools(rmp, &config) &&
+           init_r_mempool_nonempty_classes(rmp);
+  }
+
+  for (uint32_t index = 0; index < rmp->number_of_mempools; ++index) {
+    rmp->mem_pools[index] = mempool_create_with_config(
+        r_mempool_class_elem_count(rmp, index),
+        r_mempool_class_upper_size(rmp, index), &config);
+    if (!rmp->mem_pools[index]) {
+      // The cleanup will be performed by the caller.
+      return false;
+    }
+  }
+
+  return init_r_mempool_nonempty_classes(rmp);
+}
+
+// Maps a size to the index of the smallest pool that can hold it in
+// constant time. A size in (2^k, 2^(k + 1)] belongs to the doubling
+// k - smallest_size_power_of_two, and its step within the doubling is
+// given by the bits of (size - 1) right below the leading one. The
+// sizes up to the smallest size are handled as (2^(k - 1), 2^k] with
+// k being smallest_size_power_of_two, which yields the first pool.
+//
+// The explicit classes have no such structure, they are binary
+// searched for the first class that is large enough instead.
+static uint32_t r_mempool_search_class(r_mempool *rmp, uint32_t size) {
+  uint32_t low = 0;
+  uint32_t high = rmp->number_of_mempools - 1;
+
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (rmp->classes[middle].size < size) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+static inline uint32_t r_mempool_size_to_index(r_mempool *rmp,
+                                               uint32_t size) {
+  if (rmp->classes) {
+    return r_mempool_search_class(rmp, size);
+  }
+
+  uint32_t value = size - 1;
+  if (value < rmp->smallest_size) {
+    value = rmp->smallest_size - 1;
+  }
+
+  int32_t k = 31 - __builtin_clz(value);
+  int32_t spacing = rmp->spacing_power_of_two;
+  int32_t doubling = k - rmp->smallest_size_power_of_two;
+
+  return (uint32_t)((int32_t)(value >> (k - spacing)) +
+                    (doubling - 1) * (1 << spacing) + 1);
+}
+
+static r_mempool *r_mempool_create_internal(
+    uint8_t smallest_size_power_of_two, uint8_t largest_size_power_of_two,
+    uint8_t smallest_elem_count_power_of_two, uint8_t spacing_power_of_two,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread, uint32_t alignment,
+    mempool_page_backing_t page_backing) {
+  if (!valid_mempool_alignment(alignment) ||
+      !valid_mempool_page_backing(page_backing)) {
+    return NULL;
+  }
+
+  r_mempool *rmp = (r_mempool *)mem_calloc(1, sizeof(r_mempool));
+  if (!rmp) {
+    return NULL;
+  }
+  rmp->alignment = alignment;
+  rmp->page_backing = page_backing;
+
+  if (!assess_r_mempool_create_inputs(
+          rmp, smallest_size_power_of_two, largest_size_power_of_two,
+          smallest_elem_count_power_of_two, spacing_power_of_two, fb_policy,
+          will_be_accessed_by_only_one_thread)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+  rmp->fb_policy = fb_policy;
+
+  if (!init_r_mempool_internal_pools(rmp)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+
+  return rmp;
+}
+
+r_mempool *r_mempool_create_aligned(uint8_t smallest_size_power_of_two,
+                                    uint8_t largest_size_power_of_two,
+                                    uint8_t smallest_elem_count_power_of_two,
+                                    r_memory_fallback_policy_t fb_policy,
+                                    bool will_be_accessed_by_only_one_thread,
+                                    uint32_t alignment) {
+  return r_mempool_create_internal(
+      smallest_size_power_of_two, largest_size_power_of_two,
+      smallest_elem_count_power_of_two, 0, fb_policy,
+      will_be_accessed_by_only_one_thread, alignment, page_backing_heap);
+}
+
+r_mempool *r_mempool_create_spaced(uint8_t smallest_size_power_of_two,
+                                   uint8_t largest_size_power_of_two,
+                                   uint8_t smallest_elem_count_power_of_two,
+                                   uint8_t classes_per_doubling_power_of_two,
+                                   r_memory_fallback_policy_t fb_policy,
+                                   bool will_be_accessed_by_only_one_thread) {
+  return r_mempool_create_internal(
+      smallest_size_power_of_two, largest_size_power_of_two,
+      smallest_elem_count_power_of_two, classes_per_doubling_power_of_two,
+      fb_policy, will_be_accessed_by_only_one_thread, 0, page_backing_heap);
+}
+
+r_mempool *r_mempool_create_backed(uint8_t smallest_size_power_of_two,
+                                   uint8_t largest_size_power_of_two,
+                                   uint8_t smallest_elem_count_power_of_two,
+                                   r_memory_fallback_policy_t fb_policy,
+                                   bool will_be_accessed_by_only_one_thread,
+                                   mempool_page_backing_t page_backing) {
+  return r_mempool_create_internal(
+      smallest_size_power_of_two, largest_size_power_of_two,
+      smallest_elem_count_power_of_two, 0, fb_policy,
+      will_be_accessed_by_only_one_thread, 0, page_backing);
+}
+
+r_mempool *r_mempool_create(uint8_t smallest_size_power_of_two,
+                            uint8_t largest_size_power_of_two,
+                            uint8_t smallest_elem_count_power_of_two,
+                            r_memory_fallback_policy_t fb_policy,
+                            bool will_be_accessed_by_only_one_thread) {
+  return r_mempool_create_aligned(
+      smallest_size_power_of_two, largest_size_power_of_two,
+      smallest_elem_count_power_of_two, fb_policy,
+      will_be_accessed_by_only_one_thread, 0);
+}
+
+r_mempool *r_mempool_create_with_classes(
+    const r_mempool_class_spec *specs, uint32_t number_of_classes,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread) {
+  r_mempool *rmp = (r_mempool *)mem_calloc(1, sizeof(r_mempool));
+  if (!rmp) {
+    return NULL;
+  }
+
+  if (!assess_r_mempool_class_specs(rmp, specs, number_of_classes, fb_policy,
+                                    will_be_accessed_by_only_one_thread)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+  rmp->fb_policy = fb_policy;
+
+  if (!init_r_mempool_internal_pools(rmp)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+
+  return rmp;
+}
+
+// Every class of a rebalancing pool starts with enough slabs for its
+// entry count, and each of its pools can take all the slabs if need be.
+bool init_rebalancing_r_mempool_internal_pools(r_mempool *rmp) {
+  if (!init_r_mempool_pseudo_pool(rmp)) {
+    return false;
+  }
+
+  rmp->mem_pools =
+      (mempool **)mem_calloc(rmp->number_of_mempools, sizeof(mempool *));
+  if (!rmp->mem_pools) {
+    // The cleanup will be performed by the caller.
+    return false;
+  }
+
+  uint64_t total_slab_count = 0;
+  for (uint32_t index = 0; index < rmp->number_of_mempools; ++index) {
+    uint32_t slab_elem_count =
+        rmp->slab_size / aligned_ext_elem_size(rmp->classes[index].size, 0);
+    if (slab_elem_count == 0) {
+      return false;
+    }
+    total_slab_count += (rmp->classes[index].count + slab_elem_count - 1) /
+                        slab_elem_count;
+  }
+  if (total_slab_count > UINT32_MAX) {
+    return false;
+  }
+
+  mempool_config config = {
+      .fallback_to_dynamic_memory =
+          rmp->fb_policy == fallback_at_first_exhaustion,
+      .lock_policy =
+          rmp->should_use_locks ? lock_policy_rwlock : lock_policy_none,
+  };
+
+  for (uint32_t index = 0; index < rmp->number_of_mempools; ++index) {
+    mempool *mp = mempool_create_slabbed(rmp->classes[index].size,
+                                         (uint32_t)total_slab_count, &config);
+    if (!mp) {
+      // The cleanup will be performed by the caller.
+      return false;
+    }
+    rmp->mem_pools[index] = mp;
+
+    while (mp->total_elem_count < rmp->classes[index].count) {
+      void *slab = mem_alloc(rmp->slab_size);
+      if (!slab) {
+        return false;
+      }
+      if (!mempool_add_slab(mp, slab, rmp->slab_size)) {
+        mem_free(slab);
+        return false;
+      }
+    }
+  }
+
+  return init_r_mempool_nonempty_classes(rmp);
+}
+
+r_mempool *r_mempool_create_rebalancing(
+    const r_mempool_class_spec *specs, uint32_t number_of_classes,
+    uint32_t slab_size, bool rebalance_on_exhaustion,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread) {
+  if (slab_size == 0) {
+    return NULL;
+  }
+
+  r_mempool *rmp = (r_mempool *)mem_calloc(1, sizeof(r_mempool));
+  if (!rmp) {
+    return NULL;
+  }
+
+  if (!assess_r_mempool_class_specs(rmp, specs, number_of_classes, fb_policy,
+                                    will_be_accessed_by_only_one_thread)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+  rmp->fb_policy = fb_policy;
+  rmp->slab_size = slab_size;
+  rmp->rebalance_on_exhaustion = rebalance_on_exhaustion;
+
+  if (!init_rebalancing_r_mempool_internal_pools(rmp)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+
+  return rmp;
+}
+
+uint32_t r_mempool_classes_buffer_size(const r_mempool_class_spec *specs,
+                                       uint32_t number_of_classes) {
+  if (!specs) {
+    return 0;
+  }
+
+  uint64_t size = 0;
+  for (uint32_t i = 0; i < number_of_classes; ++i) {
+    size += (uint64_t)specs[i].count *
+            (specs[i].size + offsetof(entry_header, next));
+    if (size > UINT32_MAX) {
+      return 0;
+    }
+  }
+
+  return (uint32_t)size;
+}
+
+bool init_static_r_mempool_internal_pools(r_mempool *rmp,
+                                          void *preallocated_buffer,
+                                          uint32_t preallocated_buffer_size) {
+  if (!init_r_mempool_pseudo_pool(rmp)) {
+    return false;
+  }
+
+  rmp->mem_pools =
+      (mempool **)mem_calloc(rmp->number_of_mempools, sizeof(mempool));
+  if (!rmp->mem_pools) {
+    // The cleanup will be performed by the caller.
+    return false;
+  }
+
+  uint32_t cumulative_size = 0;
+
+  for (uint32_t index = 0; index < rmp->number_of_mempools; ++index) {
+    uint32_t esize = r_mempool_class_upper_size(rmp, index);
+    uint32_t ecount = r_mempool_class_elem_count(rmp, index);
+    // Using different adjacent segments of the preallocated buffer
+    // with different sizes to accommodate different pools of memory.
+    uint8_t *sub_buffer = (uint8_t *)preallocated_buffer + cumulative_size;
+    uint32_t sub_buffer_size = ecount * (esize + offsetof(entry_header, next));
+    rmp->mem_pools[index] = mempool_create_from_preallocated_buffer(
+        sub_buffer, sub_buffer_size, esize,
+        rmp->fb_policy == fallback_at_first_exhaustion, !rmp->should_use_locks);
+    if (!rmp->mem_pools[index]) {
+      // The cleanup will be performed by the caller.
+      return false;
+    }
+    cumulative_size += sub_buffer_size;
+  }
+
+  if (cumulative_size != preallocated_buffer_size) {
+    return false;
+  }
+
+  return init_r_mempool_nonempty_classes(rmp);
+}
+
+r_mempool *r_mempool_create_spaced_from_preallocated_buffer(
+    void *buffer, uint32_t buf_size, uint8_t smallest_size_power_of_two,
+    uint8_t largest_size_power_of_two, uint8_t smallest_elem_count_power_of_two,
+    uint8_t classes_per_doubling_power_of_two,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread) {
+  r_mempool *rmp = (r_mempool *)mem_calloc(1, sizeof(r_mempool));
+  if (!rmp) {
+    return NULL;
+  }
+
+  if (!assess_r_mempool_create_inputs(
+          rmp, smallest_size_power_of_two, largest_size_power_of_two,
+          smallest_elem_count_power_of_two, classes_per_doubling_power_of_two,
+          fb_policy, will_be_accessed_by_only_one_thread)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+  rmp->fb_policy = fb_policy;
+
+  if (!init_static_r_mempool_internal_pools(rmp, buffer, buf_size)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+
+  return rmp;
+}
+
+r_mempool *r_mempool_create_from_preallocated_buffer(
+    void *buffer, uint32_t buf_size, uint8_t smallest_size_power_of_two,
+    uint8_t largest_size_power_of_two, uint8_t smallest_elem_count_power_of_two,
+    r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread) {
+  return r_mempool_create_spaced_from_preallocated_buffer(
+      buffer, buf_size, smallest_size_power_of_two, largest_size_power_of_two,
+      smallest_elem_count_power_of_two, 0, fb_policy,
+      will_be_accessed_by_only_one_thread);
+}
+
+r_mempool *r_mempool_create_with_classes_from_preallocated_buffer(
+    void *buffer, uint32_t buf_size, const r_mempool_class_spec *specs,
+    uint32_t number_of_classes, r_memory_fallback_policy_t fb_policy,
+    bool will_be_accessed_by_only_one_thread) {
+  // Checked upfront, so that the classes never exceed the buffer.
+  if (!buffer || buf_size == 0 ||
+      r_mempool_classes_buffer_size(specs, number_of_classes) != buf_size) {
+    return NULL;
+  }
+
+  r_mempool *rmp = (r_mempool *)mem_calloc(1, sizeof(r_mempool));
+  if (!rmp) {
+    return NULL;
+  }
+
+  if (!assess_r_mempool_class_specs(rmp, specs, number_of_classes, fb_policy,
+                                    will_be_accessed_by_only_one_thread)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+  rmp->fb_policy = fb_policy;
+
+  if (!init_static_r_mempool_internal_pools(rmp, buffer, buf_size)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+
+  return rmp;
+}
+
+void *mempool_pseudo_alloc_entry(mempool *mp, uint32_t elem_size) {
+  void *result = NULL;
+
+  if (elem_size < sizeof(addr_t)) {
+    elem_size = sizeof(addr_t);
+  }
+
+  uint32_t ext_elem_size = aligned_ext_elem_size(elem_size, mp->alignment);
+
+  if (mp->should_use_locks) {
+    pool_lock_acquire(&mp->lock);
+  }
+
+  entry_header *header = mempool_alloc_dynamic_header(mp, ext_elem_size);
+  if (header) {
+    result = (void *)&header->next;
+  }
+
+  if (mp->should_use_locks) {
+    pool_lock_release(&mp->lock);
+  }
+
+  return result;
+}
+
+static inline void r_mempool_count(uint64_t *counter, uint32_t value) {
+  __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+// Returns the first pool from 'index' on that may have free entries,
+// or number_of_mempools if there is none, without touching the pools.
+static inline uint32_t r_mempool_next_nonempty_class(r_mempool *rmp,
+                                                     uint32_t index) {
+  uint32_t words = (rmp->number_of_mempools + 63) / 64;
+
+  for (uint32_t word = index / 64; word < words; ++word) {
+    uint64_t bits =
+        __atomic_load_n(&rmp->nonempty_classes[word], __ATOMIC_ACQUIRE);
+    if (word == index / 64) {
+      bits &= ~0ull << (index % 64);
+    }
+    if (bits) {
+      return word * 64 + __builtin_ctzll(bits);
+    }
+  }
+
+  return rmp->number_of_mempools;
+}
+
+// Called once an allocation from the pool fails. An entry may have been
+// released right before the bit got cleared, in which case the bit has
+// to be set again, as the pool sets it only for its first free entry.
+// Either the pool sets its bit after this, or the acquire here makes
+// the count it had released visible.
+static void r_mempool_mark_exhausted(r_mempool *rmp, uint32_t index) {
+  mempool *mp = rmp->mem_pools[index];
+
+  __atomic_and_fetch(mp->nonempty_word, ~mp->nonempty_bit, __ATOMIC_ACQ_REL);
+  if (COUNTER_LOAD(mp->free_elem_count) > 0) {
+    __atomic_or_fetch(mp->nonempty_word, mp->nonempty_bit, __ATOMIC_RELEASE);
+  }
+}
+
+static inline bool r_mempool_is_hot(uint32_t used_count,
+                                    uint32_t total_capacity) {
+  return (uint64_t)used_count * 100 >=
+         (uint64_t)total_capacity * rebalancing_hot_percentage;
+}
+
+// A class can give a slab away if it has more than one, and wouldn't
+// become hot itself without it. Its utilization is returned as a
+// fraction through 'used_count' / 'total_capacity' to pick the coldest.
+static bool r_mempool_can_donate(r_mempool *rmp, uint32_t index,
+                                 uint32_t *used_count,
+                                 uint32_t *total_capacity) {
+  mempool *mp = rmp->mem_pools[index];
+  if (COUNTER_LOAD(mp->slab_count) < 2) {
+    return false;
+  }
+
+  mempool_stats stats = {0};
+  mempool_get_stats(mp, &stats);
+  uint32_t slab_elem_count = rmp->slab_size / mp->ext_elem_size;
+  if (stats.total_capacity <= slab_elem_count ||
+      r_mempool_is_hot(stats.used_count,
+                       stats.total_capacity - slab_elem_count)) {
+    return false;
+  }
+
+  *used_count = stats.used_count;
+  *total_capacity = stats.total_capacity;
+  return true;
+}
+
+// Moves a completely free slab from the coldest class that can give one
+// away into the given class. The classes are never locked at the same
+// time, so the rebalancing can't deadlock with the allocations.
+static bool r_mempool_refill_class(r_mempool *rmp, uint32_t hot_index) {
+  uint32_t coldest = rmp->number_of_mempools;
+  uint32_t coldest_used = 0;
+  uint32_t coldest_total = 0;
+
+  for (uint32_t index = 0; index < rmp->number_of_mempools; ++index) {
+    uint32_t used = 0;
+    uint32_t total = 0;
+    if (index != hot_index && r_mempool_can_donate(rmp, index, &used, &total) &&
+        (coldest == rmp->number_of_mempools ||
+         (uint64_t)used * coldest_total < (uint64_t)coldest_used * total)) {
+      coldest = index;
+      coldest_used = used;
+      coldest_total = total;
+    }
+  }
+  if (coldest == rmp->number_of_mempools) {
+    return false;
+  }
+
+  // The coldest class may have no completely free slab, the others are
+  // tried in turn then.
+  uint32_t donor = coldest;
+  void *slab = mempool_release_free_slab(rmp->mem_pools[donor]);
+  for (uint32_t index = 0; !slab && index < rmp->number_of_mempools;
+       ++index) {
+    uint32_t used = 0;
+    uint32_t total = 0;
+    if (index != hot_index && index != coldest &&
+        r_mempool_can_donate(rmp, index, &used, &total)) {
+      donor = index;
+      slab = mempool_release_free_slab(rmp->mem_pools[donor]);
+    }
+  }
+  if (!slab) {
+    return false;
+  }
+
+  if (!mempool_add_slab(rmp->mem_pools[hot_index], slab, rmp->slab_size)) {
+    // Every pool can hold all the slabs, so this is not supposed to
+    // happen, the slab goes back to where it came from anyway.
+    if (!mempool_add_slab(rmp->mem_pools[donor], slab, rmp->slab_size)) {
+      mem_free(slab);
+    }
+    return false;
+  }
+
+  return true;
+}
+
+uint32_t r_mempool_rebalance(r_mempool *rmp) {
+  if (!rmp || rmp->slab_size == 0) {
+    return 0;
+  }
+
+  uint32_t result = 0;
+  for (uint32_t index = 0; index < rmp->number_of_mempools; ++index) {
+    mempool_stats stats = {0};
+    mempool_get_stats(rmp->mem_pools[index], &stats);
+    if (r_mempool_is_hot(stats.used_count, stats.total_capacity) &&
+        r_mempool_refill_class(rmp, index)) {
+      ++result;
+    }
+  }
+
+  return result;
+}
+
+static inline bool r_mempool_has_large_entries(r_mempool *rmp) {
+  return __atomic_load_n(&rmp->large_entries_enabled, __ATOMIC_ACQUIRE);
+}
+
+static void *r_mempool_alloc_large_entry(r_mempool *rmp, uint32_t size) {
+  if (!r_mempool_has_large_entries(rmp)) {
+    return NULL;
+  }
+
+  entry_header *header = mempool_map_dynamic_header(&rmp->large_pool, size);
+  if (!header) {
+    mempool_count_failed_allocs(&rmp->large_pool, 1);
+    return NULL;
+  }
+
+  return (void *)&header->next;
+}
+
+// The fallback entries of R_MEMPOOL_LARGE_ENTRY_THRESHOLD bytes or more
+// get mapped rather than allocated, once the large entries are enabled,
+// so that they don't fragment the heap.
+static void *r_mempool_alloc_fallback_entry(r_mempool *rmp, uint32_t size) {
+  if (size >= R_MEMPOOL_LARGE_ENTRY_THRESHOLD &&
+      r_mempool_has_large_entries(rmp)) {
+    return r_mempool_alloc_large_entry(rmp, size);
+  }
+
+  return mempool_pseudo_alloc_entry(&rmp->pseudo_pool, size);
+}
+
+// Serves an allocation whose size class is exhausted from the larger
+// classes, or from the dynamic memory with fallback_at_last_exhaustion.
+// The exhausted classes are skipped without taking their locks.
+static void *r_mempool_alloc_escalated_entry(r_mempool *rmp,
+                                             uint32_t class_index,
+                                             uint32_t size) {
+  r_mempool_class_counters *counters = &rmp->class_counters[class_index];
+  void *result = NULL;
+
+  if (rmp->rebalance_on_exhaustion &&
+      r_mempool_refill_class(rmp, class_index)) {
+    result = mempool_alloc_entry(rmp->mem_pools[class_index]);
+    if (result) {
+      return result;
+    }
+  }
+
+  r_mempool_mark_exhausted(rmp, class_index);
+
+  for (uint32_t index = r_mempool_next_nonempty_class(rmp, class_index + 1);
+       index < rmp->number_of_mempools;
+       index = r_mempool_next_nonempty_class(rmp, index + 1)) {
+    result = mempool_alloc_entry(rmp->mem_pools[index]);
+    if (result) {
+      r_mempool_count(&counters->escalated_count, 1);
+      return result;
+    }
+    r_mempool_mark_exhausted(rmp, index);
+  }
+
+  if (rmp->fb_policy == fallback_at_last_exhaustion) {
+    result = r_mempool_alloc_fallback_entry(rmp, size);
+    if (result) {
+      r_mempool_count(&counters->last_exhaustion_fallback_count, 1);
+      return result;
+    }
+  }
+
+  r_mempool_count(&counters->failed_allocs_count, 1);
+  return NULL;
+}
+
+static void r_mempool_record_size(r_mempool *rmp, uint32_t class_index,
+                                  uint32_t size, void *entry) {
+  int cpu = sched_getcpu();
+  size_histogram_stripe *stripe =
+      &rmp->size_histograms[class_index * SIZE_HISTOGRAM_STRIPES +
+                            (cpu > 0 ? (uint32_t)cpu : 0) %
+                                SIZE_HISTOGRAM_STRIPES];
+
+  uint32_t lower = r_mempool_class_lower_size(rmp, class_index);
+  uint32_t upper = r_mempool_class_upper_size(rmp, class_index);
+  uint32_t bucket = (uint32_t)((uint64_t)(size - lower - 1) *
+                               R_MEMPOOL_SIZE_HISTOGRAM_BUCKETS /
+                               (upper - lower));
+
+  // The entry may have been served by a larger class, or by the
+  // dynamic memory, which hands out exactly the requested size, or by
+  // a mapping of the large entries, which has no entry size.
+  entry_header *header = ENTRY_TO_HEADER(entry);
+  mempool *mp = header->pool_ptr;
+  uint32_t handed_out = size;
+  if (mp->maps_entries) {
+    handed_out = r_mempool_usable_size(entry);
+  } else if (mp != &rmp->pseudo_pool) {
+    handed_out = mempool_user_size(mp);
+  }
+
+  __atomic_add_fetch(&stripe->counts[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stripe->requested_bytes, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stripe->handed_out_bytes, handed_out, __ATOMIC_RELAXED);
+}
+
+static void *r_mempool_alloc_untraced_entry(r_mempool *rmp, uint32_t size) {
+  if (!rmp || size == 0) {
+    return NULL;
+  }
+
+  if (size > rmp->largest_size) {
+    return r_mempool_alloc_large_entry(rmp, size);
+  }
+
+  uint32_t class_index = r_mempool_size_to_index(rmp, size);
+  void *result = mempool_alloc_entry(rmp->mem_pools[class_index]);
+
+  if (!result) {
+    result = r_mempool_alloc_escalated_entry(rmp, class_index, size);
+  }
 
-  if (fb_policy < 0 || fb_policy >= __fallback_end_place_holder) {
-    return false;
+  if (__atomic_load_n(&rmp->size_histogram_enabled, __ATOMIC_ACQUIRE) &&
+      result) {
+    r_mempool_record_size(rmp, class_index, size, result);
   }
 
-  uint32_t smallest_size = 1 << smallest_size_power_of_two;
-  uint32_t largest_size = 1 << largest_size_power_of_two;
-  uint32_t smallest_elem_count = 1 << smallest_elem_count_power_of_two;
+  return result;
+}
 
-  if (largest_size > max_allowed_largest_size ||
-      smallest_size < min_allowed_smallest_size) {
-    return false;
-  }
+void *r_mempool_alloc_entry(r_mempool *rmp, uint32_t size) {
+  void *result = r_mempool_alloc_untraced_entry(rmp, size);
 
-  rmp->should_use_locks = !will_be_accessed_by_only_one_thread;
-  rmp->smallest_size = smallest_size;
-  rmp->largest_size = largest_size;
-  rmp->smallest_elem_count = smallest_elem_count;
-  rmp->number_of_mempools =
-      largest_size_power_of_two - smallest_size_power_of_two + 1;
-  rmp->reverse_size_lookup_array_length = (largest_size) / (smallest_size);
+  if (rmp) {
+    r_mempool_trace(r_mempool_trace_alloc, result, NULL, size);
+  }
 
-  return true;
+  return result;
 }
 
-bool init_r_mempool_pseudo_pool(r_mempool *rmp) {
-  memset(&rmp->pseudo_pool, 0, sizeof(mempool));
-  if (rmp->fb_policy == fallback_at_last_exhaustion) {
-    if (rmp->should_use_locks) {
-      if (rw_lock_init(&rmp->pseudo_pool.lock) != 0) {
-        return false;
+// The large entries are mapped one by one anyway. Their pool counts the
+// missing ones as failed allocations, as it does for r_mempool_alloc_entry.
+static uint32_t r_mempool_alloc_large_bulk(r_mempool *rmp, uint32_t size,
+                                           void **entries, uint32_t count) {
+  uint32_t result = 0;
+
+  while (result < count) {
+    void *entry = r_mempool_alloc_large_entry(rmp, size);
+    if (!entry) {
+      if (r_mempool_has_large_entries(rmp)) {
+        // The first failure is counted already.
+        mempool_count_failed_allocs(&rmp->large_pool, count - result - 1);
       }
+      break;
     }
-    rmp->pseudo_pool.fallback_to_dynamic_memory = true;
-    rmp->pseudo_pool.mempool_mark = _mempool_mark;
+    entries[result++] = entry;
   }
 
-  return true;
+  return result;
 }
 
-bool init_r_mempool_internal_pools(r_mempool *rmp) {
-  if (!init_r_mempool_pseudo_pool(rmp)) {
-    return false;
+static uint32_t r_mempool_alloc_untraced_bulk(r_mempool *rmp, uint32_t size,
+                                              void **entries, uint32_t count) {
+  if (size > rmp->largest_size) {
+    return r_mempool_alloc_large_bulk(rmp, size, entries, count);
   }
 
-  rmp->mem_pools =
-      (mempool **)mem_alloc(rmp->number_of_mempools * sizeof(mempool));
-  if (!rmp->mem_pools) {
-    // The cleanup will be performed by the caller.
-    return false;
+  uint32_t class_index = r_mempool_size_to_index(rmp, size);
+  r_mempool_class_counters *counters = &rmp->class_counters[class_index];
+  uint32_t result =
+      mempool_alloc_bulk(rmp->mem_pools[class_index], entries, count);
+  while (result < count && rmp->rebalance_on_exhaustion &&
+         r_mempool_refill_class(rmp, class_index)) {
+    result += mempool_alloc_bulk(rmp->mem_pools[class_index], &entries[result],
+                                 count - result);
   }
-  memset(rmp->mem_pools, 0, rmp->number_of_mempools * sizeof(mempool));
+  uint32_t class_result = result;
 
-  uint32_t first_size = rmp->smallest_size;
-  uint32_t last_size = rmp->largest_size;
-  uint32_t first_count = rmp->smallest_elem_count;
+  if (result < count) {
+    r_mempool_mark_exhausted(rmp, class_index);
+  }
 
-  for (uint32_t esize = first_size, ecount = first_count, index = 0;
-       esize <= last_size; esize *= 2, ecount /= 2, ++index) {
-    rmp->mem_pools[index] = mempool_create(
-        ecount, esize, rmp->fb_policy == fallback_at_first_exhaustion,
-        !rmp->should_use_locks);
-    if (!rmp->mem_pools[index]) {
-      // The cleanup will be performed by the caller.
-      return false;
+  for (uint32_t index = r_mempool_next_nonempty_class(rmp, class_index + 1);
+       index < rmp->number_of_mempools && result < count;
+       index = r_mempool_next_nonempty_class(rmp, index + 1)) {
+    result += mempool_alloc_bulk(rmp->mem_pools[index], &entries[result],
+                                 count - result);
+    if (result < count) {
+      r_mempool_mark_exhausted(rmp, index);
     }
   }
+  if (result > class_result) {
+    r_mempool_count(&counters->escalated_count, result - class_result);
+  }
 
-  return true;
+  uint32_t pool_result = result;
+  while (result < count && rmp->fb_policy == fallback_at_last_exhaustion) {
+    void *entry = r_mempool_alloc_fallback_entry(rmp, size);
+    if (!entry) {
+      break;
+    }
+    entries[result++] = entry;
+  }
+  if (result > pool_result) {
+    r_mempool_count(&counters->last_exhaustion_fallback_count,
+                    result - pool_result);
+  }
+  if (result < count) {
+    r_mempool_count(&counters->failed_allocs_count, count - result);
+  }
+
+  if (__atomic_load_n(&rmp->size_histogram_enabled, __ATOMIC_ACQUIRE)) {
+    for (uint32_t i = 0; i < result; ++i) {
+      r_mempool_record_size(rmp, class_index, size, entries[i]);
+    }
+  }
+
+  return result;
 }
 
-bool init_r_mempool_reverse_size_lookup_array(r_mempool *rmp) {
-  rmp->reverse_size_lookup_array = (uint32_t *)mem_alloc(
-      rmp->largest_size / rmp->smallest_size * sizeof(uint32_t));
-  if (!rmp->reverse_size_lookup_array) {
-    // The cleanup will be performed by the caller.
-    return false;
+uint32_t r_mempool_alloc_bulk(r_mempool *rmp, uint32_t size, void **entries,
+                              uint32_t count) {
+  if (!rmp || size == 0 || !entries) {
+    return 0;
   }
 
-  uint32_t threshold_plus_one = 1;
-  uint32_t target_index = 0;
-  for (uint32_t i = 0; i < rmp->reverse_size_lookup_array_length; ++i) {
-    rmp->reverse_size_lookup_array[i] = target_index;
-    if (i == (threshold_plus_one - 1)) {
-      ++target_index;
-      threshold_plus_one *= 2;
-    }
+  uint32_t result = r_mempool_alloc_untraced_bulk(rmp, size, entries, count);
+
+  // The missing entries are recorded as failed allocations.
+  for (uint32_t i = 0; i < count; ++i) {
+    r_mempool_trace(r_mempool_trace_alloc, i < result ? entries[i] : NULL,
+                    NULL, size);
   }
 
-  return true;
+  return result;
 }
 
-r_mempool *r_mempool_create(uint8_t smallest_size_power_of_two,
-                            uint8_t largest_size_power_of_two,
-                            uint8_t smallest_elem_count_power_of_two,
-                            r_memory_fallback_policy_t fb_policy,
-                            bool will_be_accessed_by_only_one_thread) {
-  r_mempool *rmp = (r_mempool *)mem_calloc(1, sizeof(r_mempool));
-  if (!rmp) {
-    return NULL;
+void *r_mempool_calloc_entry(r_mempool *rmp, uint32_t size) {
+  void *result = r_mempool_alloc_entry(rmp, size);
+
+  if (result) {
+    memset(result, 0, size);
   }
 
-  if (!assess_r_mempool_create_inputs(
-          rmp, smallest_size_power_of_two, largest_size_power_of_two,
-          smallest_elem_count_power_of_two, fb_policy,
-          will_be_accessed_by_only_one_thread)) {
-    r_mempool_destroy(rmp);
-    return NULL;
+  return result;
+}
+
+uint32_t r_mempool_usable_size(void *entry) {
+  if (!entry) {
+    return 0;
   }
-  rmp->fb_policy = fb_policy;
 
-  if (!init_r_mempool_internal_pools(rmp)) {
-    r_mempool_destroy(rmp);
-    return NULL;
+  headerless_slab *slab = headerless_slab_of(entry);
+  if (slab) {
+    return mempool_user_size(slab->pool_ptr);
   }
 
-  if (!init_r_mempool_reverse_size_lookup_array(rmp)) {
-    r_mempool_destroy(rmp);
-    return NULL;
+  entry_header *header = mempool_checked_header(entry);
+  mempool *mp = header->pool_ptr;
+  if (mp->maps_entries) {
+    size_t size = mempool_mapped_user_size(mp, header);
+    return size < UINT32_MAX ? (uint32_t)size : UINT32_MAX;
+  }
+  if (mp->ext_elem_size == 0) {
+    // Only the pseudo pool has no entry size, its entries are as large
+    // as requested, possibly rounded up by the allocator.
+    size_t size = malloc_usable_size((uint8_t *)header - mp->header_offset) -
+                  mp->header_offset - offsetof(entry_header, next);
+    return size < UINT32_MAX ? (uint32_t)size : UINT32_MAX;
   }
 
-  return rmp;
+  return mempool_user_size(mp);
 }
 
-bool init_static_r_mempool_internal_pools(r_mempool *rmp,
-                                          void *preallocated_buffer,
-                                          uint32_t preallocated_buffer_size) {
-  if (!init_r_mempool_pseudo_pool(rmp)) {
-    return false;
+static void *r_mempool_realloc_untraced_entry(r_mempool *rmp, void *addr,
+                                              uint32_t size) {
+  if (!rmp || size == 0) {
+    return NULL;
   }
 
-  rmp->mem_pools =
-      (mempool **)mem_calloc(rmp->number_of_mempools, sizeof(mempool));
-  if (!rmp->mem_pools) {
-    // The cleanup will be performed by the caller.
-    return false;
+  bool is_large = size > rmp->largest_size;
+  if (is_large && !r_mempool_has_large_entries(rmp)) {
+    return NULL;
   }
 
-  uint32_t first_size = rmp->smallest_size;
-  uint32_t last_size = rmp->largest_size;
-  uint32_t first_count = rmp->smallest_elem_count;
+  uint32_t copy_size = 0;
 
-  uint32_t cumulative_size = 0;
+  if (addr) {
+    entry_header *header = ENTRY_TO_HEADER(addr);
 
-  for (uint32_t esize = first_size, ecount = first_count, index = 0;
-       esize <= last_size; esize *= 2, ecount /= 2, ++index) {
-    // Using different adjacent segments of the preallocated buffer
-    // with different sizes to accommodate different pools of memory.
-    uint8_t *sub_buffer = (uint8_t *)preallocated_buffer + cumulative_size;
-    uint32_t sub_buffer_size = ecount * (esize + offsetof(entry_header, next));
-    rmp->mem_pools[index] = mempool_create_from_preallocated_buffer(
-        sub_buffer, sub_buffer_size, esize,
-        rmp->fb_policy == fallback_at_first_exhaustion, !rmp->should_use_locks);
-    if (!rmp->mem_pools[index]) {
-      // The cleanup will be performed by the caller.
-      return false;
+    if (!is_large) {
+      uint32_t index = r_mempool_size_to_index(rmp, size);
+      uint32_t new_ext_size = rmp->mem_pools[index]->ext_elem_size;
+
+      if (new_ext_size == header->pool_ptr->ext_elem_size) {
+        // The requested size matches the current
+        // size, return the original pointer.
+        return addr;
+      }
     }
-    cumulative_size += sub_buffer_size;
+
+    // The entry may also have room to spare, e.g. when it came from a
+    // larger class, or when it is shrinking.
+    uint32_t usable_size = r_mempool_usable_size(addr);
+    uint32_t percentage = __atomic_load_n(&rmp->realloc_in_place_percentage,
+                                          __ATOMIC_RELAXED);
+    if (size <= usable_size &&
+        (uint64_t)size * 100 >= (uint64_t)usable_size * percentage) {
+      return addr;
+    }
+
+    // A large entry staying large gets remapped rather than copied.
+    if (is_large && header->pool_ptr == &rmp->large_pool) {
+      entry_header *new_header =
+          mempool_remap_dynamic_header(&rmp->large_pool, header, size);
+      if (new_header) {
+        return (void *)&new_header->next;
+      }
+    }
+
+    copy_size = size < usable_size ? size : usable_size;
   }
 
-  if (cumulative_size != preallocated_buffer_size) {
-    return false;
+  void *new_entry = r_mempool_alloc_untraced_entry(rmp, size);
+  if (new_entry && addr) {
+    memcpy(new_entry, addr, copy_size);
+    mempool_free_entry(addr);
   }
 
-  return true;
+  return new_entry;
 }
 
-r_mempool *r_mempool_create_from_preallocated_buffer(
-    void *buffer, uint32_t buf_size, uint8_t smallest_size_power_of_two,
-    uint8_t largest_size_power_of_two, uint8_t smallest_elem_count_power_of_two,
-    r_memory_fallback_policy_t fb_policy,
-    bool will_be_accessed_by_only_one_thread) {
-  r_mempool *rmp = (r_mempool *)mem_calloc(1, sizeof(r_mempool));
-  if (!rmp) {
-    return NULL;
+bool r_mempool_enable_large_entries(r_mempool *rmp,
+                                    uint32_t cached_mapping_count) {
+  if (!rmp || rmp->large_entries_enabled ||
+      cached_mapping_count > R_MEMPOOL_MAX_CACHED_MAPPINGS) {
+    return false;
   }
 
-  if (!assess_r_mempool_create_inputs(
-          rmp, smallest_size_power_of_two, largest_size_power_of_two,
-          smallest_elem_count_power_of_two, fb_policy,
-          will_be_accessed_by_only_one_thread)) {
-    r_mempool_destroy(rmp);
-    return NULL;
+  mempool *mp = &rmp->large_pool;
+  memset(mp, 0, sizeof(mempool));
+  if (cached_mapping_count > 0) {
+    mp->cached_mappings = (cached_mapping *)mem_calloc(cached_mapping_count,
+                                                       sizeof(cached_mapping));
+    if (!mp->cached_mappings) {
+      return false;
+    }
+    if (rmp->should_use_locks) {
+      if (pool_lock_init(&mp->lock, lock_policy_rwlock) != 0) {
+        mem_free(mp->cached_mappings);
+        mp->cached_mappings = NULL;
+        return false;
+      }
+      mp->should_use_locks = true;
+    }
   }
-  rmp->fb_policy = fb_policy;
 
-  if (!init_static_r_mempool_internal_pools(rmp, buffer, buf_size)) {
-    r_mempool_destroy(rmp);
-    return NULL;
-  }
+  mp->fallback_to_dynamic_memory = true;
+  mp->mempool_mark = _mempool_mark;
+  mp->alignment = rmp->alignment;
+  // The length of the mapping comes first, then the header.
+  mp->header_offset = rmp->alignment > 2 * offsetof(entry_header, next)
+                          ? rmp->alignment - offsetof(entry_header, next)
+                          : offsetof(entry_header, next);
+  mp->maps_entries = true;
+  mp->max_cached_mappings = cached_mapping_count;
+
+  __atomic_store_n(&rmp->large_entries_enabled, true, __ATOMIC_RELEASE);
+  return true;
+}
 
-  if (!init_r_mempool_reverse_size_lookup_array(rmp)) {
-    r_mempool_destroy(rmp);
-    return NULL;
+bool r_mempool_set_realloc_in_place_percentage(r_mempool *rmp,
+                                               uint32_t percentage) {
+  if (!rmp || percentage > 100) {
+    return false;
   }
 
-  return rmp;
+  __atomic_store_n(&rmp->realloc_in_place_percentage, percentage,
+                   __ATOMIC_RELAXED);
+  return true;
 }
 
-void *mempool_pseudo_alloc_entry(mempool *mp, uint32_t elem_size) {
-  void *result = NULL;
+void *r_mempool_realloc_entry(r_mempool *rmp, void *addr, uint32_t size) {
+  void *result = r_mempool_realloc_untraced_entry(rmp, addr, size);
 
-  if (elem_size < sizeof(addr_t)) {
-    elem_size = sizeof(addr_t);
+  if (rmp) {
+    r_mempool_trace(r_mempool_trace_realloc, result, addr, size);
   }
 
-  uint32_t ext_elem_size = USER_SIZE_TO_EXT_SIZE(elem_size);
+  return result;
+}
 
-  if (mp->should_use_locks) {
-    rw_lock_wrlock(&mp->lock);
+void _r_mempool_free_entry(void *entry) {
+  if (entry) {
+    r_mempool_trace(r_mempool_trace_free, entry, NULL, 0);
   }
 
-  void *new_buffer = mem_alloc(ext_elem_size);
-  if (new_buffer) {
-    entry_header *header = (entry_header *)new_buffer;
-    header->elem_status = elem_is_not_a_pool_member;
-    header->pool_ptr = mp;
-    result = (void *)&header->next;
-    ++mp->active_dynamic_memory_buffer_count;
-  }
+  _mempool_free_entry(entry);
+}
 
-  if (mp->should_use_locks) {
-    rw_lock_unlock(&mp->lock);
+void r_mempool_free_bulk(void **entries, uint32_t count) {
+  if (entries && __atomic_load_n(&trace_file, __ATOMIC_RELAXED)) {
+    for (uint32_t i = 0; i < count; ++i) {
+      if (entries[i]) {
+        r_mempool_trace(r_mempool_trace_free, entries[i], NULL, 0);
+      }
+    }
   }
 
-  return result;
+  mempool_free_bulk(entries, count);
 }
 
-void *r_mempool_alloc_entry(r_mempool *rmp, uint32_t size) {
+uint32_t r_mempool_used_count(r_mempool *rmp, uint32_t size) {
   if (!rmp || size == 0 || size > rmp->largest_size) {
-    return NULL;
+    return 0;
   }
 
-  uint32_t index = (size - 1) / rmp->smallest_size;
+  uint32_t index = r_mempool_size_to_index(rmp, size);
 
-  void *result = NULL;
+  return mempool_used_count(rmp->mem_pools[index]);
+}
 
-  for (; index <= rmp->number_of_mempools; ++index) {
-    result = mempool_alloc_entry(
-        rmp->mem_pools[rmp->reverse_size_lookup_array[index]]);
-    if (result) {
-      break;
-    }
+void r_mempool_get_stats(r_mempool *rmp, uint32_t size,
+                         r_mempool_stats *stats) {
+  if (!stats) {
+    assert(false);
   }
 
-  if (!result && rmp->fb_policy == fallback_at_last_exhaustion) {
-    result = mempool_pseudo_alloc_entry(&rmp->pseudo_pool, size);
+  memset(stats, 0, sizeof(r_mempool_stats));
+  if (!rmp || size == 0) {
+    return;
   }
 
-  return result;
+  if (size > rmp->largest_size) {
+    if (r_mempool_has_large_entries(rmp)) {
+      mempool_get_stats(&rmp->large_pool, &stats->pool);
+    }
+    return;
+  }
+
+  uint32_t index = r_mempool_size_to_index(rmp, size);
+  r_mempool_class_counters *counters = &rmp->class_counters[index];
+
+  mempool_get_stats(rmp->mem_pools[index], &stats->pool);
+  stats->escalated_count = COUNTER_LOAD(counters->escalated_count);
+  stats->last_exhaustion_fallback_count =
+      COUNTER_LOAD(counters->last_exhaustion_fallback_count);
+  stats->failed_allocs_count = COUNTER_LOAD(counters->failed_allocs_count);
 }
 
-void *r_mempool_calloc_entry(r_mempool *rmp, uint32_t size) {
-  void *result = r_mempool_alloc_entry(rmp, size);
+size_t r_mempool_trim(r_mempool *rmp) {
+  if (!rmp) {
+    return 0;
+  }
 
-  if (result) {
-    memset(result, 0, size);
+  size_t result = 0;
+  for (uint32_t i = 0; i < rmp->number_of_mempools; ++i) {
+    result += mempool_trim(rmp->mem_pools[i]);
   }
 
-  return result;
-}
+  // The cached mappings of the large entries go back as well.
+  if (r_mempool_has_large_entries(rmp) &&
+      rmp->large_pool.max_cached_mappings > 0) {
+    mempool *mp = &rmp->large_pool;
+    if (mp->should_use_locks) {
+      pool_lock_acquire(&mp->lock);
+    }
 
-void *r_mempool_realloc_entry(r_mempool *rmp, void *addr, uint32_t size) {
-  if (!rmp || size == 0 || size > rmp->largest_size) {
-    return NULL;
+    for (uint32_t i = 0; i < mp->cached_mapping_count; ++i) {
+      munmap(mp->cached_mappings[i].base, mp->cached_mappings[i].length);
+      result += mp->cached_mappings[i].length;
+    }
+    mp->cached_mapping_count = 0;
+
+    if (mp->should_use_locks) {
+      pool_lock_release(&mp->lock);
+    }
   }
 
-  uint32_t min_user_size = 0;
+  return result;
+}
 
-  if (addr) {
-    entry_header *header = ENTRY_TO_HEADER(addr);
+void r_mempool_reset_stats(r_mempool *rmp) {
+  if (!rmp) {
+    return;
+  }
 
-    uint32_t index = (size - 1) / rmp->smallest_size;
-    uint32_t new_ext_size =
-        rmp->mem_pools[rmp->reverse_size_lookup_array[index]]->ext_elem_size;
+  for (uint32_t i = 0; i < rmp->number_of_mempools; ++i) {
+    r_mempool_class_counters *counters = &rmp->class_counters[i];
+    mempool_reset_stats(rmp->mem_pools[i]);
+    __atomic_store_n(&counters->escalated_count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&counters->last_exhaustion_fallback_count, 0,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&counters->failed_allocs_count, 0, __ATOMIC_RELAXED);
+  }
+  mempool_reset_stats(&rmp->pseudo_pool);
+  if (r_mempool_has_large_entries(rmp)) {
+    mempool_reset_stats(&rmp->large_pool);
+  }
 
-    if (new_ext_size == header->pool_ptr->ext_elem_size) {
-      // The requested size matches the current
-      // size, return the original pointer.
-      return addr;
+  size_histogram_stripe *histograms =
+      __atomic_load_n(&rmp->size_histograms, __ATOMIC_ACQUIRE);
+  if (histograms) {
+    for (uint32_t i = 0; i < rmp->number_of_mempools * SIZE_HISTOGRAM_STRIPES;
+         ++i) {
+      for (uint32_t j = 0; j < R_MEMPOOL_SIZE_HISTOGRAM_BUCKETS; ++j) {
+        __atomic_store_n(&histograms[i].counts[j], 0, __ATOMIC_RELAXED);
+      }
+      __atomic_store_n(&histograms[i].requested_bytes, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&histograms[i].handed_out_bytes, 0, __ATOMIC_RELAXED);
     }
+  }
+}
 
-    min_user_size = EXT_SIZE_TO_USER_SIZE(header->pool_ptr->ext_elem_size);
-    if (EXT_SIZE_TO_USER_SIZE(new_ext_size) < min_user_size) {
-      min_user_size = EXT_SIZE_TO_USER_SIZE(new_ext_size);
-    }
+bool r_mempool_set_size_histogram(r_mempool *rmp, bool enabled) {
+  if (!rmp) {
+    return false;
   }
 
-  void *new_entry = r_mempool_alloc_entry(rmp, size);
-  if (new_entry && addr) {
-    memcpy(new_entry, addr, min_user_size);
-    mempool_free_entry(addr);
+  if (enabled && !__atomic_load_n(&rmp->size_histograms, __ATOMIC_ACQUIRE)) {
+    size_t size = (size_t)rmp->number_of_mempools * SIZE_HISTOGRAM_STRIPES *
+                  sizeof(size_histogram_stripe);
+    size_histogram_stripe *histograms =
+        (size_histogram_stripe *)aligned_alloc(CACHE_LINE_SIZE, size);
+    if (!histograms) {
+      return false;
+    }
+    memset(histograms, 0, size);
+
+    // The histograms stay around until the pool gets destroyed, since
+    // the allocating threads may still be recording into them.
+    size_histogram_stripe *expected = NULL;
+    if (!__atomic_compare_exchange_n(&rmp->size_histograms, &expected,
+                                     histograms, false, __ATOMIC_RELEASE,
+                                     __ATOMIC_RELAXED)) {
+      mem_free(histograms);
+    }
   }
 
-  return new_entry;
+  __atomic_store_n(&rmp->size_histogram_enabled, enabled, __ATOMIC_RELEASE);
+  return true;
 }
 
-uint32_t r_mempool_used_count(r_mempool *rmp, uint32_t size) {
+void r_mempool_get_size_histogram(r_mempool *rmp, uint32_t size,
+                                  r_mempool_size_histogram *histogram) {
+  if (!histogram) {
+    assert(false);
+  }
+
+  memset(histogram, 0, sizeof(r_mempool_size_histogram));
   if (!rmp || size == 0 || size > rmp->largest_size) {
-    return 0;
+    return;
   }
 
-  uint32_t index = (size - 1) / rmp->smallest_size;
+  uint32_t index = r_mempool_size_to_index(rmp, size);
+  histogram->lower_size = r_mempool_class_lower_size(rmp, index);
+  histogram->upper_size = r_mempool_class_upper_size(rmp, index);
+
+  size_histogram_stripe *histograms =
+      __atomic_load_n(&rmp->size_histograms, __ATOMIC_ACQUIRE);
+  if (!histograms) {
+    return;
+  }
 
-  return mempool_used_count(
-      rmp->mem_pools[rmp->reverse_size_lookup_array[index]]);
+  for (uint32_t i = 0; i < SIZE_HISTOGRAM_STRIPES; ++i) {
+    size_histogram_stripe *stripe =
+        &histograms[index * SIZE_HISTOGRAM_STRIPES + i];
+    for (uint32_t j = 0; j < R_MEMPOOL_SIZE_HISTOGRAM_BUCKETS; ++j) {
+      histogram->counts[j] += COUNTER_LOAD(stripe->counts[j]);
+    }
+    histogram->requested_bytes += COUNTER_LOAD(stripe->requested_bytes);
+    histogram->handed_out_bytes += COUNTER_LOAD(stripe->handed_out_bytes);
+  }
 }
 
 uint32_t r_mempool_total_capacity(r_mempool *rmp, uint32_t size) {
@@ -780,10 +4324,9 @@ uint32_t r_mempool_total_capacity(r_mempool *rmp, uint32_t size) {
     return 0;
   }
 
-  uint32_t index = (size - 1) / rmp->smallest_size;
+  uint32_t index = r_mempool_size_to_index(rmp, size);
 
-  return mempool_total_capacity(
-      rmp->mem_pools[rmp->reverse_size_lookup_array[index]]);
+  return mempool_total_capacity(rmp->mem_pools[index]);
 }
 
 uint32_t r_mempool_dynamic_allocs_count(r_mempool *rmp, uint32_t size) {
@@ -796,10 +4339,9 @@ uint32_t r_mempool_dynamic_allocs_count(r_mempool *rmp, uint32_t size) {
   }
 
   if (rmp->fb_policy == fallback_at_first_exhaustion) {
-    uint32_t index = (size - 1) / rmp->smallest_size;
+    uint32_t index = r_mempool_size_to_index(rmp, size);
 
-    return mempool_dynamic_allocs_count(
-        rmp->mem_pools[rmp->reverse_size_lookup_array[index]]);
+    return mempool_dynamic_allocs_count(rmp->mem_pools[index]);
   }
 
   return mempool_dynamic_allocs_count(&rmp->pseudo_pool);
@@ -0,0 +1,488 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// A drop-in replacement of the malloc family on top of a ranged pool,
+// to be preloaded under unmodified programs:
+//
+//   LD_PRELOAD=./libcmempool_malloc.so ./program
+//
+// The sizes up to the largest class are served by the ranged pool, whose
+// classes keep per-thread magazines, and the larger sizes by its large
+// entries, which get mapped one by one. The
+// pool code is compiled into this translation unit, so its own calls to
+// malloc and friends end up here as well. Those calls, and the ones made
+// before the pool exists, are served by mmap directly, which keeps the
+// bootstrapping free of recursion.
+
+#include "cmempool.c"
+
+#include <errno.h>
+#include <sys/mman.h>
+
+// The geometry of the ranged pool, see r_mempool_create. The pool buffers
+// are reserved up front, but their pages only get touched once used.
+#ifndef CMEMPOOL_MALLOC_SMALLEST_SIZE_POWER_OF_TWO
+#define CMEMPOOL_MALLOC_SMALLEST_SIZE_POWER_OF_TWO 4
+#endif
+#ifndef CMEMPOOL_MALLOC_LARGEST_SIZE_POWER_OF_TWO
+#define CMEMPOOL_MALLOC_LARGEST_SIZE_POWER_OF_TWO 15
+#endif
+#ifndef CMEMPOOL_MALLOC_SMALLEST_ELEM_COUNT_POWER_OF_TWO
+#define CMEMPOOL_MALLOC_SMALLEST_ELEM_COUNT_POWER_OF_TWO 21
+#endif
+#ifndef CMEMPOOL_MALLOC_THREAD_CACHE_SIZE
+#define CMEMPOOL_MALLOC_THREAD_CACHE_SIZE 256
+#endif
+// An entry shrinking below this percentage of its usable size gets moved
+// to a smaller class by realloc.
+#ifndef CMEMPOOL_MALLOC_REALLOC_IN_PLACE_PERCENTAGE
+#define CMEMPOOL_MALLOC_REALLOC_IN_PLACE_PERCENTAGE 50
+#endif
+// The number of released large entry mappings kept for reuse, see
+// r_mempool_enable_large_entries.
+#ifndef CMEMPOOL_MALLOC_CACHED_MAPPINGS
+#define CMEMPOOL_MALLOC_CACHED_MAPPINGS 16
+#endif
+
+#define MALLOC_EXPORT __attribute__((visibility("default")))
+
+// The alignment malloc guarantees, as glibc does on 64-bit targets.
+#define MALLOC_MIN_ALIGNMENT 16
+
+// The pointers which don't come from the pool directly carry this header
+// right before them, in place of the entry_header of the pool entries.
+// The marks are distinct from every elem_status, so free can tell them
+// apart.
+typedef struct shim_header {
+  uint32_t mark;
+  void *base;  // The mapping, or the pool entry holding the pointer
+} shim_header;
+
+static const uint32_t shim_mapped_mark = 0xbadc0ffe;
+static const uint32_t shim_offset_mark = 0xabad1dea;
+
+typedef enum shim_state_t {
+  shim_uninitialized = 0,
+  shim_initializing,
+  shim_ready
+} shim_state_t;
+
+static r_mempool *shim_rmp = NULL;
+static uint32_t shim_state = shim_uninitialized;
+// Set while the thread is inside the pool code, so that the allocations
+// made by the pool itself don't recurse into it.
+static __thread bool shim_busy = false;
+
+static inline size_t shim_page_size(void) {
+  static size_t page_size = 0;
+  size_t size = __atomic_load_n(&page_size, __ATOMIC_RELAXED);
+
+  if (size == 0) {
+    size = (size_t)sysconf(_SC_PAGESIZE);
+    __atomic_store_n(&page_size, size, __ATOMIC_RELAXED);
+  }
+
+  return size;
+}
+
+static inline shim_header *shim_header_of(void *ptr) {
+  return (shim_header *)ptr - 1;
+}
+
+// Maps a zeroed region for a single allocation. The length of the mapping
+// is stored at its start, and the user pointer is aligned after it.
+static void *shim_map(size_t size, size_t alignment) {
+  size_t page_size = shim_page_size();
+  size_t prefix = sizeof(size_t) + sizeof(shim_header);
+
+  if (alignment < MALLOC_MIN_ALIGNMENT) {
+    alignment = MALLOC_MIN_ALIGNMENT;
+  }
+
+  if (size > SIZE_MAX - prefix - alignment - page_size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t length = (prefix + alignment + size + page_size - 1) &
+                  ~(page_size - 1);
+  void *base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  *(size_t *)base = length;
+  uintptr_t user =
+      ((uintptr_t)base + prefix + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  shim_header *header = shim_header_of((void *)user);
+  header->mark = shim_mapped_mark;
+  header->base = base;
+
+  return (void *)user;
+}
+
+static inline size_t shim_mapped_usable_size(void *ptr) {
+  void *base = shim_header_of(ptr)->base;
+  return (uintptr_t)base + *(size_t *)base - (uintptr_t)ptr;
+}
+
+static void shim_unmap(void *ptr) {
+  void *base = shim_header_of(ptr)->base;
+  munmap(base, *(size_t *)base);
+}
+
+// Grows or shrinks a mapped allocation, possibly moving the mapping. The
+// offset of the user pointer within its page doesn't change, so neither
+// does its alignment, as long as it isn't above the page size.
+static void *shim_remap(void *ptr, size_t size) {
+  size_t page_size = shim_page_size();
+  void *base = shim_header_of(ptr)->base;
+  size_t offset = (uintptr_t)ptr - (uintptr_t)base;
+
+  if (offset >= page_size || size > SIZE_MAX - offset - page_size) {
+    return NULL;
+  }
+
+  size_t length = (offset + size + page_size - 1) & ~(page_size - 1);
+  void *new_base = mremap(base, *(size_t *)base, length, MREMAP_MAYMOVE);
+  if (new_base == MAP_FAILED) {
+    return NULL;
+  }
+
+  *(size_t *)new_base = length;
+  void *new_ptr = (uint8_t *)new_base + offset;
+  shim_header_of(new_ptr)->base = new_base;
+
+  return new_ptr;
+}
+
+static r_mempool *shim_create_pool(void) {
+  r_mempool *rmp = (r_mempool *)mem_calloc(1, sizeof(r_mempool));
+  if (!rmp) {
+    return NULL;
+  }
+
+  // An exhausted class escalates to the larger ones as usual, and the
+  // allocation gets mapped once all of them are exhausted.
+  if (!assess_r_mempool_create_inputs(
+          rmp, CMEMPOOL_MALLOC_SMALLEST_SIZE_POWER_OF_TWO,
+          CMEMPOOL_MALLOC_LARGEST_SIZE_POWER_OF_TWO,
+          CMEMPOOL_MALLOC_SMALLEST_ELEM_COUNT_POWER_OF_TWO, 0,
+          fallback_disabled, false)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+  rmp->fb_policy = fallback_disabled;
+  rmp->lock_policy = lock_policy_adaptive_mutex;
+  rmp->thread_cache_size = CMEMPOOL_MALLOC_THREAD_CACHE_SIZE;
+  rmp->lazy_init = true;
+  rmp->realloc_in_place_percentage =
+      CMEMPOOL_MALLOC_REALLOC_IN_PLACE_PERCENTAGE;
+
+  if (!init_r_mempool_internal_pools(rmp)) {
+    r_mempool_destroy(rmp);
+    return NULL;
+  }
+
+  // Without the large entries, the shim maps the large sizes itself.
+  r_mempool_enable_large_entries(rmp, CMEMPOOL_MALLOC_CACHED_MAPPINGS);
+
+  return rmp;
+}
+
+// Another thread may hold any of the pool locks at the time of a fork, and
+// it doesn't exist in the child, so the child would block on its first
+// allocation. All of them are taken before forking instead, then released
+// in the parent, and reinitialized in the child. The pool code never
+// takes the slot lock while holding a pool lock, so it comes last. The
+// pool locks are adaptive mutexes, as the MCS locks can't be nested, see
+// mcs_thread_node.
+static void shim_for_each_pool_lock(r_mempool *rmp,
+                                    void (*visit)(pool_lock *)) {
+  for (uint32_t i = 0; i < rmp->number_of_mempools; ++i) {
+    if (rmp->mem_pools[i]->should_use_locks) {
+      visit(&rmp->mem_pools[i]->lock);
+    }
+  }
+  if (rmp->pseudo_pool.should_use_locks) {
+    visit(&rmp->pseudo_pool.lock);
+  }
+  if (r_mempool_has_large_entries(rmp) && rmp->large_pool.should_use_locks) {
+    visit(&rmp->large_pool.lock);
+  }
+}
+
+static void shim_reinit_pool_lock(pool_lock *lock) {
+  pool_lock_init(lock, lock->policy);
+}
+
+static void shim_prepare_fork(void) {
+  shim_for_each_pool_lock(shim_rmp, pool_lock_acquire);
+  pthread_mutex_lock(&thread_cache_slots_lock);
+}
+
+static void shim_release_after_fork(void) {
+  pthread_mutex_unlock(&thread_cache_slots_lock);
+  shim_for_each_pool_lock(shim_rmp, pool_lock_release);
+}
+
+static void shim_reset_after_fork(void) {
+  pthread_mutex_init(&thread_cache_slots_lock, NULL);
+  shim_for_each_pool_lock(shim_rmp, shim_reinit_pool_lock);
+}
+
+// Returns the pool once it is ready. The first caller creates it, while
+// the callers racing with it, as well as the allocations made during the
+// creation, get NULL and fall back to mmap. If the creation fails, the
+// shim keeps serving everything by mmap.
+static inline r_mempool *shim_pool(void) {
+  uint32_t state = __atomic_load_n(&shim_state, __ATOMIC_ACQUIRE);
+  if (state == shim_ready) {
+    return shim_busy ? NULL : shim_rmp;
+  }
+
+  uint32_t expected = shim_uninitialized;
+  if (state != shim_uninitialized ||
+      !__atomic_compare_exchange_n(&shim_state, &expected, shim_initializing,
+                                   false, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  shim_rmp = shim_create_pool();
+  if (shim_rmp &&
+      pthread_atfork(shim_prepare_fork, shim_release_after_fork,
+                     shim_reset_after_fork) != 0) {
+    // Forking would be unsafe, so let's keep serving everything by mmap.
+    r_mempool_destroy(shim_rmp);
+  }
+  __atomic_store_n(&shim_state, shim_ready, __ATOMIC_RELEASE);
+
+  return shim_busy ? NULL : shim_rmp;
+}
+
+static inline void *shim_pool_alloc(r_mempool *rmp, size_t size) {
+  shim_busy = true;
+  void *result = r_mempool_alloc_entry(rmp, size ? (uint32_t)size : 1);
+  shim_busy = false;
+
+  return result;
+}
+
+static void *shim_malloc(size_t size) {
+  r_mempool *rmp = shim_pool();
+
+  if (rmp && size <= UINT32_MAX) {
+    void *result = shim_pool_alloc(rmp, size);
+    if (result) {
+      return result;
+    }
+  }
+
+  return shim_map(size, MALLOC_MIN_ALIGNMENT);
+}
+
+static void shim_free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+
+  shim_header *header = shim_header_of(ptr);
+  if (header->mark == shim_mapped_mark) {
+    shim_unmap(ptr);
+    return;
+  }
+  if (header->mark == shim_offset_mark) {
+    ptr = header->base;
+  }
+
+  bool busy = shim_busy;
+  shim_busy = true;
+  _r_mempool_free_entry(ptr);
+  shim_busy = busy;
+}
+
+static void *shim_aligned_alloc(size_t alignment, size_t size) {
+  if (alignment <= MALLOC_MIN_ALIGNMENT) {
+    return shim_malloc(size);
+  }
+
+  r_mempool *rmp = shim_pool();
+  if (rmp && alignment < rmp->largest_size &&
+      size <= rmp->largest_size - alignment) {
+    // The entry is at least 16 bytes aligned, so there is room for the
+    // header and the size before the first aligned address after it.
+    void *entry = shim_pool_alloc(rmp, size + alignment);
+    if (entry) {
+      uintptr_t user = ((uintptr_t)entry + sizeof(shim_header) + alignment -
+                        1) & ~(uintptr_t)(alignment - 1);
+      shim_header *header = shim_header_of((void *)user);
+      header->mark = shim_offset_mark;
+      header->base = entry;
+      return (void *)user;
+    }
+  }
+
+  return shim_map(size, alignment);
+}
+
+MALLOC_EXPORT void *malloc(size_t size) { return shim_malloc(size); }
+
+MALLOC_EXPORT void free(void *ptr) { shim_free(ptr); }
+
+MALLOC_EXPORT void *calloc(size_t elem_count, size_t elem_size) {
+  size_t size = 0;
+  if (__builtin_mul_overflow(elem_count, elem_size, &size)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  void *result = shim_malloc(size);
+  // The fresh mappings are zeroed already.
+  if (result && shim_header_of(result)->mark != shim_mapped_mark) {
+    memset(result, 0, size);
+  }
+
+  return result;
+}
+
+MALLOC_EXPORT size_t malloc_usable_size(void *ptr) {
+  if (!ptr) {
+    return 0;
+  }
+
+  shim_header *header = shim_header_of(ptr);
+  if (header->mark == shim_mapped_mark) {
+    return shim_mapped_usable_size(ptr);
+  }
+  if (header->mark == shim_offset_mark) {
+    return r_mempool_usable_size(header->base) -
+           ((uintptr_t)ptr - (uintptr_t)header->base);
+  }
+
+  return r_mempool_usable_size(ptr);
+}
+
+MALLOC_EXPORT void *realloc(void *ptr, size_t size) {
+  if (!ptr) {
+    return shim_malloc(size);
+  }
+  if (size == 0) {
+    shim_free(ptr);
+    return NULL;
+  }
+
+  shim_header *header = shim_header_of(ptr);
+  void *result = NULL;
+
+  if (header->mark == shim_mapped_mark) {
+    if (size <= shim_mapped_usable_size(ptr) &&
+        size > shim_mapped_usable_size(ptr) / 2) {
+      return ptr;
+    }
+    // The shim's own mappings keep growing in the page tables instead of
+    // being copied.
+    r_mempool *rmp = shim_pool();
+    if (!rmp || size > rmp->largest_size) {
+      result = shim_remap(ptr, size);
+      if (result) {
+        return result;
+      }
+    }
+  } else if (header->mark != shim_offset_mark) {
+    r_mempool *rmp = shim_pool();
+    if (rmp && size <= UINT32_MAX) {
+      shim_busy = true;
+      result = r_mempool_realloc_entry(rmp, ptr, (uint32_t)size);
+      shim_busy = false;
+      if (result) {
+        return result;
+      }
+    }
+  }
+
+  size_t usable_size = malloc_usable_size(ptr);
+  result = shim_malloc(size);
+  if (result) {
+    memcpy(result, ptr, size < usable_size ? size : usable_size);
+    shim_free(ptr);
+  }
+
+  return result;
+}
+
+MALLOC_EXPORT int posix_memalign(void **memptr, size_t alignment,
+                                 size_t size) {
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+
+  void *result = shim_aligned_alloc(alignment, size);
+  if (!result) {
+    return ENOMEM;
+  }
+
+  *memptr = result;
+  return 0;
+}
+
+MALLOC_EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return shim_aligned_alloc(alignment, size);
+}
+
+MALLOC_EXPORT void *memalign(size_t alignment, size_t size) {
+  // Like glibc, round the invalid alignments up to a power of two.
+  if (alignment > SIZE_MAX / 2 + 1) {
+    errno = EINVAL;
+    return NULL;
+  }
+  while ((alignment & (alignment - 1)) != 0) {
+    alignment = (alignment | (alignment - 1)) + 1;
+  }
+
+  return shim_aligned_alloc(alignment, size);
+}
+
+MALLOC_EXPORT void *valloc(size_t size) {
+  return shim_aligned_alloc(shim_page_size(), size);
+}
+
+MALLOC_EXPORT void *pvalloc(size_t size) {
+  size_t page_size = shim_page_size();
+
+  if (size > SIZE_MAX - page_size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size = size ? (size + page_size - 1) & ~(page_size - 1) : page_size;
+  return shim_aligned_alloc(page_size, size);
+}
@@ -1,8 +1,13 @@
 #include <cmempool.h>
+#include <malloc.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <tau/tau.h>
+#include <unistd.h>
 TAU_MAIN()  // sets up Tau (+ main function)
 
 // C_MEMPOOL TESTS
@@ -516,159 +521,2668 @@ TEST(cmempools, preallocated_buffer_with_fallback_no_locks) {
   REQUIRE_EQ((void*)mp, NULL);
 }
 
+// Thread cache (magazine) tests
+TEST(cmempools, create_with_config_fails) {
+  mempool_config config = {.thread_cache_size =
+                               MEMPOOL_MAX_THREAD_CACHE_SIZE + 1};
+  mempool* mp = mempool_create_with_config(256, sizeof(int), &config);
+  REQUIRE_EQ((void*)mp, NULL);
+
+  mp = mempool_create_with_config(256, sizeof(int), NULL);
+  REQUIRE_EQ((void*)mp, NULL);
+
+  config.thread_cache_size = 0;
+  config.lock_policy = __lock_policy_end_place_holder;
+  mp = mempool_create_with_config(256, sizeof(int), &config);
+  REQUIRE_EQ((void*)mp, NULL);
+
+  config.lock_policy = -1;
+  mp = mempool_create_with_config(256, sizeof(int), &config);
+  REQUIRE_EQ((void*)mp, NULL);
+}
+
+TEST(cmempools, thread_cache_allocations_and_deallocations) {
+  mempool_config config = {.thread_cache_size = 16};
+  mempool* mp = mempool_create_with_config(256, sizeof(int), &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+  REQUIRE_EQ(mempool_cached_count(mp), 0);
+
+  int* ptrs[256] = {0};
+
+  // The first allocation refills the magazine with half of its size.
+  ptrs[0] = mempool_alloc_entry(mp);
+  REQUIRE_NE((void*)ptrs[0], NULL);
+  REQUIRE_EQ(mempool_used_count(mp), 1);
+  REQUIRE_EQ(mempool_cached_count(mp), 7);
+
+  for (uint32_t i = 1; i < 256; ++i) {
+    ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)ptrs[i], NULL);
+    *ptrs[i] = i;
+    REQUIRE_EQ(mempool_used_count(mp), i + 1);
+  }
+  REQUIRE_EQ(mempool_cached_count(mp), 0);
+  REQUIRE_EQ((void*)mempool_alloc_entry(mp), NULL);
+
+  // The releases go to the magazine, which gets drained by half
+  // whenever it's full.
+  for (uint32_t i = 0; i < 256; ++i) {
+    mempool_free_entry(ptrs[i]);
+    REQUIRE_EQ(mempool_used_count(mp), 256 - (i + 1));
+    REQUIRE(mempool_cached_count(mp) <= 16);
+  }
+  REQUIRE_EQ(mempool_cached_count(mp), 16);
+  REQUIRE_EQ(mempool_total_capacity(mp), 256);
+
+  mempool_destroy(mp);
+  REQUIRE_EQ((void*)mp, NULL);
+}
+
+TEST(cmempools, thread_cache_with_fallback) {
+  mempool_config config = {.fallback_to_dynamic_memory = true,
+                           .thread_cache_size = 8};
+  mempool* mp = mempool_create_with_config(32, sizeof(int), &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  int* ptrs[33] = {0};
+  for (uint32_t i = 0; i < 33; ++i) {
+    ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)ptrs[i], NULL);
+  }
+  REQUIRE_EQ(mempool_used_count(mp), 32);
+  REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 1);
+
+  for (uint32_t i = 0; i < 33; ++i) {
+    mempool_free_entry(ptrs[i]);
+  }
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+  REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+#define THREAD_CACHE_TEST_THREADS 8
+#define THREAD_CACHE_TEST_ROUNDS 2000
+
+static void* thread_cache_worker(void* arg) {
+  mempool* mp = (mempool*)arg;
+  void* ptrs[32];
+
+  for (uint32_t round = 0; round < THREAD_CACHE_TEST_ROUNDS; ++round) {
+    uint32_t count = 1 + round % 32;
+    for (uint32_t i = 0; i < count; ++i) {
+      ptrs[i] = mempool_alloc_entry(mp);
+      if (!ptrs[i]) {
+        return (void*)1;
+      }
+      memset(ptrs[i], (int)i, 64);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+      mempool_free_entry(ptrs[i]);
+    }
+  }
+
+  return NULL;
+}
+
+TEST(cmempools, thread_cache_multiple_threads) {
+  mempool_config config = {.thread_cache_size = 32};
+  mempool* mp = mempool_create_with_config(
+      THREAD_CACHE_TEST_THREADS * (32 + 32), 64, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  pthread_t threads[THREAD_CACHE_TEST_THREADS];
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, thread_cache_worker, mp), 0);
+  }
+
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    void* ret = NULL;
+    pthread_join(threads[i], &ret);
+    REQUIRE_EQ(ret, NULL);
+  }
+
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+  REQUIRE(mempool_cached_count(mp) <= THREAD_CACHE_TEST_THREADS * 32);
+  REQUIRE_EQ(mempool_total_capacity(mp), THREAD_CACHE_TEST_THREADS * 64);
+
+  mempool_destroy(mp);
+}
+
+// Lock-free mempool tests
+TEST(cmempools, lock_free_allocations_and_deallocations) {
+  mempool_config config = {.fallback_to_dynamic_memory = true,
+                           .lock_policy = lock_policy_lock_free};
+  mempool* mp = mempool_create_with_config(256, sizeof(int), &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  int* ptrs[256] = {0};
+
+  for (uint32_t round = 0; round < 2; ++round) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      ptrs[i] = mempool_alloc_entry(mp);
+      REQUIRE_NE((void*)ptrs[i], NULL);
+      *ptrs[i] = i;
+      REQUIRE_EQ(mempool_used_count(mp), i + 1);
+    }
+
+    int* tmp_ptr = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)tmp_ptr, NULL);
+    REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 1);
+    mempool_free_entry(tmp_ptr);
+    REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 0);
+
+    for (uint32_t i = 0; i < 256; ++i) {
+      REQUIRE_EQ(*ptrs[i], (int)i);
+      mempool_free_entry(ptrs[i]);
+      REQUIRE_EQ(mempool_used_count(mp), 256 - (i + 1));
+    }
+  }
+
+  mempool_destroy(mp);
+  REQUIRE_EQ((void*)mp, NULL);
+}
+
+TEST(cmempools, lock_free_multiple_threads) {
+  mempool_config config = {.lock_policy = lock_policy_lock_free};
+  mempool* mp = mempool_create_with_config(THREAD_CACHE_TEST_THREADS * 32, 64,
+                                           &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  pthread_t threads[THREAD_CACHE_TEST_THREADS];
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, thread_cache_worker, mp), 0);
+  }
+
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    void* ret = NULL;
+    pthread_join(threads[i], &ret);
+    REQUIRE_EQ(ret, NULL);
+  }
+
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, lock_free_with_thread_cache_multiple_threads) {
+  mempool_config config = {.thread_cache_size = 32,
+                           .lock_policy = lock_policy_lock_free};
+  mempool* mp = mempool_create_with_config(
+      THREAD_CACHE_TEST_THREADS * (32 + 32), 64, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  pthread_t threads[THREAD_CACHE_TEST_THREADS];
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, thread_cache_worker, mp), 0);
+  }
+
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    void* ret = NULL;
+    pthread_join(threads[i], &ret);
+    REQUIRE_EQ(ret, NULL);
+  }
+
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+// Lock policy tests
+TEST(cmempools, lock_policies_multiple_threads) {
+  for (mempool_lock_policy_t policy = lock_policy_rwlock;
+       policy < __lock_policy_end_place_holder; ++policy) {
+    if (policy == lock_policy_none) {
+      continue;
+    }
+
+    mempool_config config = {.lock_policy = policy};
+    mempool* mp = mempool_create_with_config(THREAD_CACHE_TEST_THREADS * 32,
+                                             64, &config);
+    REQUIRE_NE((void*)mp, NULL);
+
+    pthread_t threads[THREAD_CACHE_TEST_THREADS];
+    for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+      REQUIRE_EQ(pthread_create(&threads[i], NULL, thread_cache_worker, mp),
+                 0);
+    }
+
+    for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+      void* ret = NULL;
+      pthread_join(threads[i], &ret);
+      REQUIRE_EQ(ret, NULL);
+    }
+
+    REQUIRE_EQ(mempool_used_count(mp), 0);
+    REQUIRE_EQ(mempool_total_capacity(mp), THREAD_CACHE_TEST_THREADS * 32);
+
+    mempool_destroy(mp);
+  }
+}
+
+// Lazily initialized mempool tests
+TEST(cmempools, lazy_init_allocations_and_deallocations) {
+  for (mempool_lock_policy_t policy = lock_policy_rwlock;
+       policy < __lock_policy_end_place_holder; ++policy) {
+    mempool_config config = {.lock_policy = policy, .lazy_init = true};
+    mempool* mp = mempool_create_with_config(256, sizeof(int), &config);
+    REQUIRE_NE((void*)mp, NULL);
+
+    REQUIRE_EQ(mempool_used_count(mp), 0);
+    REQUIRE_EQ(mempool_total_capacity(mp), 256);
+
+    int* ptrs[256] = {0};
+
+    // The untouched entries are handed out in address order.
+    for (uint32_t i = 0; i < 256; ++i) {
+      ptrs[i] = mempool_alloc_entry(mp);
+      REQUIRE_NE((void*)ptrs[i], NULL);
+      if (i > 0) {
+        REQUIRE_LT((uintptr_t)ptrs[i - 1], (uintptr_t)ptrs[i]);
+      }
+      *ptrs[i] = i;
+      REQUIRE_EQ(mempool_used_count(mp), i + 1);
+    }
+    REQUIRE_EQ((void*)mempool_alloc_entry(mp), NULL);
+
+    // Release half of them and reuse those.
+    for (uint32_t i = 0; i < 256; i += 2) {
+      mempool_free_entry(ptrs[i]);
+    }
+    REQUIRE_EQ(mempool_used_count(mp), 128);
+    for (uint32_t i = 0; i < 256; i += 2) {
+      ptrs[i] = mempool_alloc_entry(mp);
+      REQUIRE_NE((void*)ptrs[i], NULL);
+      *ptrs[i] = i;
+    }
+    REQUIRE_EQ((void*)mempool_alloc_entry(mp), NULL);
+
+    for (uint32_t i = 0; i < 256; ++i) {
+      REQUIRE_EQ(*ptrs[i], (int)i);
+      mempool_free_entry(ptrs[i]);
+    }
+    REQUIRE_EQ(mempool_used_count(mp), 0);
+
+    mempool_destroy(mp);
+  }
+}
+
+TEST(cmempools, lazy_init_with_thread_cache) {
+  mempool_config config = {.thread_cache_size = 16, .lazy_init = true};
+  mempool* mp = mempool_create_with_config(100, sizeof(int), &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  int* ptrs[100] = {0};
+  for (uint32_t i = 0; i < 100; ++i) {
+    ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)ptrs[i], NULL);
+  }
+  REQUIRE_EQ((void*)mempool_alloc_entry(mp), NULL);
+  REQUIRE_EQ(mempool_used_count(mp), 100);
+
+  for (uint32_t i = 0; i < 100; ++i) {
+    mempool_free_entry(ptrs[i]);
+  }
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, lazy_init_preallocated_buffer) {
+  mempool_config config = {.lazy_init = true};
+  mempool* mp = mempool_create_from_preallocated_buffer_with_config(
+      preallocated_mp_buffer, sizeof(preallocated_mp_buffer), 256, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  uint32_t capacity = mempool_total_capacity(mp);
+  REQUIRE_EQ(capacity, 32768);
+
+  for (uint32_t i = 0; i < capacity; ++i) {
+    preallocated_ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)preallocated_ptrs[i], NULL);
+  }
+  REQUIRE_EQ(mempool_alloc_entry(mp), NULL);
+
+  for (uint32_t i = 0; i < capacity; ++i) {
+    mempool_free_entry(preallocated_ptrs[i]);
+  }
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+// Bulk allocation tests
+TEST(cmempools, bulk_allocations_and_deallocations) {
+  for (mempool_lock_policy_t policy = lock_policy_rwlock;
+       policy < __lock_policy_end_place_holder; ++policy) {
+    for (uint32_t thread_cache_size = 0; thread_cache_size <= 8;
+         thread_cache_size += 8) {
+      mempool_config config = {.fallback_to_dynamic_memory = true,
+                               .lock_policy = policy,
+                               .thread_cache_size = thread_cache_size};
+      mempool* mp = mempool_create_with_config(100, sizeof(int), &config);
+      REQUIRE_NE((void*)mp, NULL);
+
+      void* ptrs[128] = {0};
+
+      REQUIRE_EQ(mempool_alloc_bulk(mp, ptrs, 64), 64);
+      REQUIRE_EQ(mempool_used_count(mp), 64);
+      // 36 from the pool, 28 from the fallback.
+      REQUIRE_EQ(mempool_alloc_bulk(mp, &ptrs[64], 64), 64);
+      REQUIRE_EQ(mempool_used_count(mp), 100);
+      REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 28);
+
+      for (uint32_t i = 0; i < 128; ++i) {
+        REQUIRE_NE(ptrs[i], NULL);
+        memset(ptrs[i], 0xab, sizeof(int));
+      }
+
+      mempool_free_bulk(ptrs, 128);
+      for (uint32_t i = 0; i < 128; ++i) {
+        REQUIRE_EQ(ptrs[i], NULL);
+      }
+      REQUIRE_EQ(mempool_used_count(mp), 0);
+      REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 0);
+
+      mempool_destroy(mp);
+    }
+  }
+}
+
+TEST(cmempools, bulk_allocations_without_fallback) {
+  mempool* mp = mempool_create(100, sizeof(int), false, false);
+  REQUIRE_NE((void*)mp, NULL);
+
+  void* ptrs[128] = {0};
+  REQUIRE_EQ(mempool_alloc_bulk(mp, ptrs, 128), 100);
+  REQUIRE_EQ(ptrs[100], NULL);
+  REQUIRE_EQ(mempool_alloc_bulk(mp, &ptrs[100], 28), 0);
+  REQUIRE_EQ(mempool_used_count(mp), 100);
+
+  // Releasing a few entries individually leaves NULL gaps behind.
+  mempool_free_entry(ptrs[3]);
+  mempool_free_entry(ptrs[50]);
+  mempool_free_bulk(ptrs, 128);
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, bulk_free_with_mixed_pools) {
+  mempool* mp_a = mempool_create(64, 32, false, false);
+  mempool_config config = {.lock_policy = lock_policy_lock_free};
+  mempool* mp_b = mempool_create_with_config(64, 32, &config);
+  REQUIRE_NE((void*)mp_a, NULL);
+  REQUIRE_NE((void*)mp_b, NULL);
+
+  void* ptrs[128] = {0};
+  for (uint32_t i = 0; i < 128; ++i) {
+    ptrs[i] = mempool_alloc_entry(i % 2 ? mp_a : mp_b);
+    REQUIRE_NE(ptrs[i], NULL);
+  }
+  REQUIRE_EQ(mempool_used_count(mp_a), 64);
+  REQUIRE_EQ(mempool_used_count(mp_b), 64);
+
+  mempool_free_bulk(ptrs, 128);
+  REQUIRE_EQ(mempool_used_count(mp_a), 0);
+  REQUIRE_EQ(mempool_used_count(mp_b), 0);
+
+  mempool_destroy(mp_a);
+  mempool_destroy(mp_b);
+}
+
+TEST(cmempools, sharded_bulk_allocations) {
+  mempool_config config = {0};
+  mempool* mp = mempool_create_sharded(64, 32, 4, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  void* ptrs[80] = {0};
+  REQUIRE_EQ(mempool_alloc_bulk(mp, ptrs, 80), 64);
+  REQUIRE_EQ(mempool_used_count(mp), 64);
+  mempool_free_bulk(ptrs, 80);
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+// Sharded mempool tests
+TEST(cmempools, sharded_create_fails) {
+  mempool_config config = {0};
+  REQUIRE_EQ((void*)mempool_create_sharded(0, 64, 4, &config), NULL);
+  REQUIRE_EQ((void*)mempool_create_sharded(256, 0, 4, &config), NULL);
+  REQUIRE_EQ((void*)mempool_create_sharded(3, 64, 4, &config), NULL);
+  REQUIRE_EQ((void*)mempool_create_sharded(256, 64, 4, NULL), NULL);
+}
+
+TEST(cmempools, sharded_allocations_and_deallocations) {
+  mempool_config config = {.fallback_to_dynamic_memory = true};
+  // 257 elements over 4 shards, the first shard gets 65 of them.
+  mempool* mp = mempool_create_sharded(257, sizeof(int), 4, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  REQUIRE_EQ(mempool_total_capacity(mp), 257);
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  int* ptrs[257] = {0};
+
+  for (uint32_t round = 0; round < 2; ++round) {
+    // The allocations steal from the other shards once the home
+    // shard is exhausted.
+    for (uint32_t i = 0; i < 257; ++i) {
+      ptrs[i] = mempool_alloc_entry(mp);
+      REQUIRE_NE((void*)ptrs[i], NULL);
+      *ptrs[i] = i;
+      REQUIRE_EQ(mempool_used_count(mp), i + 1);
+    }
+
+    int* tmp_ptr = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)tmp_ptr, NULL);
+    REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 1);
+    REQUIRE_EQ(mempool_used_count(mp), 257);
+    mempool_free_entry(tmp_ptr);
+    REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 0);
+
+    for (uint32_t i = 0; i < 257; ++i) {
+      REQUIRE_EQ(*ptrs[i], (int)i);
+      mempool_free_entry(ptrs[i]);
+      REQUIRE_EQ(mempool_used_count(mp), 257 - (i + 1));
+    }
+  }
+
+  mempool_destroy(mp);
+  REQUIRE_EQ((void*)mp, NULL);
+}
+
+TEST(cmempools, sharded_multiple_threads) {
+  mempool_config config = {.lock_policy = lock_policy_adaptive_mutex};
+  mempool* mp = mempool_create_sharded(THREAD_CACHE_TEST_THREADS * 32, 64, 0,
+                                       &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  pthread_t threads[THREAD_CACHE_TEST_THREADS];
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, thread_cache_worker, mp), 0);
+  }
+
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    void* ret = NULL;
+    pthread_join(threads[i], &ret);
+    REQUIRE_EQ(ret, NULL);
+  }
+
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+  REQUIRE_EQ(mempool_total_capacity(mp), THREAD_CACHE_TEST_THREADS * 32);
+
+  mempool_destroy(mp);
+}
+
+// Growing mempool tests
+TEST(cmempools, growing_create_fails) {
+  mempool_config config = {.lock_policy = lock_policy_lock_free,
+                           .max_elem_count = 1024};
+  REQUIRE_EQ((void*)mempool_create_with_config(16, 64, &config), NULL);
+  REQUIRE_EQ((void*)mempool_create_sharded(16, 64, 4, &config), NULL);
+
+  // Not greater than the element count, no growth at all.
+  config.max_elem_count = 16;
+  mempool* mp = mempool_create_with_config(16, 64, &config);
+  REQUIRE_NE((void*)mp, NULL);
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, growing_allocations_and_deallocations) {
+  for (mempool_lock_policy_t policy = lock_policy_rwlock;
+       policy < lock_policy_lock_free; ++policy) {
+    for (uint32_t thread_cache_size = 0; thread_cache_size <= 8;
+         thread_cache_size += 8) {
+      mempool_config config = {.lock_policy = policy,
+                               .thread_cache_size = thread_cache_size,
+                               .lazy_init = thread_cache_size > 0,
+                               .max_elem_count = 100};
+      mempool* mp = mempool_create_with_config(10, sizeof(int), &config);
+      REQUIRE_NE((void*)mp, NULL);
+      REQUIRE_EQ(mempool_total_capacity(mp), 10);
+
+      int* ptrs[100] = {0};
+
+      // The capacity goes 10, 20, 40, 80 and finally 100.
+      for (uint32_t i = 0; i < 100; ++i) {
+        ptrs[i] = mempool_alloc_entry(mp);
+        REQUIRE_NE((void*)ptrs[i], NULL);
+        *ptrs[i] = i;
+        REQUIRE_EQ(mempool_used_count(mp), i + 1);
+      }
+      REQUIRE_EQ(mempool_total_capacity(mp), 100);
+      REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 0);
+      REQUIRE_EQ((void*)mempool_alloc_entry(mp), NULL);
+
+      for (uint32_t i = 0; i < 100; ++i) {
+        REQUIRE_EQ(*ptrs[i], (int)i);
+        mempool_free_entry(ptrs[i]);
+      }
+      REQUIRE_EQ(mempool_used_count(mp), 0);
+
+      // Everything fits without any further growth now.
+      REQUIRE_EQ(mempool_alloc_bulk(mp, (void**)ptrs, 100), 100);
+      REQUIRE_EQ(mempool_total_capacity(mp), 100);
+      mempool_free_bulk((void**)ptrs, 100);
+      REQUIRE_EQ(mempool_used_count(mp), 0);
+
+      mempool_destroy(mp);
+    }
+  }
+}
+
+TEST(cmempools, growing_with_fallback) {
+  mempool_config config = {.fallback_to_dynamic_memory = true,
+                           .max_elem_count = 48};
+  mempool* mp = mempool_create_with_config(16, sizeof(int), &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  int* ptrs[64] = {0};
+  for (uint32_t i = 0; i < 64; ++i) {
+    ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)ptrs[i], NULL);
+  }
+  // 16 + 16 + 16 from the slabs, the rest from the fallback.
+  REQUIRE_EQ(mempool_total_capacity(mp), 48);
+  REQUIRE_EQ(mempool_used_count(mp), 48);
+  REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 16);
+
+  for (uint32_t i = 0; i < 64; ++i) {
+    mempool_free_entry(ptrs[i]);
+  }
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+  REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, growing_preallocated_buffer) {
+  static uint8_t buffer[8 * (32 + 16)];
+  mempool_config config = {.max_elem_count = 64};
+  mempool* mp = mempool_create_from_preallocated_buffer_with_config(
+      buffer, sizeof(buffer), 32, &config);
+  REQUIRE_NE((void*)mp, NULL);
+  REQUIRE_EQ(mempool_total_capacity(mp), 8);
+
+  void* ptrs[64] = {0};
+  REQUIRE_EQ(mempool_alloc_bulk(mp, ptrs, 64), 64);
+  REQUIRE_EQ(mempool_total_capacity(mp), 64);
+  mempool_free_bulk(ptrs, 64);
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, growing_multiple_threads) {
+  for (uint32_t thread_cache_size = 0; thread_cache_size <= 32;
+       thread_cache_size += 32) {
+    mempool_config config = {
+        .thread_cache_size = thread_cache_size,
+        .max_elem_count = THREAD_CACHE_TEST_THREADS * (32 + 32)};
+    mempool* mp = mempool_create_with_config(4, 64, &config);
+    REQUIRE_NE((void*)mp, NULL);
+
+    pthread_t threads[THREAD_CACHE_TEST_THREADS];
+    for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+      REQUIRE_EQ(pthread_create(&threads[i], NULL, thread_cache_worker, mp),
+                 0);
+    }
+
+    for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+      void* ret = NULL;
+      pthread_join(threads[i], &ret);
+      REQUIRE_EQ(ret, NULL);
+    }
+
+    REQUIRE_EQ(mempool_used_count(mp), 0);
+    REQUIRE_LT(mempool_total_capacity(mp),
+               THREAD_CACHE_TEST_THREADS * (32 + 32) + 1);
+
+    mempool_destroy(mp);
+  }
+}
+
+TEST(cmempools, growing_sharded) {
+  mempool_config config = {.max_elem_count = 256};
+  mempool* mp = mempool_create_sharded(16, sizeof(int), 4, &config);
+  REQUIRE_NE((void*)mp, NULL);
+  REQUIRE_EQ(mempool_total_capacity(mp), 16);
+
+  void* ptrs[256] = {0};
+  REQUIRE_EQ(mempool_alloc_bulk(mp, ptrs, 256), 256);
+  REQUIRE_EQ(mempool_total_capacity(mp), 256);
+  REQUIRE_EQ((void*)mempool_alloc_entry(mp), NULL);
+  mempool_free_bulk(ptrs, 256);
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+// Aligned mempool tests
+TEST(cmempools, aligned_create_fails) {
+  uint32_t alignments[] = {1, 4, 24, 100, MEMPOOL_MAX_ALIGNMENT * 2};
+  for (uint32_t i = 0; i < sizeof(alignments) / sizeof(alignments[0]); ++i) {
+    mempool_config config = {.alignment = alignments[i]};
+    REQUIRE_EQ((void*)mempool_create_with_config(16, 64, &config), NULL);
+    REQUIRE_EQ((void*)mempool_create_sharded(16, 64, 4, &config), NULL);
+    REQUIRE_EQ((void*)mempool_create_from_preallocated_buffer_with_config(
+                   preallocated_mp_buffer, sizeof(preallocated_mp_buffer), 64,
+                   &config),
+               NULL);
+    REQUIRE_EQ((void*)r_mempool_create_aligned(4, 8, 8, fallback_disabled,
+                                               false, alignments[i]),
+               NULL);
+  }
+
+  // The buffer can't hold a single aligned entry.
+  mempool_config config = {.alignment = MEMPOOL_MAX_ALIGNMENT};
+  REQUIRE_EQ((void*)mempool_create_from_preallocated_buffer_with_config(
+                 preallocated_mp_buffer, MEMPOOL_MAX_ALIGNMENT, 64, &config),
+             NULL);
+}
+
+TEST(cmempools, aligned_allocations) {
+  uint32_t alignments[] = {8, 16, 32, 64, 4096};
+  for (uint32_t i = 0; i < sizeof(alignments) / sizeof(alignments[0]); ++i) {
+    for (mempool_lock_policy_t policy = lock_policy_rwlock;
+         policy < __lock_policy_end_place_holder; ++policy) {
+      mempool_config config = {.fallback_to_dynamic_memory = true,
+                               .lock_policy = policy,
+                               .alignment = alignments[i]};
+      if (policy != lock_policy_lock_free) {
+        config.max_elem_count = 32;
+      }
+      mempool* mp = mempool_create_with_config(8, 24, &config);
+      REQUIRE_NE((void*)mp, NULL);
+
+      // The initial buffer, the slabs and the fallback.
+      void* ptrs[48] = {0};
+      for (uint32_t j = 0; j < 48; ++j) {
+        ptrs[j] = mempool_calloc_entry(mp);
+        REQUIRE_NE(ptrs[j], NULL);
+        REQUIRE_EQ((uintptr_t)ptrs[j] % alignments[i], 0);
+        memset(ptrs[j], 0xab, 24);
+      }
+      REQUIRE_NE(mempool_dynamic_allocs_count(mp), 0);
+
+      for (uint32_t j = 0; j < 48; ++j) {
+        mempool_free_entry(ptrs[j]);
+      }
+      REQUIRE_EQ(mempool_used_count(mp), 0);
+      REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 0);
+
+      mempool_destroy(mp);
+    }
+  }
+}
+
+TEST(cmempools, aligned_preallocated_buffer) {
+  mempool_config config = {.alignment = 64};
+  // An unaligned start, the pool should skip up to the next boundary.
+  uint8_t* buffer = (uint8_t*)preallocated_mp_buffer;
+  buffer += 64 - (uintptr_t)buffer % 64 + 8;
+  mempool* mp = mempool_create_from_preallocated_buffer_with_config(
+      buffer, 64 * 16, 32, &config);
+  REQUIRE_NE((void*)mp, NULL);
+  // 56 bytes skipped up to the boundary, and 48 more for the first
+  // header, leaving room for 14 entries of 64 bytes.
+  REQUIRE_EQ(mempool_total_capacity(mp), 14);
+
+  for (uint32_t i = 0; i < 14; ++i) {
+    preallocated_ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)preallocated_ptrs[i], NULL);
+    REQUIRE_EQ((uintptr_t)preallocated_ptrs[i] % 64, 0);
+  }
+  REQUIRE_EQ(mempool_alloc_entry(mp), NULL);
+
+  for (uint32_t i = 0; i < 14; ++i) {
+    mempool_free_entry(preallocated_ptrs[i]);
+  }
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, aligned_sharded) {
+  mempool_config config = {.fallback_to_dynamic_memory = true,
+                           .alignment = 32};
+  mempool* mp = mempool_create_sharded(64, 40, 4, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  void* ptrs[80] = {0};
+  REQUIRE_EQ(mempool_alloc_bulk(mp, ptrs, 80), 80);
+  for (uint32_t i = 0; i < 80; ++i) {
+    REQUIRE_EQ((uintptr_t)ptrs[i] % 32, 0);
+  }
+  REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 16);
+  mempool_free_bulk(ptrs, 80);
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+  REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+// Headerless mempool tests
+TEST(cmempools, headerless_create_fails) {
+  mempool_config config = {.headerless = true,
+                           .lock_policy = lock_policy_lock_free};
+  REQUIRE_EQ((void*)mempool_create_with_config(16, 16, &config), NULL);
+
+  config.lock_policy = lock_policy_rwlock;
+  config.thread_cache_size = 8;
+  REQUIRE_EQ((void*)mempool_create_with_config(16, 16, &config), NULL);
+
+  config.thread_cache_size = 0;
+  config.lazy_init = true;
+  REQUIRE_EQ((void*)mempool_create_with_config(16, 16, &config), NULL);
+
+  config.lazy_init = false;
+  config.max_elem_count = 32;
+  REQUIRE_EQ((void*)mempool_create_with_config(16, 16, &config), NULL);
+
+  config.max_elem_count = 0;
+  REQUIRE_EQ((void*)mempool_create_sharded(16, 16, 4, &config), NULL);
+  REQUIRE_EQ((void*)mempool_create_from_preallocated_buffer_with_config(
+                 preallocated_mp_buffer, sizeof(preallocated_mp_buffer), 16,
+                 &config),
+             NULL);
+
+  // Doesn't fit into a slab.
+  REQUIRE_EQ((void*)mempool_create_with_config(1, 4 * 1024 * 1024, &config),
+             NULL);
+}
+
+TEST(cmempools, headerless_allocations_and_deallocations) {
+  for (mempool_lock_policy_t policy = lock_policy_rwlock;
+       policy < lock_policy_lock_free; ++policy) {
+    mempool_config config = {.lock_policy = policy, .headerless = true};
+    mempool* mp = mempool_create_with_config(256, 16, &config);
+    REQUIRE_NE((void*)mp, NULL);
+    REQUIRE_EQ(mempool_total_capacity(mp), 256);
+
+    uint8_t* ptrs[256] = {0};
+    for (uint32_t i = 0; i < 256; ++i) {
+      ptrs[i] = mempool_calloc_entry(mp);
+      REQUIRE_NE((void*)ptrs[i], NULL);
+      // The entries are packed without any headers in between.
+      if (i > 0) {
+        REQUIRE_EQ((uintptr_t)ptrs[i] - (uintptr_t)ptrs[i - 1], 16);
+      }
+      memset(ptrs[i], (int)i, 16);
+      REQUIRE_EQ(mempool_used_count(mp), i + 1);
+    }
+    REQUIRE_EQ((void*)mempool_alloc_entry(mp), NULL);
+
+    for (uint32_t i = 0; i < 256; ++i) {
+      REQUIRE_EQ(ptrs[i][0], (uint8_t)i);
+      REQUIRE_EQ(ptrs[i][15], (uint8_t)i);
+      mempool_free_entry(ptrs[i]);
+      REQUIRE_EQ((void*)ptrs[i], NULL);
+    }
+    REQUIRE_EQ(mempool_used_count(mp), 0);
+
+    mempool_destroy(mp);
+  }
+}
+
+TEST(cmempools, headerless_multiple_slabs_with_fallback) {
+  mempool_config config = {.fallback_to_dynamic_memory = true,
+                           .alignment = 64,
+                           .headerless = true};
+  // A slab holds less than 32768 entries of 64 bytes.
+  mempool* mp = mempool_create_with_config(100000, 48, &config);
+  REQUIRE_NE((void*)mp, NULL);
+  REQUIRE_EQ(mempool_total_capacity(mp), 100000);
+
+  static void* ptrs[100100];
+  REQUIRE_EQ(mempool_alloc_bulk(mp, ptrs, 100100), 100100);
+  REQUIRE_EQ(mempool_used_count(mp), 100000);
+  REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 100);
+  for (uint32_t i = 0; i < 100100; ++i) {
+    REQUIRE_EQ((uintptr_t)ptrs[i] % 64, 0);
+  }
+
+  mempool_free_bulk(ptrs, 100100);
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+  REQUIRE_EQ(mempool_dynamic_allocs_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, headerless_mixed_with_other_pools) {
+  mempool_config config = {.headerless = true};
+  mempool* mp_a = mempool_create_with_config(64, 32, &config);
+  mempool* mp_b = mempool_create(64, 32, false, false);
+  r_mempool* rmp = r_mempool_create(4, 6, 7, fallback_disabled, false);
+  REQUIRE_NE((void*)mp_a, NULL);
+  REQUIRE_NE((void*)mp_b, NULL);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  void* ptrs[192] = {0};
+  for (uint32_t i = 0; i < 192; ++i) {
+    if (i % 3 == 0) {
+      ptrs[i] = mempool_alloc_entry(mp_a);
+    } else if (i % 3 == 1) {
+      ptrs[i] = mempool_alloc_entry(mp_b);
+    } else {
+      ptrs[i] = r_mempool_alloc_entry(rmp, 32);
+    }
+    REQUIRE_NE(ptrs[i], NULL);
+  }
+  REQUIRE_EQ(mempool_used_count(mp_a), 64);
+  REQUIRE_EQ(mempool_used_count(mp_b), 64);
+
+  // Individual and bulk releases find the right pools.
+  for (uint32_t i = 0; i < 96; ++i) {
+    if (i % 3 == 2) {
+      r_mempool_free_entry(ptrs[i]);
+    } else {
+      mempool_free_entry(ptrs[i]);
+    }
+  }
+  mempool_free_bulk(ptrs, 192);
+  REQUIRE_EQ(mempool_used_count(mp_a), 0);
+  REQUIRE_EQ(mempool_used_count(mp_b), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+
+  mempool_destroy(mp_a);
+  mempool_destroy(mp_b);
+  r_mempool_destroy(rmp);
+}
+
+// Defined by the library when built for the unit tests.
+uint32_t headerless_registry_used_slot_count(void);
+bool headerless_registry_add_base(uintptr_t base);
+void headerless_registry_remove_base(uintptr_t base);
+
+TEST(cmempools, headerless_create_destroy_cycles) {
+  mempool_config config = {.headerless = true};
+  uint32_t used_slot_count = headerless_registry_used_slot_count();
+  mempool* long_lived = mempool_create_with_config(64, 32, &config);
+  REQUIRE_NE((void*)long_lived, NULL);
+
+  // The pools going away don't leave their registry slots behind, even
+  // when enough of them come and go for the slots to form clusters, so
+  // the lookups of every release stay short.
+  static mempool* mps[256];
+  for (uint32_t cycle = 0; cycle < 32; ++cycle) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      mps[i] = mempool_create_with_config(64, 32, &config);
+      REQUIRE_NE((void*)mps[i], NULL);
+      void* ptr = mempool_alloc_entry(mps[i]);
+      REQUIRE_NE(ptr, NULL);
+      mempool_free_entry(ptr);
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      mempool_destroy(mps[(i * 97 + cycle) % 256]);
+    }
+    REQUIRE_LE(headerless_registry_used_slot_count(), used_slot_count + 4);
+  }
+
+  void* ptr = mempool_alloc_entry(long_lived);
+  REQUIRE_NE(ptr, NULL);
+  mempool_free_entry(ptr);
+  REQUIRE_EQ(mempool_used_count(long_lived), 0);
+
+  mempool_destroy(long_lived);
+  REQUIRE_EQ(headerless_registry_used_slot_count(), used_slot_count);
+
+  // Made up slabs, far above the user space addresses, fill a quarter
+  // of the registry, so that the removals happen within clusters.
+  uintptr_t fake_base = (uintptr_t)0xffff800000000000ull;
+  uint32_t state = 0x2545f491;
+  for (uint32_t cycle = 0; cycle < 8; ++cycle) {
+    static uintptr_t bases[2048];
+    for (uint32_t i = 0; i < 2048; ++i) {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      bases[i] = fake_base + (uintptr_t)(state % (1 << 20)) * (2 << 20);
+      REQUIRE_TRUE(headerless_registry_add_base(bases[i]));
+    }
+    for (uint32_t i = 0; i < 2048; ++i) {
+      headerless_registry_remove_base(bases[(i * 1021 + cycle) % 2048]);
+    }
+    REQUIRE_EQ(headerless_registry_used_slot_count(), used_slot_count);
+  }
+}
+
+TEST(cmempools, headerless_multiple_threads) {
+  mempool_config config = {.lock_policy = lock_policy_ticket_spinlock,
+                           .headerless = true};
+  mempool* mp =
+      mempool_create_with_config(THREAD_CACHE_TEST_THREADS * 32, 64, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  pthread_t threads[THREAD_CACHE_TEST_THREADS];
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, thread_cache_worker, mp), 0);
+  }
+
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    void* ret = NULL;
+    pthread_join(threads[i], &ret);
+    REQUIRE_EQ(ret, NULL);
+  }
+
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, page_backing_create_fails) {
+  mempool_config config = {.page_backing = __page_backing_end_place_holder};
+  REQUIRE_EQ((void*)mempool_create_with_config(16, 16, &config), NULL);
+  REQUIRE_EQ((void*)mempool_create_sharded(16, 16, 4, &config), NULL);
+
+  config.page_backing = page_backing_regular_pages;
+  REQUIRE_EQ((void*)mempool_create_from_preallocated_buffer_with_config(
+                 preallocated_mp_buffer, sizeof(preallocated_mp_buffer), 16,
+                 &config),
+             NULL);
+
+  config.headerless = true;
+  REQUIRE_EQ((void*)mempool_create_with_config(16, 16, &config), NULL);
+}
+
+TEST(cmempools, page_backing_allocations_and_deallocations) {
+  mempool_stats stats;
+  mempool* mp = mempool_create(16, 64, false, false);
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.page_backing, page_backing_heap);
+  mempool_destroy(mp);
+
+  // Whatever the kernel can provide, the pool ends up with some
+  // mapping no better than requested.
+  for (mempool_page_backing_t backing = page_backing_regular_pages;
+       backing < __page_backing_end_place_holder; ++backing) {
+    mempool_config config = {.page_backing = backing, .alignment = 64};
+    mp = mempool_create_with_config(1 << 16, 48, &config);
+    REQUIRE_NE((void*)mp, NULL);
+
+    mempool_get_stats(mp, &stats);
+    REQUIRE_GE(stats.page_backing, page_backing_regular_pages);
+    REQUIRE_LE(stats.page_backing, backing);
+    REQUIRE_EQ(stats.total_capacity, 1 << 16);
+
+    void* ptrs[256];
+    for (uint32_t i = 0; i < 256; ++i) {
+      ptrs[i] = mempool_alloc_entry(mp);
+      REQUIRE_NE(ptrs[i], NULL);
+      REQUIRE_EQ((uintptr_t)ptrs[i] % 64, 0);
+      memset(ptrs[i], 0xee, 48);
+    }
+    REQUIRE_EQ(mempool_used_count(mp), 256);
+
+    for (uint32_t i = 0; i < 256; ++i) {
+      mempool_free_entry(ptrs[i]);
+    }
+    REQUIRE_EQ(mempool_used_count(mp), 0);
+
+    mempool_destroy(mp);
+  }
+
+  // The plain mappings never fail over to anything else.
+  mempool_config config = {.page_backing = page_backing_regular_pages};
+  mp = mempool_create_with_config(16, 64, &config);
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.page_backing, page_backing_regular_pages);
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, page_backing_sharded) {
+  mempool_config config = {
+      .page_backing = page_backing_transparent_huge_pages};
+  mempool* mp = mempool_create_sharded(1024, 64, 4, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  mempool_stats stats;
+  mempool_get_stats(mp, &stats);
+  REQUIRE_GE(stats.page_backing, page_backing_regular_pages);
+  REQUIRE_LE(stats.page_backing, page_backing_transparent_huge_pages);
+
+  void* ptr = mempool_alloc_entry(mp);
+  REQUIRE_NE(ptr, NULL);
+  mempool_free_entry(ptr);
+
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, trim) {
+  // The pools allocated from the heap are left as they are.
+  mempool* mp = mempool_create(1024, 64, false, false);
+  void* ptr = mempool_alloc_entry(mp);
+  mempool_free_entry(ptr);
+  REQUIRE_EQ(mempool_trim(mp), 0);
+  mempool_destroy(mp);
+
+  mempool_config config = {.page_backing = page_backing_regular_pages};
+  mp = mempool_create_with_config(4096, 64, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  char* ptrs[4096];
+  for (uint32_t i = 0; i < 4096; ++i) {
+    ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)ptrs[i], NULL);
+    memset(ptrs[i], 't', 64);
+  }
+  REQUIRE_EQ(mempool_trim(mp), 0);
+
+  // Only the pages without any used entries go back.
+  for (uint32_t i = 1; i < 4095; ++i) {
+    mempool_free_entry(ptrs[i]);
+  }
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t trimmed = mempool_trim(mp);
+  REQUIRE_GT(trimmed, 0);
+  REQUIRE_EQ(trimmed % page_size, 0);
+  REQUIRE_LT(trimmed, 4096 * 80);
+  REQUIRE_EQ(mempool_trim(mp), 0);
+
+  mempool_stats stats;
+  mempool_get_stats(mp, &stats);
+  REQUIRE_GT(stats.trimmed_count, 0);
+  REQUIRE_EQ(stats.used_count, 2);
+  REQUIRE_EQ(stats.total_capacity, 4096);
+  REQUIRE_EQ(ptrs[0][63], 't');
+  REQUIRE_EQ(ptrs[4095][0], 't');
+
+  // The trimmed entries are handed out after the rest of the free ones.
+  for (uint32_t i = 1; i < 4095; ++i) {
+    ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)ptrs[i], NULL);
+    memset(ptrs[i], 'u', 64);
+  }
+  REQUIRE_EQ(mempool_alloc_entry(mp), NULL);
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.trimmed_count, 0);
+  REQUIRE_EQ(stats.used_count, 4096);
+
+  for (uint32_t i = 0; i < 4096; ++i) {
+    mempool_free_entry(ptrs[i]);
+  }
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, trim_lazily_initialized_and_sharded) {
+  mempool_config config = {.page_backing = page_backing_regular_pages,
+                           .lazy_init = true,
+                           .alignment = 64};
+  mempool* mp = mempool_create_with_config(1024, 100, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  void* ptrs[1024];
+  for (uint32_t i = 0; i < 512; ++i) {
+    ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE(ptrs[i], NULL);
+  }
+  for (uint32_t i = 0; i < 512; ++i) {
+    mempool_free_entry(ptrs[i]);
+  }
+  REQUIRE_GT(mempool_trim(mp), 0);
+
+  // The untouched entries come before the trimmed ones.
+  for (uint32_t i = 0; i < 1024; ++i) {
+    ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE(ptrs[i], NULL);
+    REQUIRE_EQ((uintptr_t)ptrs[i] % 64, 0);
+    memset(ptrs[i], 0x5a, 100);
+  }
+  REQUIRE_EQ(mempool_alloc_entry(mp), NULL);
+  for (uint32_t i = 0; i < 1024; ++i) {
+    mempool_free_entry(ptrs[i]);
+  }
+  mempool_destroy(mp);
+
+  config.lazy_init = false;
+  mp = mempool_create_sharded(4096, 64, 4, &config);
+  REQUIRE_NE((void*)mp, NULL);
+  ptrs[0] = mempool_alloc_entry(mp);
+  REQUIRE_NE(ptrs[0], NULL);
+  mempool_free_entry(ptrs[0]);
+  REQUIRE_GT(mempool_trim(mp), 0);
+
+  mempool_stats stats;
+  mempool_get_stats(mp, &stats);
+  REQUIRE_GT(stats.trimmed_count, 0);
+  REQUIRE_EQ(stats.used_count, 0);
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, trim_aligned_entries) {
+  // The user bytes of an aligned entry run past the slots the pool
+  // buffer would be split into from its start.
+  mempool_config config = {.page_backing = page_backing_regular_pages,
+                           .alignment = 64};
+  mempool* mp = mempool_create_with_config(128, 112, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  char* ptrs[128];
+  for (uint32_t i = 0; i < 128; ++i) {
+    ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)ptrs[i], NULL);
+    memset(ptrs[i], 'a' + i % 26, 112);
+  }
+  for (uint32_t i = 32; i < 128; ++i) {
+    mempool_free_entry(ptrs[i]);
+  }
+
+  REQUIRE_GT(mempool_trim(mp), 0);
+  for (uint32_t i = 0; i < 32; ++i) {
+    for (uint32_t j = 0; j < 112; ++j) {
+      REQUIRE_EQ(ptrs[i][j], (char)('a' + i % 26));
+    }
+  }
+
+  for (uint32_t i = 0; i < 32; ++i) {
+    mempool_free_entry(ptrs[i]);
+  }
+  mempool_destroy(mp);
+}
+
+#define TRIM_TEST_THREADS 4
+
+static void* trim_worker(void* arg) {
+  mempool* mp = (mempool*)arg;
+  void* ptrs[64];
+
+  for (uint32_t round = 0; round < 200; ++round) {
+    for (uint32_t i = 0; i < 64; ++i) {
+      ptrs[i] = mempool_alloc_entry(mp);
+      if (!ptrs[i]) {
+        return (void*)1;
+      }
+      memset(ptrs[i], (int)i, 64);
+    }
+    for (uint32_t i = 0; i < 64; ++i) {
+      if (((unsigned char*)ptrs[i])[63] != i) {
+        return (void*)1;
+      }
+      mempool_free_entry(ptrs[i]);
+    }
+  }
+
+  return NULL;
+}
+
+TEST(cmempools, trim_multiple_threads) {
+  mempool_config config = {.page_backing = page_backing_regular_pages,
+                           .thread_cache_size = 16};
+  mempool* mp =
+      mempool_create_with_config(TRIM_TEST_THREADS * 128, 64, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  pthread_t threads[TRIM_TEST_THREADS];
+  for (uint32_t i = 0; i < TRIM_TEST_THREADS; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, trim_worker, mp), 0);
+  }
+  for (uint32_t i = 0; i < 100; ++i) {
+    mempool_trim(mp);
+  }
+  for (uint32_t i = 0; i < TRIM_TEST_THREADS; ++i) {
+    void* ret = NULL;
+    pthread_join(threads[i], &ret);
+    REQUIRE_EQ(ret, NULL);
+  }
+
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, stats_snapshot) {
+  mempool_config config = {.fallback_to_dynamic_memory = true,
+                           .thread_cache_size = 8};
+  mempool* mp = mempool_create_with_config(32, sizeof(int), &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  int* ptrs[34] = {0};
+  for (uint32_t i = 0; i < 34; ++i) {
+    ptrs[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE((void*)ptrs[i], NULL);
+  }
+  mempool_free_entry(ptrs[0]);
+
+  mempool_stats stats;
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.total_capacity, 32);
+  REQUIRE_EQ(stats.used_count, 31);
+  REQUIRE_EQ(stats.dynamic_allocs_count, 2);
+  REQUIRE_EQ(stats.cached_count, 1);
+  REQUIRE_EQ(stats.used_count, mempool_used_count(mp));
+  REQUIRE_EQ(stats.cached_count, mempool_cached_count(mp));
+
+  for (uint32_t i = 1; i < 34; ++i) {
+    mempool_free_entry(ptrs[i]);
+  }
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.used_count, 0);
+  REQUIRE_EQ(stats.dynamic_allocs_count, 0);
+  mempool_destroy(mp);
+
+  // The sharded pools sum up the statistics of their shards.
+  config.thread_cache_size = 0;
+  mp = mempool_create_sharded(64, sizeof(int), 4, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  void* entries[65] = {0};
+  REQUIRE_EQ(mempool_alloc_bulk(mp, entries, 65), 65);
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.total_capacity, 64);
+  REQUIRE_EQ(stats.used_count, 64);
+  REQUIRE_EQ(stats.dynamic_allocs_count, 1);
+  REQUIRE_EQ(stats.cached_count, 0);
+
+  mempool_free_bulk(entries, 65);
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.used_count, 0);
+  REQUIRE_EQ(stats.dynamic_allocs_count, 0);
+  mempool_destroy(mp);
+}
+
+TEST(cmempools, stats_peaks_and_failures) {
+  mempool_config config = {.fallback_to_dynamic_memory = true};
+  mempool* mp = mempool_create_with_config(8, sizeof(int), &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  void* entries[12] = {0};
+  for (uint32_t i = 0; i < 10; ++i) {
+    entries[i] = mempool_alloc_entry(mp);
+    REQUIRE_NE(entries[i], NULL);
+  }
+  mempool_free_bulk(entries, 10);
+
+  mempool_stats stats;
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.used_count, 0);
+  REQUIRE_EQ(stats.peak_used_count, 8);
+  REQUIRE_EQ(stats.peak_dynamic_allocs_count, 2);
+  REQUIRE_EQ(stats.fallback_count, 2);
+  REQUIRE_EQ(stats.failed_allocs_count, 0);
+
+  // The peaks start over from the current values.
+  REQUIRE_EQ(mempool_alloc_bulk(mp, entries, 3), 3);
+  mempool_reset_stats(mp);
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.peak_used_count, 3);
+  REQUIRE_EQ(stats.peak_dynamic_allocs_count, 0);
+  REQUIRE_EQ(stats.fallback_count, 0);
+  mempool_free_bulk(entries, 3);
+  mempool_destroy(mp);
+
+  // Without the fallback, every missing entry counts as a failure.
+  config.fallback_to_dynamic_memory = false;
+  config.lock_policy = lock_policy_lock_free;
+  mp = mempool_create_with_config(8, sizeof(int), &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  REQUIRE_EQ(mempool_alloc_bulk(mp, entries, 12), 8);
+  REQUIRE_EQ(mempool_alloc_entry(mp), NULL);
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.peak_used_count, 8);
+  REQUIRE_EQ(stats.failed_allocs_count, 5);
+  REQUIRE_EQ(stats.fallback_count, 0);
+  mempool_free_bulk(entries, 12);
+  mempool_destroy(mp);
+
+  // A sharded pool counts its own failures, not the ones of its shards.
+  config.lock_policy = lock_policy_rwlock;
+  mp = mempool_create_sharded(8, sizeof(int), 4, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  for (uint32_t i = 0; i < 9; ++i) {
+    entries[i] = mempool_alloc_entry(mp);
+  }
+  REQUIRE_EQ(entries[8], NULL);
+  mempool_get_stats(mp, &stats);
+  REQUIRE_EQ(stats.peak_used_count, 8);
+  REQUIRE_EQ(stats.failed_allocs_count, 1);
+  mempool_free_bulk(entries, 9);
+  mempool_destroy(mp);
+}
+
+static volatile bool stats_test_done;
+
+static void* stats_reader(void* arg) {
+  mempool* mp = (mempool*)arg;
+  mempool_stats stats;
+
+  while (!stats_test_done) {
+    mempool_get_stats(mp, &stats);
+    if (stats.used_count > stats.total_capacity ||
+        stats.total_capacity < THREAD_CACHE_TEST_THREADS) {
+      return (void*)1;
+    }
+  }
+
+  return NULL;
+}
+
+TEST(cmempools, stats_while_allocating) {
+  mempool_config config = {.thread_cache_size = 32,
+                           .max_elem_count = THREAD_CACHE_TEST_THREADS * 128};
+  mempool* mp =
+      mempool_create_with_config(THREAD_CACHE_TEST_THREADS, 64, &config);
+  REQUIRE_NE((void*)mp, NULL);
+
+  stats_test_done = false;
+  pthread_t reader;
+  REQUIRE_EQ(pthread_create(&reader, NULL, stats_reader, mp), 0);
+
+  pthread_t threads[THREAD_CACHE_TEST_THREADS];
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, thread_cache_worker, mp), 0);
+  }
+
+  for (uint32_t i = 0; i < THREAD_CACHE_TEST_THREADS; ++i) {
+    void* ret = NULL;
+    pthread_join(threads[i], &ret);
+    REQUIRE_EQ(ret, NULL);
+  }
+
+  stats_test_done = true;
+  void* ret = NULL;
+  pthread_join(reader, &ret);
+  REQUIRE_EQ(ret, NULL);
+
+  REQUIRE_EQ(mempool_used_count(mp), 0);
+
+  mempool_destroy(mp);
+}
+
 // C_R_MEMPOOL TESTS
 
-TEST(r_mempools, create_fails) {
-  r_mempool* rmp = r_mempool_create(4, 17, 0, fallback_disabled, false);
-  REQUIRE_EQ((void*)rmp, NULL);
+TEST(r_mempools, create_fails) {
+  r_mempool* rmp = r_mempool_create(4, 17, 0, fallback_disabled, false);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  rmp = r_mempool_create(4, 0, 17, fallback_disabled, false);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  rmp = r_mempool_create(0, 17, 17, fallback_disabled, false);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  rmp = r_mempool_create(4, 3, 17, fallback_disabled, false);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  rmp = r_mempool_create(4, 4, 17, fallback_disabled, false);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  rmp = r_mempool_create(4, 6, 17, -1, false);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  rmp = r_mempool_create(4, 6, 17, __fallback_end_place_holder, false);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  rmp = r_mempool_create(4, 6, 17, __fallback_end_place_holder + 1, false);
+  REQUIRE_EQ((void*)rmp, NULL);
+}
+
+TEST(r_mempools, create_succeeds) {
+  r_mempool* rmp = r_mempool_create(4, 17, 17, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  r_mempool_destroy(rmp);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  rmp = r_mempool_create(4, 17, 17, fallback_disabled, true);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  r_mempool_destroy(rmp);
+  REQUIRE_EQ((void*)rmp, NULL);
+}
+
+TEST(r_mempools, simple_allocations) {
+  r_mempool* rmp = r_mempool_create(4, 6, 7, fallback_disabled, false);
+  char* ptr = NULL;
+
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
+  ptr = r_mempool_alloc_entry(rmp, 1);  // Should come from buffers of 16
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 1);
+  r_mempool_free_entry(ptr);
+
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
+  ptr = r_mempool_alloc_entry(rmp, 16);  // Should come from buffers of 16
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 1);
+  r_mempool_free_entry(ptr);
+
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  ptr = r_mempool_alloc_entry(rmp, 17);  // Should come from buffers of 32
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 1);
+  r_mempool_free_entry(ptr);
+
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  ptr = r_mempool_alloc_entry(rmp, 32);  // Should come from buffers of 32
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 1);
+  r_mempool_free_entry(ptr);
+
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
+  ptr = r_mempool_alloc_entry(rmp, 33);  // Should come from buffers of 64
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 1);
+  r_mempool_free_entry(ptr);
+
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
+  ptr = r_mempool_alloc_entry(rmp, 63);  // Should come from buffers of 64
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 1);
+  r_mempool_free_entry(ptr);
+
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
+  ptr = r_mempool_alloc_entry(rmp, 64);  // Should come from buffers of 64
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 1);
+  r_mempool_free_entry(ptr);
+
+  REQUIRE_EQ((void*)r_mempool_alloc_entry(rmp, 0), NULL);
+  REQUIRE_EQ((void*)r_mempool_alloc_entry(rmp, 65), NULL);
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, size_classes_over_a_wide_range) {
+  r_mempool* rmp = r_mempool_create(5, 20, 16, fallback_disabled, true);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  for (uint32_t size = 32; size <= (1 << 20); size *= 2) {
+    // size - 1 and size share a class, size + 1 goes to the next one.
+    uint32_t sizes[] = {size / 2 + 1, size - 1, size};
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+      REQUIRE_EQ(r_mempool_used_count(rmp, size), 0);
+      void* ptr = r_mempool_alloc_entry(rmp, sizes[i]);
+      REQUIRE_NE(ptr, NULL);
+      REQUIRE_EQ(r_mempool_used_count(rmp, size), 1);
+      r_mempool_free_entry(ptr);
+    }
+  }
+
+  // Everything up to the smallest size maps to the first class.
+  void* ptr = r_mempool_alloc_entry(rmp, 1);
+  REQUIRE_NE(ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 1);
+  r_mempool_free_entry(ptr);
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, exhaust_all_with_two_classes) {
+  r_mempool* rmp = r_mempool_create(4, 5, 2, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  void* ptrs[6];  // 16: 4, 32: 2
+  for (uint32_t i = 0; i < 6; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 16);
+    REQUIRE_NE(ptrs[i], NULL);
+  }
+  REQUIRE_EQ(r_mempool_alloc_entry(rmp, 16), NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 2);
+
+  for (uint32_t i = 0; i < 6; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, spaced_create_fails) {
+  // The steps would be 4 bytes long.
+  r_mempool* rmp = r_mempool_create_spaced(4, 6, 4, 2, fallback_disabled, true);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  // At most 8 classes per doubling.
+  rmp = r_mempool_create_spaced(8, 10, 4, 4, fallback_disabled, true);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  rmp = r_mempool_create_spaced(6, 8, 4, 3, fallback_disabled, true);
+  REQUIRE_NE((void*)rmp, NULL);
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, spaced_size_classes) {
+  // 4 classes per doubling: 32, 40, 48, 56, 64, 80, 96, 112, 128, ...
+  r_mempool* rmp = r_mempool_create_spaced(5, 8, 6, 2, fallback_disabled, true);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  uint32_t classes[13] = {32};
+  for (uint32_t i = 1; i < 13; ++i) {
+    uint32_t doubling = 32u << ((i - 1) / 4);
+    classes[i] = doubling + ((i - 1) % 4 + 1) * doubling / 4;
+  }
+  REQUIRE_EQ(classes[4], 64);
+  REQUIRE_EQ(classes[5], 80);
+  REQUIRE_EQ(classes[12], 256);
+
+  // Every size should be served by the smallest class that can hold it.
+  uint32_t index = 0;
+  for (uint32_t size = 1; size <= 256; ++size) {
+    if (size > classes[index]) {
+      ++index;
+    }
+    void* ptr = r_mempool_alloc_entry(rmp, size);
+    REQUIRE_NE(ptr, NULL);
+    memset(ptr, 0xAB, size);
+    REQUIRE_EQ(r_mempool_used_count(rmp, size), 1);
+    REQUIRE_EQ(r_mempool_used_count(rmp, classes[index]), 1);
+    if (index > 0) {
+      REQUIRE_EQ(r_mempool_used_count(rmp, classes[index - 1]), 0);
+    }
+    r_mempool_free_entry(ptr);
+  }
+
+  // The classes hold as many elements as their power of two ceilings.
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 32), 64);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 40), 32);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 64), 32);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 80), 16);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 256), 8);
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, create_with_classes_fails) {
+  r_mempool_class_spec unordered[] = {{64, 4}, {32, 4}};
+  r_mempool_class_spec unaligned[] = {{64, 4}, {100, 4}};
+  r_mempool_class_spec too_small[] = {{8, 4}, {64, 4}};
+  r_mempool_class_spec empty_class[] = {{64, 4}, {128, 0}};
+
+  REQUIRE_EQ((void*)r_mempool_create_with_classes(NULL, 2, fallback_disabled,
+                                                  true),
+             NULL);
+  REQUIRE_EQ((void*)r_mempool_create_with_classes(unordered, 0,
+                                                  fallback_disabled, true),
+             NULL);
+  REQUIRE_EQ((void*)r_mempool_create_with_classes(unordered, 2,
+                                                  fallback_disabled, true),
+             NULL);
+  REQUIRE_EQ((void*)r_mempool_create_with_classes(unaligned, 2,
+                                                  fallback_disabled, true),
+             NULL);
+  REQUIRE_EQ((void*)r_mempool_create_with_classes(too_small, 2,
+                                                  fallback_disabled, true),
+             NULL);
+  REQUIRE_EQ((void*)r_mempool_create_with_classes(empty_class, 2,
+                                                  fallback_disabled, true),
+             NULL);
+}
+
+TEST(r_mempools, create_with_classes) {
+  // Lots of 64 and 4096 byte entries, few in between.
+  r_mempool_class_spec specs[] = {
+      {64, 256}, {256, 4}, {1024, 2}, {4096, 64}};
+  r_mempool* rmp =
+      r_mempool_create_with_classes(specs, 4, fallback_at_last_exhaustion,
+                                    false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 1), 256);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 64), 256);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 65), 4);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 1000), 2);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 4096), 64);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 4097), 0);
+
+  uint32_t sizes[] = {1, 64, 65, 256, 257, 1024, 1025, 4096};
+  uint32_t classes[] = {64, 64, 256, 256, 1024, 1024, 4096, 4096};
+  for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    void* ptr = r_mempool_alloc_entry(rmp, sizes[i]);
+    REQUIRE_NE(ptr, NULL);
+    memset(ptr, 0xAB, sizes[i]);
+    REQUIRE_EQ(r_mempool_used_count(rmp, classes[i]), 1);
+    r_mempool_free_entry(ptr);
+  }
+  REQUIRE_EQ(r_mempool_alloc_entry(rmp, 4097), NULL);
+
+  // Once the 256 byte class is exhausted, the larger ones take over.
+  void* ptrs[7];
+  for (uint32_t i = 0; i < 7; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 200);
+    REQUIRE_NE(ptrs[i], NULL);
+  }
+  REQUIRE_EQ(r_mempool_used_count(rmp, 256), 4);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 1024), 2);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 4096), 1);
+  for (uint32_t i = 0; i < 7; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, escalation_skips_exhausted_classes) {
+  // 16: 8, 32: 4, 64: 2, 128: 1
+  r_mempool* rmp = r_mempool_create(4, 7, 3, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  void* small[8];
+  void* medium[4];
+  for (uint32_t i = 0; i < 8; ++i) {
+    small[i] = r_mempool_alloc_entry(rmp, 16);
+    REQUIRE_NE(small[i], NULL);
+  }
+  for (uint32_t i = 0; i < 4; ++i) {
+    medium[i] = r_mempool_alloc_entry(rmp, 32);
+    REQUIRE_NE(medium[i], NULL);
+  }
+
+  // Both the 16 and 32 byte classes are exhausted now.
+  void* escalated[3];
+  for (uint32_t i = 0; i < 3; ++i) {
+    escalated[i] = r_mempool_alloc_entry(rmp, 16);
+    REQUIRE_NE(escalated[i], NULL);
+  }
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 2);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 128), 1);
+  REQUIRE_EQ(r_mempool_alloc_entry(rmp, 16), NULL);
+
+  // An exhausted class becomes a candidate again once an entry is back,
+  // whichever way it gets released.
+  mempool_free_entry(medium[0]);
+  void* ptr = r_mempool_alloc_entry(rmp, 16);
+  REQUIRE_NE(ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 4);
+  r_mempool_free_entry(ptr);
+
+  void* bulk[4];
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 16, bulk, 4), 1);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 4);
+  r_mempool_free_bulk(bulk, 1);
+
+  for (uint32_t i = 0; i < 3; ++i) {
+    r_mempool_free_entry(escalated[i]);
+  }
+  for (uint32_t i = 1; i < 4; ++i) {
+    r_mempool_free_entry(medium[i]);
+  }
+  for (uint32_t i = 0; i < 8; ++i) {
+    r_mempool_free_entry(small[i]);
+  }
+
+  r_mempool_destroy(rmp);
+}
+
+#define ESCALATION_TEST_THREADS 4
+#define ESCALATION_TEST_ROUNDS 20000
+
+static void* escalation_worker(void* arg) {
+  r_mempool* rmp = (r_mempool*)arg;
+  void* ptrs[3];
+
+  // The pool can hold all the entries of all the threads at once, so
+  // an exhausted class must never hide the free entries of another.
+  for (uint32_t round = 0; round < ESCALATION_TEST_ROUNDS; ++round) {
+    for (uint32_t i = 0; i < 3; ++i) {
+      ptrs[i] = r_mempool_alloc_entry(rmp, 16);
+      if (!ptrs[i]) {
+        return (void*)1;
+      }
+    }
+    for (uint32_t i = 0; i < 3; ++i) {
+      r_mempool_free_entry(ptrs[i]);
+    }
+  }
+
+  return NULL;
+}
+
+TEST(r_mempools, escalation_multiple_threads) {
+  // 16: 8, 32: 4 => 12 entries for 4 threads holding 3 each.
+  r_mempool* rmp = r_mempool_create(4, 5, 3, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  pthread_t threads[ESCALATION_TEST_THREADS];
+  for (uint32_t i = 0; i < ESCALATION_TEST_THREADS; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, escalation_worker, rmp), 0);
+  }
 
-  rmp = r_mempool_create(4, 0, 17, fallback_disabled, false);
-  REQUIRE_EQ((void*)rmp, NULL);
+  for (uint32_t i = 0; i < ESCALATION_TEST_THREADS; ++i) {
+    void* ret = NULL;
+    pthread_join(threads[i], &ret);
+    REQUIRE_EQ(ret, NULL);
+  }
 
-  rmp = r_mempool_create(0, 17, 17, fallback_disabled, false);
-  REQUIRE_EQ((void*)rmp, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
 
-  rmp = r_mempool_create(4, 3, 17, fallback_disabled, false);
-  REQUIRE_EQ((void*)rmp, NULL);
+  r_mempool_destroy(rmp);
+}
 
-  rmp = r_mempool_create(4, 4, 17, fallback_disabled, false);
-  REQUIRE_EQ((void*)rmp, NULL);
+TEST(r_mempools, rebalancing_create_fails) {
+  r_mempool_class_spec specs[] = {{64, 16}, {256, 16}};
 
-  rmp = r_mempool_create(4, 6, 17, -1, false);
-  REQUIRE_EQ((void*)rmp, NULL);
+  // A slab should hold at least one entry of every class.
+  REQUIRE_EQ((void*)r_mempool_create_rebalancing(specs, 2, 0, true,
+                                                 fallback_disabled, true),
+             NULL);
+  REQUIRE_EQ((void*)r_mempool_create_rebalancing(specs, 2, 256, true,
+                                                 fallback_disabled, true),
+             NULL);
 
-  rmp = r_mempool_create(4, 6, 17, __fallback_end_place_holder, false);
-  REQUIRE_EQ((void*)rmp, NULL);
+  r_mempool* rmp = r_mempool_create_rebalancing(specs, 2, 272, true,
+                                                fallback_disabled, true);
+  REQUIRE_NE((void*)rmp, NULL);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 64), 18);  // 6 slabs of 3
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 256), 16);
+  r_mempool_destroy(rmp);
+
+  // The other ranged pools are left alone.
+  rmp = r_mempool_create(4, 6, 4, fallback_disabled, true);
+  REQUIRE_EQ(r_mempool_rebalance(rmp), 0);
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, rebalance_on_exhaustion) {
+  // A slab holds 16 entries of 64 bytes, or 4 entries of 256 bytes.
+  r_mempool_class_spec specs[] = {{64, 16}, {256, 16}};
+  r_mempool* rmp = r_mempool_create_rebalancing(specs, 2, 1280, true,
+                                                fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  // The idle 256 byte class gives away all its slabs but the last one,
+  // and the larger class serves the rest as usual.
+  void* ptrs[68];
+  for (uint32_t i = 0; i < 68; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 64);
+    REQUIRE_NE(ptrs[i], NULL);
+    memset(ptrs[i], 0xAB, 64);
+  }
+  REQUIRE_EQ(r_mempool_alloc_entry(rmp, 64), NULL);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 64), 64);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 256), 4);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 256), 4);
+
+  for (uint32_t i = 0; i < 68; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
+
+  // Now the 64 byte class is the idle one.
+  uint32_t count = r_mempool_alloc_bulk(rmp, 256, ptrs, 20);
+  REQUIRE_EQ(count, 16);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 64), 16);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 256), 16);
+  r_mempool_free_bulk(ptrs, count);
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, rebalance_from_maintenance) {
+  r_mempool_class_spec specs[] = {{64, 16}, {256, 16}};
+  r_mempool* rmp = r_mempool_create_rebalancing(specs, 2, 1280, false,
+                                                fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  void* small[25];
+  for (uint32_t i = 0; i < 13; ++i) {
+    small[i] = r_mempool_alloc_entry(rmp, 64);
+    REQUIRE_NE(small[i], NULL);
+  }
+
+  // 13 of 16 is hot, and 0 of 12 would still be cold.
+  REQUIRE_EQ(r_mempool_rebalance(rmp), 1);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 64), 32);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 256), 12);
+  REQUIRE_EQ(r_mempool_rebalance(rmp), 0);
+
+  // 12 of 12 is hot, but 13 of 16 would be hot as well.
+  void* large[12];
+  for (uint32_t i = 0; i < 12; ++i) {
+    large[i] = r_mempool_alloc_entry(rmp, 256);
+    REQUIRE_NE(large[i], NULL);
+  }
+  REQUIRE_EQ(r_mempool_rebalance(rmp), 0);
+
+  // A slab with entries in use never moves.
+  for (uint32_t i = 0; i < 12; ++i) {
+    if (i % 4 != 0) {
+      r_mempool_free_entry(large[i]);
+    }
+  }
+  for (uint32_t i = 0; i < 13; ++i) {
+    r_mempool_free_entry(small[i]);
+  }
+  for (uint32_t i = 0; i < 25; ++i) {
+    small[i] = r_mempool_alloc_entry(rmp, 64);
+    REQUIRE_NE(small[i], NULL);
+  }
+  REQUIRE_EQ(r_mempool_rebalance(rmp), 0);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 256), 12);
+
+  // Once one of them is free, it does.
+  r_mempool_free_entry(large[0]);
+  REQUIRE_EQ(r_mempool_rebalance(rmp), 1);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 64), 48);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 256), 8);
+
+  for (uint32_t i = 0; i < 25; ++i) {
+    r_mempool_free_entry(small[i]);
+  }
+  for (uint32_t i = 4; i < 12; i += 4) {
+    r_mempool_free_entry(large[i]);
+  }
+
+  r_mempool_destroy(rmp);
+}
+
+#define REBALANCING_TEST_THREADS 4
+#define REBALANCING_TEST_ROUNDS 5000
+
+static void* rebalancing_worker(void* arg) {
+  r_mempool* rmp = (r_mempool*)arg;
+  void* ptrs[8];
+
+  for (uint32_t round = 0; round < REBALANCING_TEST_ROUNDS; ++round) {
+    // Every thread shifts between the two classes over time.
+    uint32_t size = (round / 500) % 2 ? 256 : 64;
+    for (uint32_t i = 0; i < 8; ++i) {
+      ptrs[i] = r_mempool_alloc_entry(rmp, size);
+      if (!ptrs[i]) {
+        return (void*)1;
+      }
+      memset(ptrs[i], (int)i, size);
+    }
+    for (uint32_t i = 0; i < 8; ++i) {
+      r_mempool_free_entry(ptrs[i]);
+    }
+  }
+
+  return NULL;
+}
+
+TEST(r_mempools, rebalance_multiple_threads) {
+  r_mempool_class_spec specs[] = {{64, 32}, {256, 32}};
+  r_mempool* rmp = r_mempool_create_rebalancing(
+      specs, 2, 1280, true, fallback_at_last_exhaustion, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  pthread_t threads[REBALANCING_TEST_THREADS];
+  for (uint32_t i = 0; i < REBALANCING_TEST_THREADS; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, rebalancing_worker, rmp), 0);
+  }
+  for (uint32_t i = 0; i < 1000; ++i) {
+    r_mempool_rebalance(rmp);
+  }
+
+  for (uint32_t i = 0; i < REBALANCING_TEST_THREADS; ++i) {
+    void* ret = NULL;
+    pthread_join(threads[i], &ret);
+    REQUIRE_EQ(ret, NULL);
+  }
+
+  // The slabs only ever move, 2 + 8 of them.
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 256), 0);
+  REQUIRE_EQ(r_mempool_total_capacity(rmp, 64) / 16 +
+                 r_mempool_total_capacity(rmp, 256) / 4,
+             10);
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, trace_recording) {
+  char path[] = "/tmp/cmempool_trace_XXXXXX";
+  int fd = mkstemp(path);
+  REQUIRE_NE(fd, -1);
+  close(fd);
+
+  r_mempool* rmp = r_mempool_create(4, 6, 3, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  // Nothing gets recorded before the start.
+  void* ignored = r_mempool_alloc_entry(rmp, 16);
+  REQUIRE_TRUE(r_mempool_trace_start(path));
+  REQUIRE_FALSE(r_mempool_trace_start(path));
+
+  void* a = r_mempool_alloc_entry(rmp, 10);
+  void* old_a = a;
+  void* b = r_mempool_calloc_entry(rmp, 40);
+  void* old_b = b;
+  b = r_mempool_realloc_entry(rmp, b, 60);
+  void* new_b = b;
+  void* entries[8] = {0};
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 64, entries, 8), 1);
+  r_mempool_free_entry(a);
+  r_mempool_free_entry(b);
+  r_mempool_free_bulk(entries, 8);
+
+  r_mempool_trace_stop();
+  r_mempool_free_entry(ignored);
+  r_mempool_destroy(rmp);
+
+  FILE* file = fopen(path, "rb");
+  REQUIRE_NE((void*)file, NULL);
+  char magic[8];
+  uint32_t preamble[2];
+  REQUIRE_EQ(fread(magic, sizeof(magic), 1, file), 1);
+  REQUIRE_EQ(memcmp(magic, R_MEMPOOL_TRACE_MAGIC, 8), 0);
+  REQUIRE_EQ(fread(preamble, sizeof(preamble), 1, file), 1);
+  REQUIRE_EQ(preamble[0], R_MEMPOOL_TRACE_VERSION);
+  REQUIRE_EQ(preamble[1], sizeof(r_mempool_trace_record));
+
+  r_mempool_trace_record records[16];
+  size_t count = fread(records, sizeof(records[0]), 16, file);
+  fclose(file);
+  unlink(path);
+
+  // 2 allocs, 1 realloc, 8 bulk allocs (7 failed) and 3 frees.
+  REQUIRE_EQ(count, 14);
+  REQUIRE_EQ(records[0].op, r_mempool_trace_alloc);
+  REQUIRE_EQ(records[0].size, 10);
+  REQUIRE_EQ(records[0].entry, (uint64_t)(uintptr_t)old_a);
+  REQUIRE_EQ(records[1].op, r_mempool_trace_alloc);
+  REQUIRE_EQ(records[1].entry, (uint64_t)(uintptr_t)old_b);
+  REQUIRE_EQ(records[2].op, r_mempool_trace_realloc);
+  REQUIRE_EQ(records[2].old_entry, (uint64_t)(uintptr_t)old_b);
+  REQUIRE_EQ(records[2].entry, (uint64_t)(uintptr_t)new_b);
+  REQUIRE_EQ(records[11].entry, (uint64_t)(uintptr_t)old_a);
+  REQUIRE_NE(records[3].entry, 0);
+  for (uint32_t i = 4; i < 11; ++i) {
+    REQUIRE_EQ(records[i].op, r_mempool_trace_alloc);
+    REQUIRE_EQ(records[i].entry, 0);
+  }
+  for (uint32_t i = 11; i < 14; ++i) {
+    REQUIRE_EQ(records[i].op, r_mempool_trace_free);
+    REQUIRE_EQ(records[i].thread_id, records[0].thread_id);
+    REQUIRE_LT(records[i - 1].timestamp_ns, records[i].timestamp_ns + 1);
+  }
+}
+
+TEST(r_mempools, bulk_allocations) {
+  r_mempool* rmp = r_mempool_create(4, 6, 7, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  void* ptrs[256] = {0};
+
+  // Only 32 of them fit in the pool of 64, the rest can't be served.
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 64, ptrs, 40), 32);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 32);
+  r_mempool_free_bulk(ptrs, 40);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
+
+  // 16: 128, 32: 64, 64: 32 => 224
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 10, ptrs, 256), 224);
+  for (uint32_t size = 16; size <= 64; size *= 2) {
+    REQUIRE_EQ(r_mempool_used_count(rmp, size),
+               r_mempool_total_capacity(rmp, size));
+  }
+  r_mempool_free_bulk(ptrs, 256);
+  for (uint32_t size = 16; size <= 64; size *= 2) {
+    REQUIRE_EQ(r_mempool_used_count(rmp, size), 0);
+  }
+
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 65, ptrs, 1), 0);
+
+  r_mempool_destroy(rmp);
+
+  rmp = r_mempool_create(4, 6, 7, fallback_at_last_exhaustion, false);
+  REQUIRE_NE((void*)rmp, NULL);
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 64, ptrs, 40), 40);
+  REQUIRE_EQ(r_mempool_dynamic_allocs_count(rmp, 64), 8);
+  r_mempool_free_bulk(ptrs, 40);
+  REQUIRE_EQ(r_mempool_dynamic_allocs_count(rmp, 64), 0);
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, class_stats) {
+  r_mempool* rmp =
+      r_mempool_create(4, 6, 3, fallback_at_last_exhaustion, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  // 16: 8, 32: 4, 64: 2 entries
+  void* entries[16] = {0};
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 10, entries, 16), 16);
+
+  r_mempool_stats stats;
+  r_mempool_get_stats(rmp, 10, &stats);
+  REQUIRE_EQ(stats.pool.used_count, 8);
+  REQUIRE_EQ(stats.pool.peak_used_count, 8);
+  REQUIRE_EQ(stats.escalated_count, 6);
+  REQUIRE_EQ(stats.last_exhaustion_fallback_count, 2);
+  REQUIRE_EQ(stats.failed_allocs_count, 0);
+
+  // The pool of 64 missed 2 of the 4 entries escalated to it above.
+  void* entry = r_mempool_alloc_entry(rmp, 64);
+  REQUIRE_NE(entry, NULL);
+  r_mempool_get_stats(rmp, 64, &stats);
+  REQUIRE_EQ(stats.pool.failed_allocs_count, 3);
+  REQUIRE_EQ(stats.escalated_count, 0);
+  REQUIRE_EQ(stats.last_exhaustion_fallback_count, 1);
+  r_mempool_free_entry(entry);
+
+  r_mempool_free_bulk(entries, 16);
+  r_mempool_reset_stats(rmp);
+  r_mempool_get_stats(rmp, 10, &stats);
+  REQUIRE_EQ(stats.pool.peak_used_count, 0);
+  REQUIRE_EQ(stats.escalated_count, 0);
+  REQUIRE_EQ(stats.last_exhaustion_fallback_count, 0);
+
+  r_mempool_get_stats(rmp, 65, &stats);
+  REQUIRE_EQ(stats.pool.total_capacity, 0);
+  r_mempool_destroy(rmp);
+
+  rmp = r_mempool_create(4, 6, 3, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 64, entries, 3), 2);
+  REQUIRE_EQ(r_mempool_alloc_entry(rmp, 64), NULL);
+  r_mempool_get_stats(rmp, 64, &stats);
+  REQUIRE_EQ(stats.failed_allocs_count, 2);
+  REQUIRE_EQ(stats.pool.failed_allocs_count, 2);
+  r_mempool_free_bulk(entries, 3);
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, size_histogram) {
+  r_mempool* rmp = r_mempool_create(4, 6, 3, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  // Nothing gets recorded by default.
+  void* entry = r_mempool_alloc_entry(rmp, 20);
+  r_mempool_free_entry(entry);
+  r_mempool_size_histogram histogram;
+  r_mempool_get_size_histogram(rmp, 20, &histogram);
+  REQUIRE_EQ(histogram.lower_size, 16);
+  REQUIRE_EQ(histogram.upper_size, 32);
+  REQUIRE_EQ(histogram.requested_bytes, 0);
+
+  REQUIRE_TRUE(r_mempool_set_size_histogram(rmp, true));
+
+  // The class of 32 spans (16, 32], 2 bytes per bucket.
+  void* entries[8] = {0};
+  entries[0] = r_mempool_alloc_entry(rmp, 17);
+  entries[1] = r_mempool_alloc_entry(rmp, 18);
+  entries[2] = r_mempool_alloc_entry(rmp, 19);
+  entries[3] = r_mempool_calloc_entry(rmp, 32);
+  // Served by the class of 64, once the class of 32 is exhausted.
+  entries[4] = r_mempool_alloc_entry(rmp, 30);
+  for (uint32_t i = 0; i < 5; ++i) {
+    REQUIRE_NE(entries[i], NULL);
+  }
+
+  r_mempool_get_size_histogram(rmp, 20, &histogram);
+  REQUIRE_EQ(histogram.counts[0], 2);
+  REQUIRE_EQ(histogram.counts[1], 1);
+  REQUIRE_EQ(histogram.counts[6], 1);
+  REQUIRE_EQ(histogram.counts[7], 1);
+  REQUIRE_EQ(histogram.requested_bytes, 17 + 18 + 19 + 32 + 30);
+  REQUIRE_EQ(histogram.handed_out_bytes, 4 * 32 + 64);
+
+  // The smallest class starts from 1.
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 1, &entries[5], 3), 3);
+  r_mempool_get_size_histogram(rmp, 1, &histogram);
+  REQUIRE_EQ(histogram.lower_size, 0);
+  REQUIRE_EQ(histogram.upper_size, 16);
+  REQUIRE_EQ(histogram.counts[0], 3);
+  REQUIRE_EQ(histogram.requested_bytes, 3);
+  REQUIRE_EQ(histogram.handed_out_bytes, 3 * 16);
+
+  // The recorded sizes are kept when stopped, until a reset.
+  REQUIRE_TRUE(r_mempool_set_size_histogram(rmp, false));
+  r_mempool_free_bulk(entries, 8);
+  entry = r_mempool_alloc_entry(rmp, 1);
+  r_mempool_free_entry(entry);
+  r_mempool_get_size_histogram(rmp, 1, &histogram);
+  REQUIRE_EQ(histogram.counts[0], 3);
+  r_mempool_reset_stats(rmp);
+  r_mempool_get_size_histogram(rmp, 1, &histogram);
+  REQUIRE_EQ(histogram.counts[0], 0);
+  REQUIRE_EQ(histogram.handed_out_bytes, 0);
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, aligned_allocations) {
+  r_mempool* rmp =
+      r_mempool_create_aligned(4, 8, 4, fallback_at_last_exhaustion, false, 64);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  void* ptrs[64] = {0};
+  for (uint32_t i = 0; i < 64; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 1 + i * 4);
+    REQUIRE_NE(ptrs[i], NULL);
+    REQUIRE_EQ((uintptr_t)ptrs[i] % 64, 0);
+    memset(ptrs[i], 0xab, 1 + i * 4);
+  }
+
+  // Growing keeps the contents and the alignment.
+  ptrs[0] = r_mempool_realloc_entry(rmp, ptrs[0], 200);
+  REQUIRE_NE(ptrs[0], NULL);
+  REQUIRE_EQ((uintptr_t)ptrs[0] % 64, 0);
+  REQUIRE_EQ(*(uint8_t*)ptrs[0], 0xab);
+
+  for (uint32_t i = 0; i < 64; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 256), 0);
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, simple_reallocations) {
+  r_mempool* rmp = r_mempool_create(4, 6, 7, fallback_disabled, false);
+  char* ptr = NULL;
+
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  ptr = r_mempool_realloc_entry(rmp, ptr, 3);
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 1);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+
+  for (int i = 0; i < 3; ++i) {
+    ptr[i] = i;
+  }
+
+  char* orig = ptr;
+  ptr = r_mempool_realloc_entry(rmp, ptr, 6);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 1);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  // Since the block size is still 16 no real "reallocation" happened
+  REQUIRE_EQ((void*)orig, (void*)ptr);
+  for (int i = 0; i < 6; ++i) {
+    if (i < 3) {
+      REQUIRE_EQ(ptr[i], i);
+    } else {
+      ptr[i] = i;
+    }
+  }
+
+  ptr = r_mempool_realloc_entry(rmp, ptr, 20);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 1);
+  REQUIRE_NE((void*)orig, (void*)ptr);
+  for (int i = 0; i < 20; ++i) {
+    if (i < 6) {
+      REQUIRE_EQ(ptr[i], i);
+    } else {
+      ptr[i] = i;
+    }
+  }
+
+  orig = ptr;
+  ptr = r_mempool_realloc_entry(rmp, ptr, 5);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 1);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  REQUIRE_NE((void*)orig, (void*)ptr);
+  for (int i = 0; i < 5; ++i) {
+    REQUIRE_EQ(ptr[i], i);
+  }
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, usable_size) {
+  r_mempool* rmp =
+      r_mempool_create(4, 6, 2, fallback_at_last_exhaustion, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  REQUIRE_EQ(r_mempool_usable_size(NULL), 0);
+
+  // 16: 4, 32: 2, 64: 1
+  void* ptrs[8];
+  for (uint32_t i = 0; i < 8; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 10);
+    REQUIRE_NE(ptrs[i], NULL);
+  }
+  REQUIRE_EQ(r_mempool_usable_size(ptrs[0]), 16);
+  REQUIRE_EQ(r_mempool_usable_size(ptrs[4]), 32);
+  REQUIRE_EQ(r_mempool_usable_size(ptrs[6]), 64);
+  // The last one came from the dynamic memory.
+  REQUIRE_TRUE(r_mempool_usable_size(ptrs[7]) >= 10);
+  memset(ptrs[7], 0xAB, r_mempool_usable_size(ptrs[7]));
+
+  for (uint32_t i = 0; i < 8; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, realloc_in_place) {
+  r_mempool* rmp = r_mempool_create(4, 12, 9, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  REQUIRE_FALSE(r_mempool_set_realloc_in_place_percentage(NULL, 25));
+  REQUIRE_FALSE(r_mempool_set_realloc_in_place_percentage(rmp, 101));
+
+  char* ptr = (char*)r_mempool_alloc_entry(rmp, 4096);
+  REQUIRE_NE((void*)ptr, NULL);
+  memset(ptr, 'x', 4096);
+
+  // By default, a smaller class means a copy.
+  char* orig = ptr;
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 3000);
+  REQUIRE_EQ((void*)ptr, (void*)orig);
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 1024);
+  REQUIRE_NE((void*)ptr, (void*)orig);
+  REQUIRE_EQ(r_mempool_usable_size(ptr), 1024);
+  REQUIRE_EQ(ptr[1023], 'x');
+
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 4096);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 1024), 0);
+  REQUIRE_EQ(ptr[1023], 'x');
+
+  // Down to a quarter of the entry, it stays where it is, and it can
+  // grow back without a copy as well.
+  REQUIRE_TRUE(r_mempool_set_realloc_in_place_percentage(rmp, 25));
+  orig = ptr;
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 1024);
+  REQUIRE_EQ((void*)ptr, (void*)orig);
+  REQUIRE_EQ(r_mempool_usable_size(ptr), 4096);
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 2048);
+  REQUIRE_EQ((void*)ptr, (void*)orig);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 1024), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 2048), 0);
+
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 1000);
+  REQUIRE_NE((void*)ptr, (void*)orig);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 1000), 1);
+  REQUIRE_EQ(ptr[999], 'x');
+
+  // With 0, it never moves while shrinking.
+  REQUIRE_TRUE(r_mempool_set_realloc_in_place_percentage(rmp, 0));
+  orig = ptr;
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 1);
+  REQUIRE_EQ((void*)ptr, (void*)orig);
+
+  r_mempool_free_entry(ptr);
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, realloc_dynamic_entries) {
+  // 16: 2, 32: 1
+  r_mempool* rmp =
+      r_mempool_create(4, 5, 1, fallback_at_last_exhaustion, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  void* ptrs[3];
+  for (uint32_t i = 0; i < 3; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 16);
+    REQUIRE_NE(ptrs[i], NULL);
+  }
+
+  // Both the old and the new entries come from the dynamic memory,
+  // and only the bytes the old one has get copied.
+  char* ptr = (char*)r_mempool_alloc_entry(rmp, 9);
+  REQUIRE_NE((void*)ptr, NULL);
+  memset(ptr, 'y', 9);
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 32);
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_TRUE(r_mempool_usable_size(ptr) >= 32);
+  for (uint32_t i = 0; i < 9; ++i) {
+    REQUIRE_EQ(ptr[i], 'y');
+  }
+
+  r_mempool_free_entry(ptr);
+  for (uint32_t i = 0; i < 3; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, large_entries) {
+  r_mempool* rmp = r_mempool_create(4, 6, 7, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  // The sizes above the largest class are refused until enabled.
+  REQUIRE_EQ(r_mempool_alloc_entry(rmp, 65), NULL);
+  REQUIRE_FALSE(r_mempool_enable_large_entries(NULL, 2));
+  REQUIRE_FALSE(
+      r_mempool_enable_large_entries(rmp, R_MEMPOOL_MAX_CACHED_MAPPINGS + 1));
+  REQUIRE_TRUE(r_mempool_enable_large_entries(rmp, 2));
+  REQUIRE_FALSE(r_mempool_enable_large_entries(rmp, 2));
+
+  uint32_t size = 1 << 20;
+  char* ptr = (char*)r_mempool_alloc_entry(rmp, size);
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ((uintptr_t)ptr % 16, 0);
+  REQUIRE_TRUE(r_mempool_usable_size(ptr) >= size);
+  memset(ptr, 'l', size);
+
+  r_mempool_stats stats;
+  r_mempool_get_stats(rmp, size, &stats);
+  REQUIRE_EQ(stats.pool.dynamic_allocs_count, 1);
+  REQUIRE_EQ(stats.pool.fallback_count, 1);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
+
+  // The released mapping gets reused for the next large entry that
+  // fits in it, but not for a much smaller one.
+  char* old_ptr = ptr;
+  r_mempool_free_entry(ptr);
+  r_mempool_get_stats(rmp, size, &stats);
+  REQUIRE_EQ(stats.pool.dynamic_allocs_count, 0);
+
+  ptr = (char*)r_mempool_alloc_entry(rmp, 1000);
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_NE((void*)ptr, (void*)old_ptr);
+  r_mempool_free_entry(ptr);
+
+  ptr = (char*)r_mempool_alloc_entry(rmp, size - 100);
+  REQUIRE_EQ((void*)ptr, (void*)old_ptr);
+  memset(ptr, 'l', size - 100);
+
+  // The large entries grow in place or get remapped, and shrink back
+  // into the classes.
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 8 * size);
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_TRUE(r_mempool_usable_size(ptr) >= 8 * size);
+  for (uint32_t i = 0; i < size - 100; i += 4096) {
+    REQUIRE_EQ(ptr[i], 'l');
+  }
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 64);
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 1);
+  for (uint32_t i = 0; i < 64; ++i) {
+    REQUIRE_EQ(ptr[i], 'l');
+  }
+
+  // And the class entries grow into the large ones.
+  ptr = (char*)r_mempool_realloc_entry(rmp, ptr, 100000);
+  REQUIRE_NE((void*)ptr, NULL);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
+  for (uint32_t i = 0; i < 64; ++i) {
+    REQUIRE_EQ(ptr[i], 'l');
+  }
+  r_mempool_free_entry(ptr);
+
+  r_mempool_reset_stats(rmp);
+  r_mempool_get_stats(rmp, size, &stats);
+  REQUIRE_EQ(stats.pool.fallback_count, 0);
 
-  rmp = r_mempool_create(4, 6, 17, __fallback_end_place_holder + 1, false);
-  REQUIRE_EQ((void*)rmp, NULL);
+  r_mempool_destroy(rmp);
 }
 
-TEST(r_mempools, create_succeeds) {
-  r_mempool* rmp = r_mempool_create(4, 17, 17, fallback_disabled, false);
+TEST(r_mempools, large_fallback_entries) {
+  r_mempool_class_spec specs[] = {{64, 4}, {256 * 1024, 1}};
+  r_mempool* rmp =
+      r_mempool_create_with_classes(specs, 2, fallback_at_last_exhaustion,
+                                    false);
   REQUIRE_NE((void*)rmp, NULL);
+  REQUIRE_TRUE(r_mempool_enable_large_entries(rmp, 0));
+
+  void* pool_entry = r_mempool_alloc_entry(rmp, 200 * 1024);
+  REQUIRE_NE(pool_entry, NULL);
+
+  // The fallback entries above the threshold get mapped, so they start
+  // right after the length and the header of their mappings.
+  void* large_entry = r_mempool_alloc_entry(rmp, 200 * 1024);
+  REQUIRE_NE(large_entry, NULL);
+  REQUIRE_EQ((uintptr_t)large_entry % 4096, 32);
+  REQUIRE_TRUE(r_mempool_usable_size(large_entry) >= 200 * 1024);
+
+  r_mempool_stats stats;
+  r_mempool_get_stats(rmp, 200 * 1024, &stats);
+  REQUIRE_EQ(stats.last_exhaustion_fallback_count, 1);
+  r_mempool_get_stats(rmp, 512 * 1024, &stats);
+  REQUIRE_EQ(stats.pool.dynamic_allocs_count, 1);
+
+  // The smaller ones still come from the heap.
+  void* small_entries[5];
+  for (uint32_t i = 0; i < 5; ++i) {
+    small_entries[i] = r_mempool_alloc_entry(rmp, 64);
+    REQUIRE_NE(small_entries[i], NULL);
+  }
+  r_mempool_get_stats(rmp, 512 * 1024, &stats);
+  REQUIRE_EQ(stats.pool.dynamic_allocs_count, 1);
 
+  for (uint32_t i = 0; i < 5; ++i) {
+    r_mempool_free_entry(small_entries[i]);
+  }
+  r_mempool_free_entry(large_entry);
+  r_mempool_free_entry(pool_entry);
+  r_mempool_get_stats(rmp, 512 * 1024, &stats);
+  REQUIRE_EQ(stats.pool.dynamic_allocs_count, 0);
+
+  // The histograms count the usable sizes of the mapped entries.
+  REQUIRE_TRUE(r_mempool_set_size_histogram(rmp, true));
+  pool_entry = r_mempool_alloc_entry(rmp, 200 * 1024);
+  large_entry = r_mempool_alloc_entry(rmp, 200 * 1024);
+  REQUIRE_NE(large_entry, NULL);
+
+  r_mempool_size_histogram histogram;
+  r_mempool_get_size_histogram(rmp, 200 * 1024, &histogram);
+  REQUIRE_EQ(histogram.requested_bytes, 2 * 200 * 1024);
+  REQUIRE_EQ(histogram.handed_out_bytes,
+             256 * 1024 + r_mempool_usable_size(large_entry));
+  REQUIRE_LT(histogram.handed_out_bytes, 2 * 256 * 1024);
+
+  r_mempool_free_entry(large_entry);
+  r_mempool_free_entry(pool_entry);
   r_mempool_destroy(rmp);
-  REQUIRE_EQ((void*)rmp, NULL);
+}
 
-  rmp = r_mempool_create(4, 17, 17, fallback_disabled, true);
+TEST(r_mempools, aligned_large_entries) {
+  r_mempool* rmp =
+      r_mempool_create_aligned(4, 6, 7, fallback_disabled, false, 256);
   REQUIRE_NE((void*)rmp, NULL);
+  REQUIRE_TRUE(r_mempool_enable_large_entries(rmp, 4));
 
+  void* ptrs[8];
+  for (uint32_t i = 0; i < 8; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 5000 * (i + 1));
+    REQUIRE_NE(ptrs[i], NULL);
+    REQUIRE_EQ((uintptr_t)ptrs[i] % 256, 0);
+  }
+  ptrs[0] = r_mempool_realloc_entry(rmp, ptrs[0], 1 << 22);
+  REQUIRE_EQ((uintptr_t)ptrs[0] % 256, 0);
+
+  for (uint32_t i = 0; i < 8; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
   r_mempool_destroy(rmp);
-  REQUIRE_EQ((void*)rmp, NULL);
 }
 
-TEST(r_mempools, simple_allocations) {
+TEST(r_mempools, large_entries_bulk_free) {
   r_mempool* rmp = r_mempool_create(4, 6, 7, fallback_disabled, false);
-  char* ptr = NULL;
-
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
-  ptr = r_mempool_alloc_entry(rmp, 1);  // Should come from buffers of 16
-  REQUIRE_NE((void*)ptr, NULL);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 1);
-  r_mempool_free_entry(ptr);
+  REQUIRE_NE((void*)rmp, NULL);
+  REQUIRE_TRUE(r_mempool_enable_large_entries(rmp, 2));
+
+  // The bulk release goes through the mapping cache, which has a lock
+  // of its own, along with the entries of the classes.
+  void* ptrs[4];
+  ptrs[0] = r_mempool_alloc_entry(rmp, 1 << 20);
+  ptrs[1] = r_mempool_alloc_entry(rmp, 16);
+  ptrs[2] = r_mempool_alloc_entry(rmp, 1 << 20);
+  ptrs[3] = r_mempool_alloc_entry(rmp, 1 << 20);
+  for (uint32_t i = 0; i < 4; ++i) {
+    REQUIRE_NE(ptrs[i], NULL);
+  }
+  r_mempool_free_bulk(ptrs, 3);
+  for (uint32_t i = 0; i < 3; ++i) {
+    REQUIRE_EQ(ptrs[i], NULL);
+  }
+  r_mempool_free_entry(ptrs[3]);
 
+  r_mempool_stats stats;
+  r_mempool_get_stats(rmp, 1 << 20, &stats);
+  REQUIRE_EQ(stats.pool.dynamic_allocs_count, 0);
   REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
-  ptr = r_mempool_alloc_entry(rmp, 16);  // Should come from buffers of 16
-  REQUIRE_NE((void*)ptr, NULL);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 1);
-  r_mempool_free_entry(ptr);
 
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
-  ptr = r_mempool_alloc_entry(rmp, 17);  // Should come from buffers of 32
-  REQUIRE_NE((void*)ptr, NULL);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 1);
-  r_mempool_free_entry(ptr);
+  // The cached mappings are reused afterwards.
+  ptrs[0] = r_mempool_alloc_entry(rmp, 1 << 20);
+  REQUIRE_NE(ptrs[0], NULL);
+  r_mempool_free_entry(ptrs[0]);
 
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
-  ptr = r_mempool_alloc_entry(rmp, 32);  // Should come from buffers of 32
-  REQUIRE_NE((void*)ptr, NULL);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 1);
-  r_mempool_free_entry(ptr);
+  r_mempool_destroy(rmp);
+}
 
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
-  ptr = r_mempool_alloc_entry(rmp, 33);  // Should come from buffers of 64
-  REQUIRE_NE((void*)ptr, NULL);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 1);
-  r_mempool_free_entry(ptr);
+TEST(r_mempools, large_entries_bulk_allocations) {
+  r_mempool* rmp = r_mempool_create(4, 6, 7, fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
 
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
-  ptr = r_mempool_alloc_entry(rmp, 63);  // Should come from buffers of 64
-  REQUIRE_NE((void*)ptr, NULL);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 1);
-  r_mempool_free_entry(ptr);
+  void* ptrs[8] = {NULL};
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 1 << 20, ptrs, 8), 0);
+  REQUIRE_TRUE(r_mempool_enable_large_entries(rmp, 4));
+
+  // The sizes above the largest class get mapped one by one, as they
+  // would be by r_mempool_alloc_entry.
+  REQUIRE_EQ(r_mempool_alloc_bulk(rmp, 1 << 20, ptrs, 8), 8);
+  for (uint32_t i = 0; i < 8; ++i) {
+    REQUIRE_NE(ptrs[i], NULL);
+    REQUIRE_TRUE(r_mempool_usable_size(ptrs[i]) >= 1 << 20);
+    memset(ptrs[i], 'b', 1 << 20);
+  }
 
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  r_mempool_stats stats;
+  r_mempool_get_stats(rmp, 1 << 20, &stats);
+  REQUIRE_EQ(stats.pool.dynamic_allocs_count, 8);
+  REQUIRE_EQ(stats.pool.fallback_count, 8);
+  REQUIRE_EQ(stats.pool.failed_allocs_count, 0);
   REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
-  ptr = r_mempool_alloc_entry(rmp, 64);  // Should come from buffers of 64
-  REQUIRE_NE((void*)ptr, NULL);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 1);
-  r_mempool_free_entry(ptr);
 
-  REQUIRE_EQ((void*)r_mempool_alloc_entry(rmp, 0), NULL);
-  REQUIRE_EQ((void*)r_mempool_alloc_entry(rmp, 65), NULL);
+  r_mempool_free_bulk(ptrs, 8);
+  r_mempool_get_stats(rmp, 1 << 20, &stats);
+  REQUIRE_EQ(stats.pool.dynamic_allocs_count, 0);
 
   r_mempool_destroy(rmp);
 }
 
-TEST(r_mempools, simple_reallocations) {
+static void* large_entries_worker(void* arg) {
+  r_mempool* rmp = (r_mempool*)arg;
+
+  for (uint32_t i = 0; i < 2000; ++i) {
+    uint32_t size = 4096 * (1 + i % 8);
+    char* ptr = (char*)r_mempool_alloc_entry(rmp, size);
+    if (!ptr) {
+      return arg;
+    }
+    ptr[0] = ptr[size - 1] = 'm';
+    r_mempool_free_entry(ptr);
+  }
+
+  return NULL;
+}
+
+TEST(r_mempools, large_entries_multiple_threads) {
   r_mempool* rmp = r_mempool_create(4, 6, 7, fallback_disabled, false);
-  char* ptr = NULL;
+  REQUIRE_NE((void*)rmp, NULL);
+  REQUIRE_TRUE(r_mempool_enable_large_entries(rmp, 8));
 
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
-  ptr = r_mempool_realloc_entry(rmp, ptr, 3);
-  REQUIRE_NE((void*)ptr, NULL);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 1);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
+  pthread_t threads[4];
+  for (uint32_t i = 0; i < 4; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, large_entries_worker, rmp),
+               0);
+  }
+  for (uint32_t i = 0; i < 4; ++i) {
+    void* result = NULL;
+    pthread_join(threads[i], &result);
+    REQUIRE_EQ(result, NULL);
+  }
 
-  for (int i = 0; i < 3; ++i) {
-    ptr[i] = i;
+  r_mempool_stats stats;
+  r_mempool_get_stats(rmp, 1 << 20, &stats);
+  REQUIRE_EQ(stats.pool.dynamic_allocs_count, 0);
+  REQUIRE_EQ(stats.pool.fallback_count, 4 * 2000);
+  REQUIRE_TRUE(stats.pool.peak_dynamic_allocs_count <= 4);
+
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, page_backing) {
+  REQUIRE_EQ((void*)r_mempool_create_backed(4, 6, 7, fallback_disabled, false,
+                                            __page_backing_end_place_holder),
+             NULL);
+
+  r_mempool* rmp = r_mempool_create_backed(4, 10, 12, fallback_disabled, false,
+                                           page_backing_huge_pages_2mb);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  for (uint32_t size = 16; size <= 1024; size *= 2) {
+    void* ptr = r_mempool_alloc_entry(rmp, size);
+    REQUIRE_NE(ptr, NULL);
+    memset(ptr, 0xaa, size);
+
+    r_mempool_stats stats;
+    r_mempool_get_stats(rmp, size, &stats);
+    REQUIRE_GE(stats.pool.page_backing, page_backing_regular_pages);
+    REQUIRE_LE(stats.pool.page_backing, page_backing_huge_pages_2mb);
+    REQUIRE_EQ(stats.pool.used_count, 1);
+
+    r_mempool_free_entry(ptr);
   }
 
-  char* orig = ptr;
-  ptr = r_mempool_realloc_entry(rmp, ptr, 6);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 1);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
-  // Since the block size is still 16 no real "reallocation" happened
-  REQUIRE_EQ((void*)orig, (void*)ptr);
-  for (int i = 0; i < 6; ++i) {
-    if (i < 3) {
-      REQUIRE_EQ(ptr[i], i);
-    } else {
-      ptr[i] = i;
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, page_backing_single_mapping) {
+  r_mempool* rmp = r_mempool_create_backed(4, 10, 12, fallback_disabled, false,
+                                           page_backing_huge_pages_2mb);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  // The classes are adjacent segments of a single mapping, so the first
+  // entry of a class directly follows the last one of the previous.
+  r_mempool_stats first_stats;
+  r_mempool_get_stats(rmp, 16, &first_stats);
+  uintptr_t expected = 0;
+  uint32_t count = 1 << 12;
+  for (uint32_t size = 16; size <= 1024; size *= 2, count /= 2) {
+    void* ptr = r_mempool_alloc_entry(rmp, size);
+    REQUIRE_NE(ptr, NULL);
+    if (expected) {
+      REQUIRE_EQ((uintptr_t)ptr, expected);
     }
+    expected = (uintptr_t)ptr + (uintptr_t)count * (size + 16);
+
+    r_mempool_stats stats;
+    r_mempool_get_stats(rmp, size, &stats);
+    REQUIRE_EQ(stats.pool.page_backing, first_stats.pool.page_backing);
+    REQUIRE_EQ(stats.pool.total_capacity, count);
+
+    r_mempool_free_entry(ptr);
   }
 
-  ptr = r_mempool_realloc_entry(rmp, ptr, 20);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 1);
-  REQUIRE_NE((void*)orig, (void*)ptr);
-  for (int i = 0; i < 20; ++i) {
-    if (i < 6) {
-      REQUIRE_EQ(ptr[i], i);
-    } else {
-      ptr[i] = i;
-    }
+  r_mempool_destroy(rmp);
+}
+
+TEST(r_mempools, trim) {
+  REQUIRE_EQ(r_mempool_trim(NULL), 0);
+
+  r_mempool* rmp = r_mempool_create_backed(4, 10, 12, fallback_disabled, false,
+                                           page_backing_regular_pages);
+  REQUIRE_NE((void*)rmp, NULL);
+  REQUIRE_TRUE(r_mempool_enable_large_entries(rmp, 2));
+
+  void* ptrs[256];
+  for (uint32_t i = 0; i < 256; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 16 << (i % 7));
+    REQUIRE_NE(ptrs[i], NULL);
   }
+  void* large_ptr = r_mempool_alloc_entry(rmp, 1 << 20);
+  REQUIRE_NE(large_ptr, NULL);
+  for (uint32_t i = 0; i < 256; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
+  r_mempool_free_entry(large_ptr);
 
-  orig = ptr;
-  ptr = r_mempool_realloc_entry(rmp, ptr, 5);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 1);
-  REQUIRE_EQ(r_mempool_used_count(rmp, 32), 0);
-  REQUIRE_NE((void*)orig, (void*)ptr);
-  for (int i = 0; i < 5; ++i) {
-    REQUIRE_EQ(ptr[i], i);
+  // The cached mapping of the large entry goes back as well.
+  REQUIRE_GT(r_mempool_trim(rmp), 1 << 20);
+  REQUIRE_EQ(r_mempool_trim(rmp), 0);
+
+  for (uint32_t i = 0; i < 256; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 16 << (i % 7));
+    REQUIRE_NE(ptrs[i], NULL);
+    memset(ptrs[i], 0x3c, 16 << (i % 7));
   }
+  for (uint32_t i = 0; i < 256; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
+  REQUIRE_EQ(r_mempool_used_count(rmp, 16), 0);
 
   r_mempool_destroy(rmp);
 }
@@ -1281,6 +3795,88 @@ TEST(static_r_mempools, exhaust_all_fallback_disabled) {
   r_mempool_destroy(rmp);
 }
 
+TEST(static_r_mempools, spaced_exhaust_all_fallback_disabled) {
+  DECLARE_STATIC_SPACED_RMEMPOOL_BUFFER(
+      preallocated_rmp_buffer,  // The name of the buffer.
+      4,  // The size of the smallest element in the pool - 2^4 : 16
+      6,  // The size of the largest element in the pool - 2^6 : 64
+      5,  // The number of smallest elements in the pool - 2^5 : 32
+      1   // The number of classes per doubling - 2^1 : 2
+  );
+
+  // 16: 32, 24: 16, 32: 16, 48: 8, 64: 8, with 16 byte headers.
+  REQUIRE_EQ(sizeof(preallocated_rmp_buffer),
+             32 * 32 + 16 * 40 + 16 * 48 + 8 * 64 + 8 * 80);
+  REQUIRE_EQ(CALCULATE_STATIC_SPACED_RMEMPOOL_BUFFER_SIZE(4, 6, 7, 0),
+             CALCULATE_STATIC_RMEMPOOL_BUFFER_SIZE(4, 6, 7));
+
+  r_mempool* rmp = r_mempool_create_spaced_from_preallocated_buffer(
+      preallocated_rmp_buffer, sizeof(preallocated_rmp_buffer), 4, 6, 5, 1,
+      fallback_disabled, false);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  uint32_t ptrs_len = 80;
+  void* ptrs[ptrs_len];
+
+  for (uint32_t i = 0; i < ptrs_len; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 8);
+    REQUIRE_NE((void*)ptrs[i], NULL);
+  }
+
+  uint32_t sizes[] = {16, 24, 32, 48, 64};
+  for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    REQUIRE_EQ(r_mempool_used_count(rmp, sizes[i]),
+               r_mempool_total_capacity(rmp, sizes[i]));
+  }
+
+  void* tmp_ptr = r_mempool_alloc_entry(rmp, 8);
+  REQUIRE_EQ((void*)tmp_ptr, NULL);
+
+  for (uint32_t i = 0; i < ptrs_len; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
+
+  // A buffer sized for the power of two classes doesn't fit.
+  r_mempool_destroy(rmp);
+  rmp = r_mempool_create_spaced_from_preallocated_buffer(
+      preallocated_rmp_buffer, sizeof(preallocated_rmp_buffer), 4, 6, 5, 0,
+      fallback_disabled, false);
+  REQUIRE_EQ((void*)rmp, NULL);
+}
+
+TEST(static_r_mempools, create_with_classes) {
+  static uint8_t buffer[CALCULATE_STATIC_RMEMPOOL_CLASS_BUFFER_SIZE(64, 32) +
+                        CALCULATE_STATIC_RMEMPOOL_CLASS_BUFFER_SIZE(512, 4)];
+  r_mempool_class_spec specs[] = {{64, 32}, {512, 4}};
+  REQUIRE_EQ(r_mempool_classes_buffer_size(specs, 2), sizeof(buffer));
+
+  // The buffer should match the classes exactly.
+  r_mempool* rmp = r_mempool_create_with_classes_from_preallocated_buffer(
+      buffer, sizeof(buffer) - 1, specs, 2, fallback_disabled, true);
+  REQUIRE_EQ((void*)rmp, NULL);
+
+  rmp = r_mempool_create_with_classes_from_preallocated_buffer(
+      buffer, sizeof(buffer), specs, 2, fallback_disabled, true);
+  REQUIRE_NE((void*)rmp, NULL);
+
+  void* ptrs[36];
+  for (uint32_t i = 0; i < 36; ++i) {
+    ptrs[i] = r_mempool_alloc_entry(rmp, 8);
+    REQUIRE_NE(ptrs[i], NULL);
+    REQUIRE_TRUE((uint8_t*)ptrs[i] >= buffer &&
+                 (uint8_t*)ptrs[i] < buffer + sizeof(buffer));
+  }
+  REQUIRE_EQ(r_mempool_alloc_entry(rmp, 8), NULL);
+
+  for (uint32_t i = 0; i < 36; ++i) {
+    r_mempool_free_entry(ptrs[i]);
+  }
+  REQUIRE_EQ(r_mempool_used_count(rmp, 64), 0);
+  REQUIRE_EQ(r_mempool_used_count(rmp, 512), 0);
+
+  r_mempool_destroy(rmp);
+}
+
 TEST(static_r_mempools, exhaust_all_fallback_disabled_no_locks) {
   DECLARE_STATIC_RMEMPOOL_BUFFER(
       preallocated_rmp_buffer,  // The name of the buffer.
@@ -1324,3 +3920,205 @@ TEST(static_r_mempools, exhaust_all_fallback_disabled_no_locks) {
 
   r_mempool_destroy(rmp);
 }
+
+// MALLOC SHIM TESTS
+// These hold for any malloc, they check libcmempool_malloc.so when the
+// tests run under it, see the shim_test target.
+
+TEST(malloc_shim, sizes_across_the_tiers) {
+  // From the smallest class up to the mapped sizes
+  for (size_t size = 0; size <= (1u << 20); size = size * 2 + 1) {
+    uint8_t* ptr = (uint8_t*)malloc(size);
+    REQUIRE_NE((void*)ptr, NULL);
+    REQUIRE_EQ((uintptr_t)ptr % 16, 0);
+    REQUIRE_GE(malloc_usable_size(ptr), size);
+    memset(ptr, 0xab, malloc_usable_size(ptr));
+    free(ptr);
+  }
+
+  uint8_t* ptr = (uint8_t*)calloc(1000, 100);
+  REQUIRE_NE((void*)ptr, NULL);
+  for (uint32_t i = 0; i < 1000 * 100; ++i) {
+    REQUIRE_EQ(ptr[i], 0);
+  }
+  free(ptr);
+
+  free(NULL);
+  REQUIRE_EQ(malloc_usable_size(NULL), 0);
+}
+
+TEST(malloc_shim, aligned_allocations) {
+  for (size_t alignment = 8; alignment <= 8192; alignment *= 2) {
+    for (size_t size = 1; size <= 100000; size *= 10) {
+      void* ptr = NULL;
+      REQUIRE_EQ(posix_memalign(&ptr, alignment, size), 0);
+      REQUIRE_EQ((uintptr_t)ptr % alignment, 0);
+      REQUIRE_GE(malloc_usable_size(ptr), size);
+      memset(ptr, 0xcd, size);
+
+      // C11 wants the size to be a multiple of the alignment.
+      void* other =
+          aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+      REQUIRE_EQ((uintptr_t)other % alignment, 0);
+      memset(other, 0xcd, size);
+
+      // The aligned entries grow like any other.
+      ptr = realloc(ptr, size * 3);
+      REQUIRE_NE(ptr, NULL);
+      REQUIRE_EQ(((uint8_t*)ptr)[size - 1], 0xcd);
+
+      free(ptr);
+      free(other);
+    }
+  }
+
+  void* ptr = memalign(64, 100);
+  REQUIRE_EQ((uintptr_t)ptr % 64, 0);
+  free(ptr);
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  ptr = valloc(100);
+  REQUIRE_EQ((uintptr_t)ptr % page_size, 0);
+  free(ptr);
+  ptr = pvalloc(100);
+  REQUIRE_EQ((uintptr_t)ptr % page_size, 0);
+  REQUIRE_GE(malloc_usable_size(ptr), (size_t)page_size);
+  free(ptr);
+}
+
+TEST(malloc_shim, realloc_keeps_the_contents) {
+  REQUIRE_EQ(realloc(malloc(16), 0), NULL);
+
+  uint8_t* ptr = (uint8_t*)realloc(NULL, 1);
+  REQUIRE_NE((void*)ptr, NULL);
+  ptr[0] = 0;
+
+  // Growing through the classes and into the mapped sizes, and back.
+  size_t size = 1;
+  for (; size < (1u << 22); size *= 3) {
+    ptr = (uint8_t*)realloc(ptr, size * 3);
+    REQUIRE_NE((void*)ptr, NULL);
+    for (size_t i = 0; i < size; i += size / 16 + 1) {
+      REQUIRE_EQ(ptr[i], (uint8_t)(i % 251));
+    }
+    for (size_t i = 0; i < size * 3; ++i) {
+      ptr[i] = (uint8_t)(i % 251);
+    }
+  }
+  for (; size > 1; size /= 3) {
+    ptr = (uint8_t*)realloc(ptr, size);
+    REQUIRE_NE((void*)ptr, NULL);
+    for (size_t i = 0; i < size; i += size / 16 + 1) {
+      REQUIRE_EQ(ptr[i], (uint8_t)(i % 251));
+    }
+  }
+
+  free(ptr);
+}
+
+static void* malloc_shim_worker(void* arg) {
+  uint32_t state = (uint32_t)(uintptr_t)arg;
+  void* ptrs[256] = {NULL};
+
+  for (uint32_t i = 0; i < 100000; ++i) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    uint32_t slot = state % 256;
+    free(ptrs[slot]);
+    ptrs[slot] = malloc(state % 4096);
+    if (!ptrs[slot]) {
+      return arg;
+    }
+  }
+
+  for (uint32_t i = 0; i < 256; ++i) {
+    free(ptrs[i]);
+  }
+
+  return NULL;
+}
+
+TEST(malloc_shim, multiple_threads) {
+  pthread_t threads[8];
+
+  for (uintptr_t i = 0; i < 8; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, malloc_shim_worker,
+                              (void*)(0x9e3779b9 + i)),
+               0);
+  }
+  for (uint32_t i = 0; i < 8; ++i) {
+    void* result = NULL;
+    pthread_join(threads[i], &result);
+    REQUIRE_EQ(result, NULL);
+  }
+}
+
+static bool malloc_shim_forks_done = false;
+
+static void* malloc_shim_fork_worker(void* arg) {
+  uint32_t state = (uint32_t)(uintptr_t)arg;
+  void* ptrs[64] = {NULL};
+
+  // Some of the sizes go beyond the largest class, so the lock of the
+  // large entries gets taken as well.
+  while (!__atomic_load_n(&malloc_shim_forks_done, __ATOMIC_RELAXED)) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    uint32_t slot = state % 64;
+    free(ptrs[slot]);
+    ptrs[slot] = malloc(state % (1 << 17));
+    if (!ptrs[slot]) {
+      return arg;
+    }
+  }
+
+  for (uint32_t i = 0; i < 64; ++i) {
+    free(ptrs[i]);
+  }
+
+  return NULL;
+}
+
+TEST(malloc_shim, fork_while_allocating) {
+  pthread_t threads[4];
+
+  for (uintptr_t i = 0; i < 4; ++i) {
+    REQUIRE_EQ(pthread_create(&threads[i], NULL, malloc_shim_fork_worker,
+                              (void*)(0x7f4a7c15 + i)),
+               0);
+  }
+
+  // The locks the workers hold at the time of the forks must not stay
+  // taken in the children.
+  for (uint32_t i = 0; i < 64; ++i) {
+    pid_t pid = fork();
+    REQUIRE_NE(pid, -1);
+    if (pid == 0) {
+      for (size_t size = 1; size <= (1 << 20); size *= 3) {
+        void* ptr = malloc(size);
+        if (!ptr) {
+          _exit(1);
+        }
+        memset(ptr, 0x42, size);
+        free(ptr);
+      }
+      _exit(0);
+    }
+
+    int status = 0;
+    REQUIRE_EQ(waitpid(pid, &status, 0), pid);
+    REQUIRE_TRUE(WIFEXITED(status));
+    REQUIRE_EQ(WEXITSTATUS(status), 0);
+  }
+
+  __atomic_store_n(&malloc_shim_forks_done, true, __ATOMIC_RELAXED);
+  for (uint32_t i = 0; i < 4; ++i) {
+    void* result = NULL;
+    pthread_join(threads[i], &result);
+    REQUIRE_EQ(result, NULL);
+  }
+}